@@ -0,0 +1,130 @@
+/* Author: Calvin Kerns
+ * Bump allocator for everything a command line needs while it runs:
+ * expanded text, argv arrays and pipeline state
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#define ARENA_CHUNK 65536
+#define ARENA_ALIGN 16
+
+//memory for the line being run, reset after each top level line
+Arena lineArena;
+
+//allocation counts reported by USH_STATS
+long statArenaAllocs;
+long statChunkMallocs;
+long statHeapAllocs;
+long statEnvBuilds;
+
+static size_t alignUp(size_t size){
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+/*move on to a chunk with room for size bytes, reusing the one after the
+current chunk when it is big enough and putting a new one there otherwise*/
+static int nextChunk(Arena *a, size_t size){
+    ArenaChunk *next = a->current ? a->current->next : a->first;
+    if((next != NULL) && (next->size >= size)){
+        next->used = 0;
+        a->current = next;
+        return 0;
+    }
+    size_t chunkSize = (size > ARENA_CHUNK) ? size : ARENA_CHUNK;
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + chunkSize);
+    if(chunk == NULL){
+        perror("arena malloc");
+        return -1;
+    }
+    statChunkMallocs += 1;
+    chunk->size = chunkSize;
+    chunk->used = 0;
+    chunk->next = next;
+    if(a->current != NULL){
+        a->current->next = chunk;
+    }
+    else{
+        a->first = chunk;
+    }
+    a->current = chunk;
+    return 0;
+}
+
+//size bytes that stay good until the arena is released past them, NULL if out of memory
+void *arenaAlloc(Arena *a, size_t size){
+    size = alignUp(size ? size : 1);
+    if((a->current == NULL) || (a->current->size - a->current->used < size)){
+        if(nextChunk(a, size) != 0){
+            return NULL;
+        }
+    }
+    void *mem = a->current->data + a->current->used;
+    a->current->used += size;
+    statArenaAllocs += 1;
+    return mem;
+}
+
+/*resize an allocation from oldSize to newSize bytes. The newest allocation
+grows in place when its chunk has room, anything else is copied and the old
+space is just left until the next release*/
+void *arenaGrow(Arena *a, void *mem, size_t oldSize, size_t newSize){
+    ArenaChunk *chunk = a->current;
+    if((mem != NULL) && (chunk != NULL) && ((char *)mem >= chunk->data) &&
+       ((char *)mem + alignUp(oldSize) == chunk->data + chunk->used)){
+        size_t start = (char *)mem - chunk->data;
+        if(chunk->size - start >= alignUp(newSize)){
+            chunk->used = start + alignUp(newSize);
+            return mem;
+        }
+    }
+    void *grown = arenaAlloc(a, newSize);
+    if((grown != NULL) && (mem != NULL)){
+        memcpy(grown, mem, (oldSize < newSize) ? oldSize : newSize);
+    }
+    return grown;
+}
+
+//remember how far the arena is used so it can be released back to here
+ArenaMark arenaMark(Arena *a){
+    ArenaMark mark;
+    mark.chunk = a->current;
+    mark.used = a->current ? a->current->used : 0;
+    return mark;
+}
+
+//free everything allocated since mark, the chunks are kept for reuse
+void arenaRelease(Arena *a, ArenaMark mark){
+    a->current = mark.chunk;
+    if(mark.chunk != NULL){
+        mark.chunk->used = mark.used;
+    }
+}
+
+/*free everything, keeping only the first chunk so one huge line doesn't
+hold on to its memory for the rest of the session*/
+void arenaReset(Arena *a){
+    if(a->first == NULL){
+        return;
+    }
+    ArenaChunk *chunk = a->first->next;
+    while(chunk != NULL){
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    a->first->next = NULL;
+    a->first->used = 0;
+    a->current = NULL;
+}
+
+//print allocation counts and peak memory to stderr, set up by USH_STATS
+void reportStats(void){
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr, "ush: %ld arena allocations in %ld chunks, %ld heap buffer allocations, %ld environments built, peak RSS %ld KB\n",
+            statArenaAllocs, statChunkMallocs, statHeapAllocs, statEnvBuilds, usage.ru_maxrss);
+}
@@ -0,0 +1,92 @@
+/* Author: Calvin Kerns
+ * Benchmark for $() output capture: the old one byte per read() loop
+ * against captureOutput(). Usage: capture_bench [megabytes] [rounds]
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+//fork a child that writes megs megabytes of short lines to a pipe
+static int startWriter(long megs, pid_t *pid){
+    int fd[2];
+    if(pipe(fd) != 0){
+        perror("pipe");
+        exit(1);
+    }
+    *pid = fork();
+    if(*pid == 0){
+        char block[65536];
+        for(size_t i = 0; i < sizeof(block); i++){
+            block[i] = (i % 64 == 63) ? '\n' : 'a' + (i % 26);
+        }
+        close(fd[0]);
+        for(long i = 0; i < megs * 16; i++){
+            if(write(fd[1], block, sizeof(block)) != (ssize_t)sizeof(block)){
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    close(fd[1]);
+    return fd[0];
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//the loop expand() used before the capture engine
+static long byteLoop(int fd, Buffer *out){
+    char c[1];
+    int spaceReplaced = 0;
+    while(read(fd, c, 1) == 1){
+        if(c[0] == '\n'){
+            bufPutc(out, ' ');
+            spaceReplaced = 1;
+        }
+        else{
+            bufPutc(out, c[0]);
+            spaceReplaced = 0;
+        }
+    }
+    if(spaceReplaced){
+        bufTruncate(out, out->len - 1);
+    }
+    return out->len;
+}
+
+static void run(const char *name, long (*capture)(int, Buffer *), long megs, int rounds){
+    double best = 0;
+    long bytes = 0;
+    for(int r = 0; r < rounds; r++){
+        pid_t pid;
+        Buffer out;
+        bufInit(&out);
+        int fd = startWriter(megs, &pid);
+        double start = now();
+        bytes = capture(fd, &out);
+        double rate = bytes / (now() - start);
+        close(fd);
+        waitpid(pid, NULL, 0);
+        bufFree(&out);
+        if(rate > best){
+            best = rate;
+        }
+    }
+    printf("%-10s %10ld bytes %12.1f MB/s\n", name, bytes, best / 1e6);
+}
+
+int main(int argc, char **argv){
+    long megs = (argc > 1) ? atol(argv[1]) : 16;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 3;
+    run("bytewise", byteLoop, megs, rounds);
+    run("chunked", captureOutput, megs, rounds);
+    return 0;
+}
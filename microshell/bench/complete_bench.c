@@ -0,0 +1,116 @@
+/* Author: Calvin Kerns
+ * Benchmark for tab completion: a PATH directory of many executables is
+ * made, the command trie is built for it in the background and then
+ * completions of short and long prefixes are timed, along with how soon a
+ * command added or removed afterwards shows up.
+ * Usage: complete_bench [executables] [rounds]
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+static char binDir[] = "/tmp/complete_benchXXXXXX";
+
+//complete.c and glob.c only need these from the rest of the shell
+int sigINT;
+const char *builtinNames[] = {"exit", "echo", "export", "history", NULL};
+
+char *getVar(const char *name){
+    return (strcmp(name, "PATH") == 0) ? binDir : NULL;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void makeCommand(const char *name){
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", binDir, name);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+    if(fd < 0){
+        perror(path);
+        exit(1);
+    }
+    close(fd);
+}
+
+//how many choices line completes to, and the slowest and mean time of rounds tries
+static long timeCompletion(const char *line, int rounds, double *worst, double *mean){
+    long count = 0;
+    double total = 0;
+    *worst = 0;
+    for(int i = 0; i < rounds; i++){
+        size_t start;
+        Buffer replace;
+        Buffer list;
+        bufInit(&replace);
+        bufInit(&list);
+        double begin = now();
+        count = completeLine(line, strlen(line), 120, &start, &replace, &list);
+        double took = now() - begin;
+        total += took;
+        *worst = (took > *worst) ? took : *worst;
+        bufFree(&replace);
+        bufFree(&list);
+    }
+    *mean = total / rounds;
+    return count;
+}
+
+int main(int argc, char **argv){
+    long commands = (argc > 1) ? atol(argv[1]) : 20000;
+    int rounds = (argc > 2) ? atoi(argv[2]) : 200;
+    if(mkdtemp(binDir) == NULL){
+        perror("mkdtemp");
+        return 1;
+    }
+    //names sharing prefixes the way real tool families do
+    static const char *families[] = {"git-", "x86_64-linux-gnu-", "python3.", "kube", "perl5.", "lib", "z", "a"};
+    char name[128];
+    for(long i = 0; i < commands; i++){
+        snprintf(name, sizeof(name), "%s%ld", families[i % 8], i / 8);
+        makeCommand(name);
+    }
+
+    double start = now();
+    startCommandTrie();
+    double started = now() - start;
+    double worst;
+    double mean;
+    start = now();
+    long count = timeCompletion("g", 1, &worst, &mean);
+    printf("%ld executables, startCommandTrie %.3f ms, first completion waiting for the build %.1f ms\n",
+           commands, started * 1e3, (now() - start) * 1e3);
+    printf("%-28s %10s %10s %10s\n", "line", "choices", "mean us", "worst us");
+    static const char *lines[] = {"g", "git-", "git-12", "x86_64-linux-gnu-99", "kube2499", "nosuch", "echo git-1"};
+    for(size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++){
+        count = timeCompletion(lines[i], rounds, &worst, &mean);
+        printf("%-28s %10ld %10.1f %10.1f\n", lines[i], count, mean * 1e6, worst * 1e6);
+    }
+
+    //a new command is seen on the next completion, no rebuild needed
+    makeCommand("zz_added_tool");
+    count = timeCompletion("zz_added", 1, &worst, &mean);
+    printf("%-28s %10ld %10.1f   after creating it\n", "zz_added", count, worst * 1e6);
+    snprintf(name, sizeof(name), "%s/zz_added_tool", binDir);
+    unlink(name);
+    count = timeCompletion("zz_added", 1, &worst, &mean);
+    printf("%-28s %10ld %10.1f   after removing it\n", "zz_added", count, worst * 1e6);
+
+    pid_t pid = fork();
+    if(pid == 0){
+        execlp("rm", "rm", "-rf", binDir, (char *)NULL);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/* Author: Calvin Kerns
+ * Lines per second of a script of echo lines, with the echo builtin and
+ * with /bin/echo, which costs a spawn per line.
+ * Usage: echo_bench [ush binary] [builtin lines] [external lines]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//write a script of lines copies of "command hello world N"
+static void writeScript(const char *path, const char *command, long lines){
+    FILE *script = fopen(path, "w");
+    if(script == NULL){
+        perror(path);
+        exit(1);
+    }
+    for(long i = 0; i < lines; i++){
+        fprintf(script, "%s hello world %ld\n", command, i);
+    }
+    fclose(script);
+}
+
+//run ush on script with its output thrown away, returns seconds
+static double runScript(const char *ush, const char *script){
+    double start = now();
+    pid_t pid = fork();
+    if(pid == 0){
+        //time the lines, not the script cache
+        setenv("USH_NOCACHE", "1", 1);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execl(ush, ush, script, (char *)NULL);
+        perror("exec");
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0)){
+        fprintf(stderr, "echo_bench: %s failed\n", ush);
+        exit(1);
+    }
+    return now() - start;
+}
+
+int main(int argc, char **argv){
+    const char *ush = (argc > 1) ? argv[1] : "./ush";
+    long builtinLines = (argc > 2) ? atol(argv[2]) : 100000;
+    long externalLines = (argc > 3) ? atol(argv[3]) : 10000;
+    char path[] = "/tmp/echo_benchXXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+
+    writeScript(path, "echo", builtinLines);
+    double builtin = runScript(ush, path);
+    writeScript(path, "/bin/echo", externalLines);
+    double external = runScript(ush, path);
+    unlink(path);
+
+    printf("%-10s %10s %10s %14s\n", "echo", "lines", "seconds", "lines/s");
+    printf("%-10s %10ld %10.3f %14.0f\n", "builtin", builtinLines, builtin, builtinLines / builtin);
+    printf("%-10s %10ld %10.3f %14.0f\n", "/bin/echo", externalLines, external, externalLines / external);
+    return 0;
+}
@@ -0,0 +1,115 @@
+/* Author: Calvin Kerns
+ * Benchmark for history search: a generated history of many entries,
+ * searched newest first through the trigram index and by looking at every
+ * entry from the end the way a plain history list is searched. Also times
+ * indexing the whole file and mapping the saved index in a new shell.
+ * Usage: history_bench [entries]
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static char histFile[] = "/tmp/history_benchXXXXXX";
+
+//history.c only needs these from the rest of the shell
+char *getVar(const char *name){
+    return (strcmp(name, "USH_HISTFILE") == 0) ? histFile : NULL;
+}
+
+int writeAll(int fd, const char *data, size_t len){
+    while(len > 0){
+        ssize_t wrote = write(fd, data, len);
+        if(wrote <= 0){
+            return -1;
+        }
+        data += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//newest entry before before containing text, looking at each one in turn
+static long linearSearch(const char *text, long before){
+    size_t len = strlen(text);
+    for(long id = before - 1; id >= 0; id--){
+        size_t entryLen;
+        const char *entry = historyEntry(id, &entryLen);
+        if(memmem(entry, entryLen, text, len) != NULL){
+            return id;
+        }
+    }
+    return -1;
+}
+
+//time the first historyCount in a fresh process, which indexes or maps
+static void timeOpen(const char *what){
+    pid_t pid = fork();
+    if(pid == 0){
+        double start = now();
+        long count = historyCount();
+        printf("%-24s %10.1f ms  %ld entries\n", what, (now() - start) * 1e3, count);
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv){
+    long entries = (argc > 1) ? atol(argv[1]) : 1000000;
+    int fd = mkstemp(histFile);
+    if(fd < 0){
+        perror("mkstemp");
+        return 1;
+    }
+    FILE *out = fdopen(fd, "w");
+    static const char *commands[] = {"git commit -m \"fix issue %ld\"", "cd /srv/app%ld/releases",
+                                     "ssh deploy@host%ld.example.com", "make -j8 target%ld",
+                                     "kubectl get pods -n team%ld", "grep -rn pattern%ld src/"};
+    srand(1);
+    for(long i = 0; i < entries; i++){
+        fprintf(out, commands[rand() % 6], (long)(rand() % 100000));
+        fputc('\n', out);
+    }
+    fclose(out);
+
+    timeOpen("index whole history");
+    timeOpen("map saved index");
+
+    static const char *queries[] = {"host4242", "fix issue 31337", "team99 ", "no such command", "target1", "cd /srv"};
+    long count = historyCount();
+    printf("%-24s %12s %12s %8s\n", "query", "index us", "linear us", "matches");
+    for(size_t q = 0; q < sizeof(queries) / sizeof(queries[0]); q++){
+        //every match, newest first, like holding down ^R
+        long matches = 0;
+        double start = now();
+        for(long id = historySearch(queries[q], -1); (id >= 0) && (matches < 1000); id = historySearch(queries[q], id)){
+            matches += 1;
+        }
+        double indexed = now() - start;
+        long linearMatches = 0;
+        start = now();
+        for(long id = linearSearch(queries[q], count); (id >= 0) && (linearMatches < 1000); id = linearSearch(queries[q], id)){
+            linearMatches += 1;
+        }
+        double linear = now() - start;
+        printf("%-24s %12.1f %12.1f %8ld%s\n", queries[q], indexed * 1e6, linear * 1e6, matches,
+               (matches == linearMatches) ? "" : "  MISMATCH");
+    }
+    unlink(histFile);
+    char index[64];
+    snprintf(index, sizeof(index), "%s.idx", histFile);
+    unlink(index);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/* Author: Calvin Kerns
+ * Seconds to run a script of long echo lines with each version of the
+ * lexer, forced through USH_LEX. The lines are mostly plain words, then a
+ * quoted string, a ; and a comment, like generated scripts.
+ * Usage: lex_bench [ush binary] [lines] [words per line]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void writeScript(const char *path, long lines, long words){
+    FILE *script = fopen(path, "w");
+    if(script == NULL){
+        perror(path);
+        exit(1);
+    }
+    for(long i = 0; i < lines; i++){
+        fputs("echo", script);
+        for(long w = 0; w < words; w++){
+            fprintf(script, " --generated-option-%ld=some/long/path/component_%ld.dat", w, i);
+        }
+        fprintf(script, " \"quoted words %ld\"; true # trailing comment %ld\n", i, i);
+    }
+    fclose(script);
+}
+
+//run ush on script with USH_LEX=version and its output thrown away, returns seconds
+static double runScript(const char *ush, const char *script, const char *version){
+    double start = now();
+    pid_t pid = fork();
+    if(pid == 0){
+        setenv("USH_NOCACHE", "1", 1);
+        setenv("USH_LEX", version, 1);
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execl(ush, ush, script, (char *)NULL);
+        perror("exec");
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0)){
+        fprintf(stderr, "lex_bench: %s failed\n", ush);
+        exit(1);
+    }
+    return now() - start;
+}
+
+int main(int argc, char **argv){
+    const char *ush = (argc > 1) ? argv[1] : "./ush";
+    long lines = (argc > 2) ? atol(argv[2]) : 20000;
+    long words = (argc > 3) ? atol(argv[3]) : 40;
+    const char *versions[] = {"scalar", "sse2", "avx2"};
+    char path[] = "/tmp/lex_benchXXXXXX";
+    int fd = mkstemp(path);
+    if(fd < 0){
+        perror("mkstemp");
+        return 1;
+    }
+    close(fd);
+    writeScript(path, lines, words);
+
+    printf("%ld lines of %ld words\n", lines, words);
+    printf("%-8s %10s %14s\n", "lexer", "seconds", "lines/s");
+    for(size_t i = 0; i < sizeof(versions) / sizeof(versions[0]); i++){
+        double seconds = runScript(ush, path, versions[i]);
+        printf("%-8s %10.3f %14.0f\n", versions[i], seconds, lines / seconds);
+    }
+    unlink(path);
+    return 0;
+}
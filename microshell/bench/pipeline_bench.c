@@ -0,0 +1,68 @@
+/* Author: Calvin Kerns
+ * Throughput of ush pipelines from 2 to 64 stages of cat, with the default
+ * pipe size and with USH_PIPE_SIZE.
+ * Usage: pipeline_bench [ush binary] [megabytes] [pipe size]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//run ush -c line, output thrown away, with USH_PIPE_SIZE set to pipeSize (unset for NULL), returns seconds
+static double runShell(const char *ush, const char *line, const char *pipeSize){
+    double start = now();
+    pid_t pid = fork();
+    if(pid == 0){
+        if(pipeSize != NULL){
+            setenv("USH_PIPE_SIZE", pipeSize, 1);
+        }
+        else{
+            unsetenv("USH_PIPE_SIZE");
+        }
+        //only the timing is of interest, not wc's count
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        execl(ush, ush, "-c", line, (char *)NULL);
+        perror("exec");
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0)){
+        fprintf(stderr, "pipeline_bench: %s failed\n", ush);
+        exit(1);
+    }
+    return now() - start;
+}
+
+int main(int argc, char **argv){
+    const char *ush = (argc > 1) ? argv[1] : "./ush";
+    long megabytes = (argc > 2) ? atol(argv[2]) : 256;
+    const char *pipeSize = (argc > 3) ? argv[3] : "1048576";
+    static const int stages[] = {2, 4, 8, 16, 32, 64};
+    char line[4096];
+
+    printf("%ld MB through head | cat ... | wc, USH_PIPE_SIZE=%s\n", megabytes, pipeSize);
+    printf("%6s %14s %14s\n", "stages", "default MB/s", "tuned MB/s");
+    for(size_t i = 0; i < sizeof(stages) / sizeof(stages[0]); i++){
+        int len = snprintf(line, sizeof(line), "head -c %ldM /dev/zero", megabytes);
+        for(int j = 0; j < stages[i] - 2; j++){
+            len += snprintf(line + len, sizeof(line) - len, " | cat");
+        }
+        snprintf(line + len, sizeof(line) - len, " | wc -c");
+        double plain = runShell(ush, line, NULL);
+        double tuned = runShell(ush, line, pipeSize);
+        printf("%6d %14.1f %14.1f\n", stages[i], megabytes / plain, megabytes / tuned);
+    }
+    return 0;
+}
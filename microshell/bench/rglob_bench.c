@@ -0,0 +1,94 @@
+/* Author: Calvin Kerns
+ * ** glob against find on a large tree.
+ * Usage: rglob_bench [dir] [files]
+ * Builds dir with the given number of files (1000000 by default, spread
+ * over 1000 directories per level) the first time it is run.
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+
+int sigINT;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+//dir/aNN/bNNN/fileNNNN.c or .h, 1000 files per leaf directory
+static void buildTree(const char *dir, long files){
+    char path[4096];
+    struct stat stats;
+    snprintf(path, sizeof(path), "%s/.built_%ld", dir, files);
+    if(stat(path, &stats) == 0){
+        return;
+    }
+    printf("building %ld files under %s\n", files, dir);
+    mkdir(dir, 0755);
+    for(long i = 0; i < files; i++){
+        long leaf = i / 1000;
+        if(i % 1000 == 0){
+            snprintf(path, sizeof(path), "%s/a%02ld", dir, leaf / 100);
+            mkdir(path, 0755);
+            snprintf(path, sizeof(path), "%s/a%02ld/b%03ld", dir, leaf / 100, leaf % 100);
+            mkdir(path, 0755);
+        }
+        snprintf(path, sizeof(path), "%s/a%02ld/b%03ld/file%04ld.%c", dir, leaf / 100, leaf % 100,
+                 i % 1000, (i % 2) ? 'c' : 'h');
+        int fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if(fd >= 0){
+            close(fd);
+        }
+    }
+    snprintf(path, sizeof(path), "%s/.built_%ld", dir, files);
+    close(open(path, O_CREAT | O_WRONLY, 0644));
+}
+
+//run find and read all of its output, the way a script capturing it would
+static long runFind(const char *dir, const char *name){
+    char cmd[4096];
+    char line[4096];
+    long count = 0;
+    snprintf(cmd, sizeof(cmd), "find %s -name '%s' -not -path '*/.*' | sort", dir, name);
+    FILE *found = popen(cmd, "r");
+    while(fgets(line, sizeof(line), found) != NULL){
+        count += 1;
+    }
+    pclose(found);
+    return count;
+}
+
+int main(int argc, char **argv){
+    const char *dir = (argc > 1) ? argv[1] : "/tmp/rglob_tree";
+    long files = (argc > 2) ? atol(argv[2]) : 1000000;
+    char pattern[4096];
+
+    buildTree(dir, files);
+    snprintf(pattern, sizeof(pattern), "%s/**/*.c", dir);
+
+    for(int round = 0; round < 2; round++){
+        double start = now();
+        //the call expandArgs makes for a word with a glob in it
+        long matches;
+        char **paths = globList(pattern, &matches);
+        double globTime = now() - start;
+        free(paths);
+        //the matched paths were put on the line arena
+        arenaReset(&lineArena);
+
+        start = now();
+        long found = runFind(dir, "*.c");
+        double findTime = now() - start;
+
+        printf("round %d: ** glob %ld paths %.3f s, find|sort %ld paths %.3f s\n",
+               round + 1, matches, globTime, found, findTime);
+    }
+    return 0;
+}
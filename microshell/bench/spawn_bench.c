@@ -0,0 +1,102 @@
+/* Author: Calvin Kerns
+ * Spawn latency of launchCommand() in fork and posix_spawn mode.
+ * Usage: spawn_bench [iterations] [ballast megabytes]
+ * The ballast is touched heap memory standing in for a shell that has
+ * grown, which is what makes fork slow.
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+//spawn.o's builtin and redirection paths aren't timed, these stand in for the rest of the shell
+extern char **environ;
+int numberReplace;
+
+char **varEnviron(void){
+    return environ;
+}
+
+int hashCommand(const char *name){
+    (void)name;
+    return 0;
+}
+
+char *lookupCommand(const char *name){
+    return (char *)name;
+}
+
+int traceOn;
+
+long traceBegin(int kind, const char *name){
+    (void)kind; (void)name;
+    return -1;
+}
+
+void traceEnd(long seq){
+    (void)seq;
+}
+
+void traceStop(void){
+}
+
+int execBuiltin(char **args, int argNumber, int infd, int outfd){
+    (void)args; (void)argNumber; (void)infd; (void)outfd;
+    return 0;
+}
+
+int applyRedirects(const Redirects *redirs){
+    (void)redirs;
+    return 0;
+}
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpDouble(const void *a, const void *b){
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//time spawn to exit of /bin/true iterations times and print percentiles
+static void run(const char *name, int mode, int iterations){
+    char *argv[] = {"true", NULL};
+    double *lat = malloc(sizeof(double) * iterations);
+    spawnMode = mode;
+    for(int i = 0; i < iterations; i++){
+        double start = now();
+        pid_t pid = launchCommand("/bin/true", argv, 0, 1, NULL, -1);
+        if(pid < 0){
+            exit(1);
+        }
+        waitpid(pid, NULL, 0);
+        lat[i] = (now() - start) * 1e6;
+    }
+    qsort(lat, iterations, sizeof(double), cmpDouble);
+    printf("%-6s p50 %8.1f us  p90 %8.1f us  p99 %8.1f us  max %8.1f us\n", name,
+           lat[iterations / 2], lat[iterations * 90 / 100],
+           lat[iterations * 99 / 100], lat[iterations - 1]);
+    free(lat);
+}
+
+int main(int argc, char **argv){
+    int iterations = (argc > 1) ? atoi(argv[1]) : 2000;
+    long ballast = (argc > 2) ? atol(argv[2]) : 256;
+    char *heap = malloc(ballast << 20);
+    if(heap != NULL){
+        memset(heap, 1, ballast << 20);
+    }
+    printf("%d spawns of /bin/true, %ld MB resident ballast\n", iterations, ballast);
+    run("fork", SPAWN_FORK, iterations);
+    run("spawn", SPAWN_POSIX, iterations);
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,408 @@
+/* Author: Calvin Kerns
+ * End to end benchmarks of a ush binary on generated workloads: a 100k
+ * line script, deep and wide pipelines, $( ) and ${VAR} heavy scripts and
+ * globs over directories of 10k and 100k files. Every workload is a
+ * number of iterations, a batch of lines each, and the script prints a
+ * mark after each one so the time every iteration took can be taken from
+ * when its mark comes in. Workloads are run several times and reported as
+ * one JSON line with p50 and p99 iteration latency over all the runs and
+ * throughput. Results can be saved as a baseline and later runs compared
+ * against it, a p50 more than the threshold slower is a regression.
+ * Usage: suite_bench [-r runs] [-s save file] [-c baseline file]
+ *                    [-t threshold percent] [-w workload] [ush binary]
+ * Exits 1 if any workload regressed.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MAX_RUNS 100
+#define MAX_RESULTS 32
+
+struct workload {
+    const char *name;
+    const char *unit;       //what throughput counts
+    double units;           //per iteration
+    int iterations;         //per run
+    char script[256];
+};
+
+struct result {
+    char name[64];
+    char unit[16];
+    double units;
+    int runs;
+    double p50;             //milliseconds per iteration
+    double p99;
+    double throughput;      //units per second over all the iterations
+    int samples;
+};
+
+static char workDir[] = "/tmp/suite_benchXXXXXX";
+static int workMade;
+
+static double now(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmpDouble(const void *a, const void *b){
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static FILE *openScript(struct workload *w, const char *name){
+    snprintf(w->script, sizeof(w->script), "%s/%s.ush", workDir, name);
+    FILE *script = fopen(w->script, "w");
+    if(script == NULL){
+        perror(w->script);
+        exit(1);
+    }
+    return script;
+}
+
+//the first mark starts the timing, each one after it ends an iteration
+static void mark(FILE *script){
+    fputs("echo mark\n", script);
+}
+
+static int wanted(const char *only, const char *name){
+    return (only == NULL) || (strcmp(only, name) == 0);
+}
+
+//a directory of count empty files for the globs to walk
+static void makeFiles(const char *dir, long count){
+    if(mkdir(dir, 0755) != 0){
+        perror(dir);
+        exit(1);
+    }
+    char path[600];
+    for(long i = 0; i < count; i++){
+        snprintf(path, sizeof(path), "%s/file%06ld.%s", dir, i, (i % 4) ? "dat" : "log");
+        int fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if(fd < 0){
+            perror(path);
+            exit(1);
+        }
+        close(fd);
+    }
+}
+
+//write the script of every workload, or only the one named only, returns how many
+static int makeWorkloads(struct workload *w, const char *only){
+    int n = 0;
+    FILE *script;
+
+    //plain lines of builtins, what the reader, lexer and expander cost
+    if(wanted(only, "script_100k")){
+        w[n] = (struct workload){"script_100k", "lines", 1000, 100, ""};
+        script = openScript(&w[n], w[n].name);
+        mark(script);
+        for(long i = 0; i < 100000; i++){
+            fprintf(script, "echo line %ld \"of the script\" > /dev/null\n", i);
+            if((i + 1) % 1000 == 0){
+                mark(script);
+            }
+        }
+        fclose(script);
+        n += 1;
+    }
+
+    //short pipelines of 16 stages one at a time, spawn and pipe setup cost
+    if(wanted(only, "pipeline_deep")){
+        w[n] = (struct workload){"pipeline_deep", "pipelines", 1, 50, ""};
+        script = openScript(&w[n], w[n].name);
+        mark(script);
+        for(int i = 0; i < 50; i++){
+            fputs("echo deep", script);
+            for(int j = 0; j < 15; j++){
+                fputs(" | cat", script);
+            }
+            fputs(" > /dev/null\n", script);
+            mark(script);
+        }
+        fclose(script);
+        n += 1;
+    }
+
+    //a lot of data through a few stages, pipe throughput
+    if(wanted(only, "pipeline_wide")){
+        w[n] = (struct workload){"pipeline_wide", "MB", 16, 16, ""};
+        script = openScript(&w[n], w[n].name);
+        mark(script);
+        for(int i = 0; i < 16; i++){
+            fputs("head -c 16M /dev/zero | cat | cat | cat > /dev/null\n", script);
+            mark(script);
+        }
+        fclose(script);
+        n += 1;
+    }
+
+    //command substitution, builtin and external, 10 lines an iteration
+    if(wanted(only, "subst")){
+        w[n] = (struct workload){"subst", "substitutions", 20, 50, ""};
+        script = openScript(&w[n], w[n].name);
+        mark(script);
+        for(int i = 0; i < 500; i++){
+            fprintf(script, "echo $(echo a%d) $(/bin/echo b) > /dev/null\n", i);
+            if((i + 1) % 10 == 0){
+                mark(script);
+            }
+        }
+        fclose(script);
+        n += 1;
+    }
+
+    //variable lookups with a few hundred variables set, 200 lines an iteration
+    if(wanted(only, "vars")){
+        w[n] = (struct workload){"vars", "expansions", 200 * 4, 100, ""};
+        script = openScript(&w[n], w[n].name);
+        for(int i = 0; i < 300; i++){
+            fprintf(script, "envset BENCH_VAR_%d value_%d\n", i, i);
+        }
+        mark(script);
+        for(int i = 0; i < 20000; i++){
+            fprintf(script, "echo ${BENCH_VAR_%d} ${BENCH_VAR_150} ${BENCH_VAR_299} ${HOME} > /dev/null\n", i % 300);
+            if((i + 1) % 200 == 0){
+                mark(script);
+            }
+        }
+        fclose(script);
+        n += 1;
+    }
+
+    //globs over big directories, the first one lists it and the rest hit the cache
+    static const long sizes[] = {10000, 100000};
+    static const char *names[] = {"glob_10k", "glob_100k"};
+    for(int s = 0; s < 2; s++){
+        if(!wanted(only, names[s])){
+            continue;
+        }
+        char dir[512];
+        snprintf(dir, sizeof(dir), "%s/files%ld", workDir, sizes[s]);
+        makeFiles(dir, sizes[s]);
+        w[n] = (struct workload){names[s], "globs", 1, 20, ""};
+        script = openScript(&w[n], w[n].name);
+        mark(script);
+        for(int i = 0; i < 20; i++){
+            fprintf(script, "echo %s/*%d*.dat > /dev/null\n", dir, i % 10);
+            mark(script);
+        }
+        fclose(script);
+        n += 1;
+    }
+    return n;
+}
+
+/*run ush on w's script with its output in a pipe and time every
+iteration from when its mark comes through, samples gets the seconds of
+each one*/
+static void runScript(const char *ush, const struct workload *w, double *samples){
+    int fds[2];
+    if(pipe(fds) != 0){
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        //time running the lines, not loading them from the script cache
+        setenv("USH_NOCACHE", "1", 1);
+        dup2(fds[1], 1);
+        close(fds[0]);
+        close(fds[1]);
+        execl(ush, ush, w->script, (char *)NULL);
+        perror("exec");
+        _exit(127);
+    }
+    close(fds[1]);
+    char buf[256];
+    double last = 0;
+    int marks = 0;
+    while(1){
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if((n < 0) && (errno == EINTR)){
+            continue;
+        }
+        if(n <= 0){
+            break;
+        }
+        double t = now();
+        for(ssize_t i = 0; i < n; i++){
+            if(buf[i] != '\n'){
+                continue;
+            }
+            if((marks > 0) && (marks <= w->iterations)){
+                samples[marks - 1] = t - last;
+            }
+            last = t;
+            marks += 1;
+        }
+    }
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || (WEXITSTATUS(status) != 0) || (marks != w->iterations + 1)){
+        fprintf(stderr, "suite_bench: %s %s failed\n", ush, w->script);
+        exit(1);
+    }
+}
+
+static void measure(const char *ush, const struct workload *w, int runs, struct result *r){
+    int count = runs * w->iterations;
+    double *times = malloc(count * sizeof(double));
+    if(times == NULL){
+        perror("malloc");
+        exit(1);
+    }
+    for(int i = 0; i < runs; i++){
+        runScript(ush, w, times + i * w->iterations);
+    }
+    double total = 0;
+    for(int i = 0; i < count; i++){
+        total += times[i];
+    }
+    qsort(times, count, sizeof(double), cmpDouble);
+    memset(r, 0, sizeof(struct result));
+    snprintf(r->name, sizeof(r->name), "%s", w->name);
+    snprintf(r->unit, sizeof(r->unit), "%s", w->unit);
+    r->units = w->units;
+    r->runs = runs;
+    r->samples = count;
+    r->p50 = times[count / 2] * 1e3;
+    r->p99 = times[(count * 99) / 100] * 1e3;
+    r->throughput = w->units * count / total;
+    free(times);
+}
+
+//one JSON line for r, extra is more fields to put in it
+static void printResult(FILE *out, const struct result *r, const char *extra){
+    fprintf(out, "{\"name\":\"%s\",\"unit\":\"%s\",\"units\":%.0f,\"runs\":%d,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"throughput\":%.1f,\"samples\":%d%s}\n",
+            r->name, r->unit, r->units, r->runs, r->p50, r->p99, r->throughput, r->samples, extra);
+}
+
+//read results saved with -s, returns how many or -1
+static int loadBaseline(const char *path, struct result *base){
+    FILE *in = fopen(path, "r");
+    if(in == NULL){
+        return -1;
+    }
+    char line[512];
+    int n = 0;
+    while((n < MAX_RESULTS) && (fgets(line, sizeof(line), in) != NULL)){
+        struct result *r = &base[n];
+        if(sscanf(line, "{\"name\":\"%63[^\"]\",\"unit\":\"%15[^\"]\",\"units\":%lf,\"runs\":%d,\"p50_ms\":%lf,\"p99_ms\":%lf,\"throughput\":%lf}",
+                  r->name, r->unit, &r->units, &r->runs, &r->p50, &r->p99, &r->throughput) == 7){
+            n += 1;
+        }
+    }
+    fclose(in);
+    return n;
+}
+
+//the generated files go however the run ends, exit(1) included
+static void removeWork(void){
+    if(!workMade){
+        return;
+    }
+    pid_t pid = fork();
+    if(pid == 0){
+        execlp("rm", "rm", "-rf", workDir, (char *)NULL);
+        _exit(127);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv){
+    int runs = 5;
+    const char *savePath = NULL;
+    const char *basePath = NULL;
+    const char *only = NULL;
+    double threshold = 10;
+    int opt;
+    while((opt = getopt(argc, argv, "r:s:c:t:w:")) != -1){
+        switch(opt){
+            case 'r': runs = atoi(optarg); break;
+            case 's': savePath = optarg; break;
+            case 'c': basePath = optarg; break;
+            case 't': threshold = atof(optarg); break;
+            case 'w': only = optarg; break;
+            default:
+                fprintf(stderr, "usage: suite_bench [-r runs] [-s save file] [-c baseline file] [-t threshold percent] [-w workload] [ush binary]\n");
+                return 2;
+        }
+    }
+    const char *ush = (optind < argc) ? argv[optind] : "./ush";
+    if((runs < 1) || (runs > MAX_RUNS)){
+        fprintf(stderr, "suite_bench: runs must be 1 to %d\n", MAX_RUNS);
+        return 2;
+    }
+    char ushPath[4096];
+    if(realpath(ush, ushPath) == NULL){
+        perror(ush);
+        return 2;
+    }
+
+    struct result base[MAX_RESULTS];
+    int baseCount = 0;
+    if(basePath != NULL){
+        baseCount = loadBaseline(basePath, base);
+        if(baseCount < 0){
+            fprintf(stderr, "suite_bench: no baseline at %s, save one with -s\n", basePath);
+            baseCount = 0;
+        }
+    }
+    FILE *save = NULL;
+    if((savePath != NULL) && ((save = fopen(savePath, "w")) == NULL)){
+        perror(savePath);
+        return 2;
+    }
+
+    if(mkdtemp(workDir) == NULL){
+        perror("mkdtemp");
+        return 1;
+    }
+    workMade = 1;
+    atexit(removeWork);
+    fprintf(stderr, "suite_bench: generating workloads in %s\n", workDir);
+    struct workload workloads[MAX_RESULTS];
+    int count = makeWorkloads(workloads, only);
+    if(count == 0){
+        fprintf(stderr, "suite_bench: no workload named %s\n", only);
+        return 2;
+    }
+
+    int regressed = 0;
+    for(int i = 0; i < count; i++){
+        struct result r;
+        measure(ushPath, &workloads[i], runs, &r);
+        if(save != NULL){
+            printResult(save, &r, "");
+        }
+        char comparison[128] = "";
+        for(int j = 0; j < baseCount; j++){
+            if(strcmp(base[j].name, r.name) == 0){
+                double change = (r.p50 - base[j].p50) * 100 / base[j].p50;
+                int worse = change > threshold;
+                regressed |= worse;
+                snprintf(comparison, sizeof(comparison), ",\"baseline_p50_ms\":%.3f,\"change_pct\":%.1f,\"regressed\":%s",
+                         base[j].p50, change, worse ? "true" : "false");
+                break;
+            }
+        }
+        printResult(stdout, &r, comparison);
+        fflush(stdout);
+    }
+    if(save != NULL){
+        fclose(save);
+    }
+    return regressed;
+}
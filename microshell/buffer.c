@@ -0,0 +1,91 @@
+/* Author: Calvin Kerns
+ * Growable character buffer used for expanded lines and captured output
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BUFFER_MIN 256
+
+void bufInit(Buffer *b){
+    b->data = NULL;
+    b->len = 0;
+    b->cap = 0;
+    b->arena = NULL;
+}
+
+//a buffer whose memory comes from a and goes away when a is released
+void bufInitArena(Buffer *b, Arena *a){
+    bufInit(b);
+    b->arena = a;
+}
+
+//make sure there is room for extra more bytes plus the null terminator,
+//returns 0 on success and -1 if memory couldn't be allocated
+int bufReserve(Buffer *b, size_t extra){
+    if(b->len + extra < b->cap){
+        return 0;
+    }
+    size_t newcap = b->cap ? b->cap : BUFFER_MIN;
+    while(newcap <= b->len + extra){
+        newcap *= 2;
+    }
+    char *grown;
+    if(b->arena != NULL){
+        grown = arenaGrow(b->arena, b->data, b->cap, newcap);
+    }
+    else{
+        grown = realloc(b->data, newcap);
+        //walk workers use buffers too
+        __atomic_fetch_add(&statHeapAllocs, 1, __ATOMIC_RELAXED);
+    }
+    if(grown == NULL){
+        perror("buffer realloc");
+        return -1;
+    }
+    b->data = grown;
+    b->cap = newcap;
+    return 0;
+}
+
+int bufAppend(Buffer *b, const char *str, size_t n){
+    if(bufReserve(b, n) != 0){
+        return -1;
+    }
+    memcpy(b->data + b->len, str, n);
+    b->len += n;
+    b->data[b->len] = 0;
+    return 0;
+}
+
+int bufPuts(Buffer *b, const char *str){
+    return bufAppend(b, str, strlen(str));
+}
+
+int bufPutc(Buffer *b, char c){
+    if(bufReserve(b, 1) != 0){
+        return -1;
+    }
+    b->data[b->len++] = c;
+    b->data[b->len] = 0;
+    return 0;
+}
+
+//shrink the buffer contents to len characters
+void bufTruncate(Buffer *b, size_t len){
+    if(len < b->len){
+        b->len = len;
+        b->data[len] = 0;
+    }
+}
+
+void bufFree(Buffer *b){
+    Arena *a = b->arena;
+    if(a == NULL){
+        free(b->data);
+    }
+    bufInit(b);
+    b->arena = a;
+}
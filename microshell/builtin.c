@@ -10,19 +10,285 @@
  #include <unistd.h>
  #include <ctype.h>
  #include <sys/types.h>
- #include <grp.h>
  #include <sys/stat.h>
- #include <time.h>
- #include <string.h>
- #include <pwd.h>
 
 int shiftOffset;
 
-void my_strmode(mode_t mode, char *str);
+//args of the test being evaluated, shared by the test helpers
+static char **testArgs;
+static int testEnd;
+static int testError;
+
+static int testOr(int *pos);
+
+//parse a test integer, flagging an error if it isn't one
+static long testNumber(const char *str){
+    char *end;
+    while(isspace((unsigned char)*str)){
+        str += 1;
+    }
+    long value = strtol(str, &end, 10);
+    while(isspace((unsigned char)*end)){
+        end += 1;
+    }
+    if((*str == 0) || (*end != 0)){
+        fprintf(stderr, "test: %s: integer expression expected\n", str);
+        testError = 1;
+    }
+    return value;
+}
+
+static int isUnaryTest(const char *op){
+    return (op[0] == '-') && (op[1] != 0) && (op[2] == 0) && (strchr("bcdefghknprsuwxzLSGOt", op[1]) != NULL);
+}
+
+static int isBinaryTest(const char *op){
+    static const char *ops[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le",
+                                "-gt", "-ge", "-nt", "-ot", "-ef", NULL};
+    for(int i = 0; ops[i] != NULL; i++){
+        if(strcmp(op, ops[i]) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//file and string tests that take one argument
+static int unaryTest(const char *op, const char *arg){
+    struct stat stats;
+    char flag = op[1];
+    if(flag == 'n'){
+        return *arg != 0;
+    }
+    if(flag == 'z'){
+        return *arg == 0;
+    }
+    if(flag == 't'){
+        return isatty(atoi(arg));
+    }
+    if((flag == 'h') || (flag == 'L')){
+        return (lstat(arg, &stats) == 0) && S_ISLNK(stats.st_mode);
+    }
+    if(flag == 'r'){
+        return access(arg, R_OK) == 0;
+    }
+    if(flag == 'w'){
+        return access(arg, W_OK) == 0;
+    }
+    if(flag == 'x'){
+        return access(arg, X_OK) == 0;
+    }
+    if(stat(arg, &stats) != 0){
+        return 0;
+    }
+    switch(flag){
+    case 'b': return S_ISBLK(stats.st_mode);
+    case 'c': return S_ISCHR(stats.st_mode);
+    case 'd': return S_ISDIR(stats.st_mode);
+    case 'f': return S_ISREG(stats.st_mode);
+    case 'p': return S_ISFIFO(stats.st_mode);
+    case 'S': return S_ISSOCK(stats.st_mode);
+    case 's': return stats.st_size > 0;
+    case 'g': return (stats.st_mode & S_ISGID) != 0;
+    case 'u': return (stats.st_mode & S_ISUID) != 0;
+    case 'k': return (stats.st_mode & S_ISVTX) != 0;
+    case 'O': return stats.st_uid == geteuid();
+    case 'G': return stats.st_gid == getegid();
+    }
+    return 1;  //-e
+}
+
+//string, integer and file comparisons
+static int binaryTest(const char *left, const char *op, const char *right){
+    struct stat a;
+    struct stat b;
+    if((strcmp(op, "=") == 0) || (strcmp(op, "==") == 0)){
+        return strcmp(left, right) == 0;
+    }
+    if(strcmp(op, "!=") == 0){
+        return strcmp(left, right) != 0;
+    }
+    if(strcmp(op, "<") == 0){
+        return strcmp(left, right) < 0;
+    }
+    if(strcmp(op, ">") == 0){
+        return strcmp(left, right) > 0;
+    }
+    if((strcmp(op, "-nt") == 0) || (strcmp(op, "-ot") == 0) || (strcmp(op, "-ef") == 0)){
+        int haveLeft = (stat(left, &a) == 0);
+        int haveRight = (stat(right, &b) == 0);
+        if(op[1] == 'e'){
+            return haveLeft && haveRight && (a.st_dev == b.st_dev) && (a.st_ino == b.st_ino);
+        }
+        if(!haveLeft || !haveRight){
+            //a file that exists is newer than one that doesn't
+            return (op[1] == 'n') ? haveLeft : haveRight;
+        }
+        long cmp = (a.st_mtim.tv_sec != b.st_mtim.tv_sec) ? (a.st_mtim.tv_sec > b.st_mtim.tv_sec ? 1 : -1)
+                 : (a.st_mtim.tv_nsec > b.st_mtim.tv_nsec) - (a.st_mtim.tv_nsec < b.st_mtim.tv_nsec);
+        return (op[1] == 'n') ? (cmp > 0) : (cmp < 0);
+    }
+    long l = testNumber(left);
+    long r = testNumber(right);
+    if(strcmp(op, "-eq") == 0) return l == r;
+    if(strcmp(op, "-ne") == 0) return l != r;
+    if(strcmp(op, "-lt") == 0) return l < r;
+    if(strcmp(op, "-le") == 0) return l <= r;
+    if(strcmp(op, "-gt") == 0) return l > r;
+    return l >= r;
+}
+
+//primary: ( expr ), a binary or unary test, or a lone string
+static int testPrimary(int *pos){
+    if(*pos >= testEnd){
+        fprintf(stderr, "test: argument expected\n");
+        testError = 1;
+        return 0;
+    }
+    char *arg = testArgs[*pos];
+    //a binary operator in the middle wins, so [ -f = -f ] compares strings
+    if((*pos + 2 < testEnd) && isBinaryTest(testArgs[*pos + 1])){
+        int res = binaryTest(arg, testArgs[*pos + 1], testArgs[*pos + 2]);
+        *pos += 3;
+        return res;
+    }
+    if((strcmp(arg, "(") == 0) && (*pos + 1 < testEnd)){
+        *pos += 1;
+        int res = testOr(pos);
+        if((*pos >= testEnd) || (strcmp(testArgs[*pos], ")") != 0)){
+            fprintf(stderr, "test: missing ')'\n");
+            testError = 1;
+            return 0;
+        }
+        *pos += 1;
+        return res;
+    }
+    if(isUnaryTest(arg) && (*pos + 1 < testEnd)){
+        int res = unaryTest(arg, testArgs[*pos + 1]);
+        *pos += 2;
+        return res;
+    }
+    *pos += 1;
+    return *arg != 0;
+}
+
+static int testNot(int *pos){
+    //! = x compares the string !, it doesn't negate
+    int binary = (*pos + 2 < testEnd) && isBinaryTest(testArgs[*pos + 1]);
+    if((*pos < testEnd) && (strcmp(testArgs[*pos], "!") == 0) && (*pos + 1 < testEnd) && !binary){
+        *pos += 1;
+        return !testNot(pos);
+    }
+    return testPrimary(pos);
+}
+
+static int testAnd(int *pos){
+    int res = testNot(pos);
+    while((*pos < testEnd) && (strcmp(testArgs[*pos], "-a") == 0)){
+        *pos += 1;
+        int right = testNot(pos);
+        res = res && right;
+    }
+    return res;
+}
+
+static int testOr(int *pos){
+    int res = testAnd(pos);
+    while((*pos < testEnd) && (strcmp(testArgs[*pos], "-o") == 0)){
+        *pos += 1;
+        int right = testAnd(pos);
+        res = res || right;
+    }
+    return res;
+}
+
+/*evaluate test args[1] .. args[count - 1] in the shell itself so
+conditions never fork. Returns 1 for true, 2 for false or an error*/
+static int testBuiltin(char **args, int count){
+    testArgs = args;
+    testEnd = count;
+    testError = 0;
+    int pos = 1;
+    int res = 0;
+    if(count > 1){
+        res = testOr(&pos);
+    }
+    if(!testError && (pos < count)){
+        fprintf(stderr, "test: too many arguments\n");
+        testError = 1;
+    }
+    return (res && !testError) ? 1 : 2;
+}
+
+/*echo [-neE] args: the words joined by spaces, built up in one buffer and
+written with a single write*/
+static int echoBuiltin(char **args, int count, int outfd){
+    int newline = 1;
+    int escapes = 0;
+    int pos = 1;
+    //options only count when every letter is one of n, e and E
+    for(; (pos < count) && (args[pos][0] == '-') && (args[pos][1] != 0); pos++){
+        if(strspn(args[pos] + 1, "neE") != strlen(args[pos] + 1)){
+            break;
+        }
+        for(char *opt = args[pos] + 1; *opt != 0; opt++){
+            if(*opt == 'n'){
+                newline = 0;
+            }
+            else{
+                escapes = (*opt == 'e');
+            }
+        }
+    }
+    ArenaMark mark = arenaMark(&lineArena);
+    Buffer out;
+    bufInitArena(&out, &lineArena);
+    int stop = 0;
+    for(int i = pos; (i < count) && !stop; i++){
+        if(i > pos){
+            bufPutc(&out, ' ');
+        }
+        if(escapes){
+            putEscape(args[i], &out, &stop);
+        }
+        else{
+            bufPuts(&out, args[i]);
+        }
+    }
+    if(newline && !stop){
+        bufPutc(&out, '\n');
+    }
+    int res = writeAll(outfd, out.data, out.len);
+    arenaRelease(&lineArena, mark);
+    return (res == 0) ? 1 : 2;
+}
+
+//every command execBuiltin handles
+const char *builtinNames[] = {"exit", "envset", "envunset", "export", "cd", "shift",
+                                     "unshift", "hash", "jobs", "wait", "fg", "bg", "parallel", "test",
+                                     "[", "sstat", "echo", "printf", "pwd", "true", "false",
+                                     "trace", "cache", "history", NULL};
+
+//returns 1 if name is handled by execBuiltin
+int isBuiltin(const char *name){
+    for(int i = 0; builtinNames[i] != NULL; i++){
+        if(strcmp(name, builtinNames[i]) == 0){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*returns 1 if name is a builtin that only writes through writeAll, so $( )
+can run it in the shell with CAPTURE_FD. parallel hands its outfd to the
+commands it starts and needs a real one*/
+int builtinCaptures(const char *name){
+    return isBuiltin(name) && (strcmp(name, "parallel") != 0);
+}
 
 //return 1  and do command if it was a builtin func, return 2 if builtin 
-//command errored, return 0 if not builtin
-int execBuiltin(char **args, int argNumber, int outfd){
+//command errored, return 3 if it set $? itself, return 0 if not builtin
+static int runBuiltin(char **args, int argNumber, int infd, int outfd){
 
     if(args == NULL){
         return 0;
@@ -59,13 +325,35 @@ int execBuiltin(char **args, int argNumber, int outfd){
             fprintf(stderr, "Incorrect amount of arguments\n");
             return 2;
         }
-        char *arg2 = args[1];
-        char *arg3 = args[2];
-        setenv(arg2, arg3, 1);
-
+        if(setVar(args[1], args[2], VAR_EXPORT) != 0){
+            fprintf(stderr, "envset: %s: not a valid name\n", args[1]);
+            return 2;
+        }
         return 1;
     }
 
+    //if command is export, NAME marks a variable exported and NAME=value sets it too
+    else if(strcmp(*args, "export") == 0){
+        int res = 1;
+        for(int i = 1; i < argNumber; i++){
+            char *equals = strchr(args[i], '=');
+            int failed;
+            if(equals != NULL){
+                *equals = 0;
+                failed = setVar(args[i], equals + 1, VAR_EXPORT);
+                *equals = '=';
+            }
+            else{
+                failed = exportVar(args[i]);
+            }
+            if(failed != 0){
+                fprintf(stderr, "export: %s: not a valid name\n", args[i]);
+                res = 2;
+            }
+        }
+        return res;
+    }
+
     //if command is envunset
     else if(strcmp(*args, "envunset") == 0){
         //check for correct number of args
@@ -73,9 +361,7 @@ int execBuiltin(char **args, int argNumber, int outfd){
             fprintf(stderr, "Incorrect amount of arguments\n");
             return 2;
         }
-        char *arg2 = args[1];
-        unsetenv(arg2);
-
+        unsetVar(args[1]);
         return 1;
     }
 
@@ -88,7 +374,7 @@ int execBuiltin(char **args, int argNumber, int outfd){
         }
         //if 1 arg given, go home, else go where specified
         if(argNumber == 1){
-            chdir(getenv("HOME"));
+            chdir(getVar("HOME"));
         }
         else{
             res = chdir(args[1]);
@@ -145,75 +431,118 @@ int execBuiltin(char **args, int argNumber, int outfd){
         return 1;
     }
 
-    //stat command
-    else if(strcmp(*args, "sstat") == 0){
-        char storage[1024];
-        if(argNumber <= 1){
-            fprintf(stderr, "Incorrect amount of arguments\n");
-            return 2;
+    //if command is hash, list, clear or fill the command path cache
+    else if(strcmp(*args, "hash") == 0){
+        if(argNumber == 1){
+            if(listCommandCache(outfd) != 0){
+                return 2;
+            }
+            return 1;
         }
-        //for each filename
-        struct stat stats;
-        for(int i=1; i<argNumber; i++){
-            if(stat(args[i], &stats) == -1){
-                perror("stat failed");
+        if(strcmp(args[1], "-r") == 0){
+            if(argNumber != 2){
+                fprintf(stderr, "Incorrect amount of arguments\n");
                 return 2;
             }
+            clearCommandCache();
+            return 1;
+        }
+        //look up every name given, reporting ones that aren't in PATH
+        int res = 1;
+        for(int i = 1; i < argNumber; i++){
+            if(hashCommand(args[i]) == 0){
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                res = 2;
+            }
+        }
+        return res;
+    }
 
-            //print filename
-            char *first = args[i];
+    //job control, see jobs.c
+    else if(strcmp(*args, "jobs") == 0){
+        return jobsBuiltin(argNumber, outfd);
+    }
+    else if(strcmp(*args, "wait") == 0){
+        return waitBuiltin(args, argNumber);
+    }
+    else if(strcmp(*args, "fg") == 0){
+        return fgBuiltin(args, argNumber);
+    }
+    else if(strcmp(*args, "bg") == 0){
+        return bgBuiltin(args, argNumber);
+    }
 
-            //print user stuff
-            struct passwd *password = getpwuid(stats.st_uid);
-            char *usrnm;
-            char UID[20];
-            if(password == NULL){
-                snprintf(UID, 20, "%d", stats.st_uid);
-            }
-            else{
-                usrnm = password->pw_name;
-            }
+    //run a command for each item, several at a time, see parallel.c
+    else if(strcmp(*args, "parallel") == 0){
+        return parallelBuiltin(args, argNumber, infd, outfd);
+    }
 
-            //print group stuff
-            struct group *grp = getgrgid(stats.st_gid);
-            char *grnm;
-            char GID[20];
-            if(grp == NULL){
-                snprintf(GID, 20, "%d", stats.st_gid);
-            }
-            else{
-                grp = NULL;
-                grnm = grp->gr_name;
-            }
+    //test and [, conditions for if and while
+    else if(strcmp(*args, "test") == 0){
+        return testBuiltin(args, argNumber);
+    }
+    else if(strcmp(*args, "[") == 0){
+        if(strcmp(args[argNumber - 1], "]") != 0){
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        return testBuiltin(args, argNumber - 1);
+    }
 
-            //permisson stuff
-            char arry[12];
-            char *fourth;
-            my_strmode(stats.st_mode, arry);
-            fourth = arry;
-            
-            //link stuff
-            int fifth;
-            fifth = stats.st_nlink;
-
-            //size info
-            int sixth;
-            sixth = stats.st_size;
-
-            //mod time info
-            char *seventh;
-            time_t *mtim = &(stats.st_mtime);
-            seventh = asctime(localtime(mtim));
-
-            int len = snprintf(storage, 1024, "%s %s %s %s%d %d %s", first, usrnm?usrnm : UID, grnm?grnm : GID, fourth, fifth, sixth, seventh);
-
-            if(write(outfd, storage, len) != len){
-                perror("write error");
-            }
+    //output builtins, these never fork
+    else if(strcmp(*args, "echo") == 0){
+        return echoBuiltin(args, argNumber, outfd);
+    }
+    else if(strcmp(*args, "printf") == 0){
+        return printfBuiltin(args, argNumber, outfd);
+    }
+    else if(strcmp(*args, "pwd") == 0){
+        char *cwd = getcwd(NULL, 0);
+        if(cwd == NULL){
+            perror("pwd");
+            return 2;
         }
+        size_t len = strlen(cwd);
+        cwd[len] = '\n';
+        int res = writeAll(outfd, cwd, len + 1);
+        free(cwd);
+        return (res == 0) ? 1 : 2;
+    }
+    else if(strcmp(*args, "true") == 0){
         return 1;
     }
+    else if(strcmp(*args, "false") == 0){
+        return 2;
+    }
+
+    //stat command, see sstat.c
+    else if(strcmp(*args, "sstat") == 0){
+        return sstatBuiltin(args, argNumber, outfd);
+    }
+
+    //$( ) output cache, see substcache.c
+    else if(strcmp(*args, "cache") == 0){
+        return cacheBuiltin(args, argNumber, outfd);
+    }
+
+    //command history, see history.c
+    else if(strcmp(*args, "history") == 0){
+        return historyBuiltin(args, argNumber, outfd);
+    }
+
+    //tracing, see trace.c
+    else if(strcmp(*args, "trace") == 0){
+        return traceBuiltin(args, argNumber, outfd);
+    }
 
     //if command was not a builtin
     return 0;
 }
+
+//runBuiltin as one trace event
+int execBuiltin(char **args, int argNumber, int infd, int outfd){
+    long trace = TRACE_BEGIN(TRACE_BUILTIN, (argNumber > 0) ? args[0] : NULL);
+    int res = runBuiltin(args, argNumber, infd, outfd);
+    TRACE_END(trace);
+    return res;
+}
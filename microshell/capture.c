@@ -0,0 +1,63 @@
+/* Author: Calvin Kerns
+ * Capture engine for $() command substitution
+*/
+
+#include "defn.h"
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+//smallest read we will ask the kernel for
+#define CAPTURE_CHUNK 65536
+
+/*read everything from fd and append it to out. Reads go straight into the
+spare room of out, which doubles as it fills, so large outputs cost a handful
+of syscalls instead of one per byte. Newlines become spaces and a single
+trailing newline is dropped, same as $() always did. Returns the number of
+bytes appended or -1 on error*/
+long captureOutput(int fd, Buffer *out){
+    size_t start = out->len;
+    ssize_t got;
+
+    while(1){
+        if(bufReserve(out, CAPTURE_CHUNK) != 0){
+            return -1;
+        }
+        got = read(fd, out->data + out->len, out->cap - out->len - 1);
+        if(got == 0){
+            break;
+        }
+        if(got < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("read");
+            out->data[out->len] = 0;
+            return -1;
+        }
+        out->len += got;
+    }
+    out->data[out->len] = 0;
+    return foldCapture(out, start);
+}
+
+/*turn what was captured from start on into $() form: newlines become
+spaces and a single trailing newline is dropped. Returns its length*/
+long foldCapture(Buffer *out, size_t start){
+    if(out->len == start){
+        return 0;
+    }
+    int trailing = (out->len > start) && (out->data[out->len - 1] == '\n');
+    //memchr is vectorized by libc, far cheaper than checking every byte here
+    char *scan = out->data + start;
+    char *end = out->data + out->len;
+    while((scan = memchr(scan, '\n', end - scan)) != NULL){
+        *scan = ' ';
+        scan += 1;
+    }
+    if(trailing){
+        bufTruncate(out, out->len - 1);
+    }
+    return out->len - start;
+}
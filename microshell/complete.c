@@ -0,0 +1,532 @@
+/* Author: Calvin Kerns
+ * Tab completion for the line editor. Command names come from a trie of
+ * the executables in the PATH directories, built by a thread at startup
+ * and again whenever PATH changes, and kept current in between with the
+ * inotify events of those directories. File names come from glob's cached
+ * directory listings
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#define TRIE_START 4096
+#define TRIE_NONE UINT32_MAX
+//a command is marked with the PATH directories it is in, past this many they share a bit
+#define TRIE_MAX_DIRS 64
+#define TRIE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+//most choices listed under the line
+#define COMPLETE_SHOW 200
+//characters that need a backslash to stay in the word
+#define COMPLETE_ESCAPE " \t\"\\$*?[;|&<>()#"
+
+//children of a node are a sibling list in byte order, node 0 is the root
+struct trieNode {
+    uint32_t child;         //0 for none
+    uint32_t sibling;
+    uint64_t dirs;          //bit per PATH directory with this command, 0 if none ends here
+    unsigned char byte;
+};
+
+struct commandTrie {
+    struct trieNode *nodes;
+    uint32_t count;
+    uint32_t cap;
+    long commands;
+    char *path;             //the PATH it was built from
+    char *dirs[TRIE_MAX_DIRS];
+    int watches[TRIE_MAX_DIRS];
+    int dirCount;
+    int notify;             //inotify fd, -1 without one
+    int done;               //set by the builder once it is ready
+};
+
+//what a word can be completed to
+struct choices {
+    long count;
+    Buffer common;          //longest common prefix of them all
+    Buffer shown;           //the first COMPLETE_SHOW, each null terminated
+    int shownCount;
+    size_t widest;
+};
+
+static struct commandTrie *trie;        //the one completions use
+static struct commandTrie *building;    //the one the builder thread is filling
+static pthread_t builder;
+
+static uint32_t newNode(struct commandTrie *t, unsigned char byte){
+    if(t->count == t->cap){
+        uint32_t newCap = t->cap ? t->cap * 2 : TRIE_START;
+        struct trieNode *grown = realloc(t->nodes, newCap * sizeof(struct trieNode));
+        if(grown == NULL){
+            return TRIE_NONE;
+        }
+        t->nodes = grown;
+        t->cap = newCap;
+    }
+    struct trieNode *node = &t->nodes[t->count];
+    memset(node, 0, sizeof(struct trieNode));
+    node->byte = byte;
+    return t->count++;
+}
+
+//node for the first len bytes of text, or TRIE_NONE
+static uint32_t trieFind(const struct commandTrie *t, const char *text, size_t len){
+    uint32_t node = 0;
+    for(size_t i = 0; i < len; i++){
+        unsigned char c = text[i];
+        node = t->nodes[node].child;
+        while((node != 0) && (t->nodes[node].byte < c)){
+            node = t->nodes[node].sibling;
+        }
+        if((node == 0) || (t->nodes[node].byte != c)){
+            return TRIE_NONE;
+        }
+    }
+    return node;
+}
+
+static int trieInsert(struct commandTrie *t, const char *name, uint64_t bit){
+    uint32_t node = 0;
+    for(const unsigned char *c = (const unsigned char *)name; *c != 0; c++){
+        uint32_t prev = TRIE_NONE;
+        uint32_t next = t->nodes[node].child;
+        while((next != 0) && (t->nodes[next].byte < *c)){
+            prev = next;
+            next = t->nodes[next].sibling;
+        }
+        if((next == 0) || (t->nodes[next].byte != *c)){
+            //indexes, not pointers, the array may move here
+            uint32_t added = newNode(t, *c);
+            if(added == TRIE_NONE){
+                return -1;
+            }
+            t->nodes[added].sibling = next;
+            if(prev == TRIE_NONE){
+                t->nodes[node].child = added;
+            }
+            else{
+                t->nodes[prev].sibling = added;
+            }
+            next = added;
+        }
+        node = next;
+    }
+    t->commands += (t->nodes[node].dirs == 0);
+    t->nodes[node].dirs |= bit;
+    return 0;
+}
+
+static void trieRemove(struct commandTrie *t, const char *name, uint64_t bit){
+    uint32_t node = trieFind(t, name, strlen(name));
+    if((node == TRIE_NONE) || !(t->nodes[node].dirs & bit)){
+        return;
+    }
+    t->nodes[node].dirs &= ~bit;
+    t->commands -= (t->nodes[node].dirs == 0);
+}
+
+//a command the way lookupCommand finds one: a regular file we can run
+static int isCommand(int dirfd, const char *name){
+    struct stat stats;
+    return (fstatat(dirfd, name, &stats, 0) == 0) && S_ISREG(stats.st_mode) &&
+           (faccessat(dirfd, name, X_OK, 0) == 0);
+}
+
+static uint64_t dirBit(int dir){
+    return 1UL << ((dir < TRIE_MAX_DIRS) ? dir : TRIE_MAX_DIRS - 1);
+}
+
+static void scanDir(struct commandTrie *t, int dir){
+    int fd = open(t->dirs[dir], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *opened = (fd >= 0) ? fdopendir(fd) : NULL;
+    if(opened == NULL){
+        if(fd >= 0){
+            close(fd);
+        }
+        return;
+    }
+    struct dirent *entry;
+    while((entry = readdir(opened)) != NULL){
+        if((entry->d_name[0] == '.') || (entry->d_type == DT_DIR)){
+            continue;
+        }
+        if(isCommand(fd, entry->d_name) && (trieInsert(t, entry->d_name, dirBit(dir)) != 0)){
+            break;
+        }
+    }
+    closedir(opened);
+}
+
+/*builder thread: watch and read every PATH directory. Watching comes first
+so nothing that changes while a directory is read is missed. Directories
+that aren't absolute would change with cd and are left out*/
+static void *buildTrie(void *arg){
+    struct commandTrie *t = arg;
+    t->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(newNode(t, 0) != TRIE_NONE){
+        char *dir = t->path;
+        while((dir != NULL) && (t->dirCount < TRIE_MAX_DIRS)){
+            char *end = strchr(dir, ':');
+            if(end != NULL){
+                *end = 0;
+            }
+            int seen = 0;
+            for(int i = 0; i < t->dirCount; i++){
+                seen |= strcmp(t->dirs[i], dir) == 0;
+            }
+            if((dir[0] == '/') && !seen){
+                int i = t->dirCount++;
+                t->dirs[i] = dir;
+                t->watches[i] = (t->notify >= 0) ? inotify_add_watch(t->notify, dir, TRIE_EVENTS) : -1;
+                scanDir(t, i);
+            }
+            dir = (end != NULL) ? end + 1 : NULL;
+        }
+    }
+    __atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void freeTrie(struct commandTrie *t){
+    if(t == NULL){
+        return;
+    }
+    if(t->notify >= 0){
+        close(t->notify);
+    }
+    free(t->nodes);
+    free(t->path);
+    free(t);
+}
+
+/*build the command trie for the current PATH in the background. A build
+still going is waited for and thrown away*/
+void startCommandTrie(void){
+    if(building != NULL){
+        pthread_join(builder, NULL);
+        freeTrie(building);
+        building = NULL;
+    }
+    struct commandTrie *t = calloc(1, sizeof(struct commandTrie));
+    const char *path = getVar("PATH");
+    if((t == NULL) || ((t->path = strdup(path ? path : "/bin:/usr/bin")) == NULL)){
+        free(t);
+        return;
+    }
+    t->notify = -1;
+    if(pthread_create(&builder, NULL, buildTrie, t) != 0){
+        freeTrie(t);
+        return;
+    }
+    building = t;
+}
+
+//PATH changed, completions come from the new one once it is built
+void rebuildCommandTrie(void){
+    if((trie != NULL) || (building != NULL)){
+        startCommandTrie();
+    }
+}
+
+//bring t up to date with what happened in its directories since last time
+static void applyEvents(struct commandTrie *t){
+    char events[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    Buffer path;
+    ssize_t got;
+    int rebuild = 0;
+    bufInit(&path);
+    while((t->notify >= 0) && ((got = read(t->notify, events, sizeof(events))) > 0)){
+        for(char *at = events; at < events + got; at += sizeof(struct inotify_event) + ((struct inotify_event *)at)->len){
+            struct inotify_event *event = (struct inotify_event *)at;
+            int dir = 0;
+            while((dir < t->dirCount) && (t->watches[dir] != event->wd)){
+                dir += 1;
+            }
+            //a lost event or a directory gone means the trie can't be trusted
+            if((event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) || (dir == t->dirCount)){
+                rebuild = 1;
+                continue;
+            }
+            if((event->len == 0) || (event->name[0] == '.')){
+                continue;
+            }
+            bufTruncate(&path, 0);
+            bufPuts(&path, t->dirs[dir]);
+            bufPutc(&path, '/');
+            bufPuts(&path, event->name);
+            if((path.data != NULL) && isCommand(AT_FDCWD, path.data)){
+                trieInsert(t, event->name, dirBit(dir));
+            }
+            else{
+                trieRemove(t, event->name, dirBit(dir));
+            }
+        }
+    }
+    bufFree(&path);
+    if(rebuild){
+        startCommandTrie();
+    }
+}
+
+/*the trie to complete from. A finished build replaces the one in use, the
+first one is waited for*/
+static struct commandTrie *currentTrie(void){
+    if((trie == NULL) && (building == NULL)){
+        startCommandTrie();
+    }
+    if((building != NULL) && ((trie == NULL) || __atomic_load_n(&building->done, __ATOMIC_ACQUIRE))){
+        pthread_join(builder, NULL);
+        freeTrie(trie);
+        trie = building;
+        building = NULL;
+    }
+    if(trie != NULL){
+        applyEvents(trie);
+    }
+    return trie;
+}
+
+//name is one choice, directories are shown and completed with a / after them
+static void addChoice(struct choices *c, const char *name, size_t len, int isDir){
+    if(c->count == 0){
+        bufAppend(&c->common, name, len);
+        if(isDir){
+            bufPutc(&c->common, '/');
+        }
+    }
+    else{
+        size_t same = 0;
+        while((same < c->common.len) && (same < len) && (c->common.data[same] == name[same])){
+            same += 1;
+        }
+        if((same == len) && isDir && (same < c->common.len) && (c->common.data[same] == '/')){
+            same += 1;
+        }
+        bufTruncate(&c->common, same);
+    }
+    c->count += 1;
+    if(c->shownCount < COMPLETE_SHOW){
+        bufAppend(&c->shown, name, len);
+        if(isDir){
+            bufPutc(&c->shown, '/');
+        }
+        bufPutc(&c->shown, 0);
+        c->shownCount += 1;
+        c->widest = (len + isDir > c->widest) ? len + isDir : c->widest;
+    }
+}
+
+//every command under node, whose name so far is in name
+static void collectCommands(const struct commandTrie *t, uint32_t node, Buffer *name, struct choices *c){
+    if(t->nodes[node].dirs != 0){
+        addChoice(c, name->data, name->len, 0);
+    }
+    size_t len = name->len;
+    for(uint32_t child = t->nodes[node].child; child != 0; child = t->nodes[child].sibling){
+        if(bufPutc(name, t->nodes[child].byte) != 0){
+            return;
+        }
+        collectCommands(t, child, name, c);
+        bufTruncate(name, len);
+    }
+}
+
+static void completeCommand(const char *word, struct choices *c){
+    struct commandTrie *t = currentTrie();
+    size_t len = strlen(word);
+    uint32_t node = (t != NULL) ? trieFind(t, word, len) : TRIE_NONE;
+    if(node != TRIE_NONE){
+        Buffer name;
+        bufInit(&name);
+        bufAppend(&name, word, len);
+        collectCommands(t, node, &name, c);
+        bufFree(&name);
+    }
+    //builtins that aren't also in PATH
+    for(int i = 0; builtinNames[i] != NULL; i++){
+        if(strncmp(builtinNames[i], word, len) != 0){
+            continue;
+        }
+        uint32_t found = (t != NULL) ? trieFind(t, builtinNames[i], strlen(builtinNames[i])) : TRIE_NONE;
+        if((found == TRIE_NONE) || (t->nodes[found].dirs == 0)){
+            addChoice(c, builtinNames[i], strlen(builtinNames[i]), 0);
+        }
+    }
+}
+
+/*names in the directory part of word starting with the rest of it, hidden
+ones only when that starts with a dot. The listing is sorted so the
+matches are found with a binary search*/
+static void completeFile(const char *word, struct choices *c){
+    const char *slash = strrchr(word, '/');
+    const char *base = slash ? slash + 1 : word;
+    size_t baseLen = strlen(base);
+    Buffer dir;
+    bufInit(&dir);
+    const char *home = getVar("HOME");
+    if((word[0] == '~') && (word[1] == '/') && (home != NULL)){
+        bufPuts(&dir, home);
+        bufAppend(&dir, word + 1, base - word - 1);
+    }
+    else if(slash != NULL){
+        bufAppend(&dir, word, base - word);
+    }
+    else{
+        bufPuts(&dir, "./");
+    }
+    char **names = NULL;
+    unsigned char *types = NULL;
+    long count = (dir.data != NULL) ? listDirectory(dir.data, &names, &types) : -1;
+    long low = 0;
+    long high = count;
+    while(low < high){
+        long mid = (low + high) / 2;
+        if(strcmp(names[mid], base) < 0){
+            low = mid + 1;
+        }
+        else{
+            high = mid;
+        }
+    }
+    size_t dirLen = dir.len;
+    for(long i = low; (i < count) && (strncmp(names[i], base, baseLen) == 0); i++){
+        if((names[i][0] == '.') && (base[0] != '.')){
+            continue;
+        }
+        bufTruncate(&dir, dirLen);
+        bufPuts(&dir, names[i]);
+        addChoice(c, names[i], strlen(names[i]), isDirectory(dir.data, types[i]));
+    }
+    bufFree(&dir);
+}
+
+static int cmpShown(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+//the choices shown sorted down columns across cols, like ls
+static void layOut(struct choices *c, size_t cols, Buffer *list){
+    char **names = malloc(c->shownCount * sizeof(char *));
+    if(names == NULL){
+        return;
+    }
+    char *name = c->shown.data;
+    for(int i = 0; i < c->shownCount; i++){
+        names[i] = name;
+        name += strlen(name) + 1;
+    }
+    qsort(names, c->shownCount, sizeof(char *), cmpShown);
+    size_t width = c->widest + 2;
+    int columns = (cols > width) ? cols / width : 1;
+    int rows = (c->shownCount + columns - 1) / columns;
+    for(int row = 0; row < rows; row++){
+        for(int i = row; i < c->shownCount; i += rows){
+            size_t len = strlen(names[i]);
+            bufAppend(list, names[i], len);
+            if(i + rows < c->shownCount){
+                for(size_t pad = len; pad < width; pad++){
+                    bufPutc(list, ' ');
+                }
+            }
+        }
+        bufPutc(list, '\n');
+    }
+    if(c->count > c->shownCount){
+        char more[64];
+        snprintf(more, sizeof(more), "(%ld more)\n", c->count - c->shownCount);
+        bufPuts(list, more);
+    }
+    free(names);
+}
+
+/*the word is in command position at the start of the line, after ; | & (
+or a keyword that takes a command*/
+static int commandPosition(const char *line, size_t start){
+    static const char *keywords[] = {"if", "then", "else", "elif", "while", "until", "do", NULL};
+    while((start > 0) && ((line[start - 1] == ' ') || (line[start - 1] == '\t'))){
+        start -= 1;
+    }
+    if((start == 0) || (strchr(";|&(", line[start - 1]) != NULL)){
+        return 1;
+    }
+    size_t end = start;
+    while((start > 0) && (line[start - 1] != ' ') && (line[start - 1] != '\t')){
+        start -= 1;
+    }
+    for(int i = 0; keywords[i] != NULL; i++){
+        if((strlen(keywords[i]) == end - start) && (strncmp(line + start, keywords[i], end - start) == 0)){
+            return start == 0 || commandPosition(line, start);
+        }
+    }
+    return 0;
+}
+
+/*complete the word that ends at pos in line. The text to put in place of
+line[*start, pos) is left in replace and, when there are several choices
+and nothing could be added, a listing of them cols wide in list. Returns
+how many choices there were*/
+long completeLine(const char *line, size_t pos, size_t cols, size_t *start, Buffer *replace, Buffer *list){
+    size_t begin = pos;
+    while((begin > 0) && (strchr(" \t\";|&()<>", line[begin - 1]) == NULL ||
+                          ((begin > 1) && (line[begin - 2] == '\\')))){
+        begin -= 1;
+    }
+    *start = begin;
+
+    //the word without its backslashes is what gets matched
+    Buffer word;
+    bufInit(&word);
+    bufAppend(&word, "", 0);
+    for(size_t i = begin; i < pos; i++){
+        if((line[i] == '\\') && (i + 1 < pos)){
+            i += 1;
+        }
+        bufPutc(&word, line[i]);
+    }
+    struct choices c;
+    memset(&c, 0, sizeof(c));
+    bufInit(&c.common);
+    bufInit(&c.shown);
+    if((word.data != NULL) && (strchr(word.data, '/') == NULL) && commandPosition(line, begin)){
+        completeCommand(word.data, &c);
+    }
+    else if(word.data != NULL){
+        completeFile(word.data, &c);
+    }
+
+    //the directory part stays as it was typed, the rest is the common prefix escaped
+    if(c.count > 0){
+        const char *slash = memrchr(line + begin, '/', pos - begin);
+        const char *base = (slash != NULL) ? slash + 1 : line + begin;
+        bufAppend(replace, line + begin, base - (line + begin));
+        for(size_t i = 0; i < c.common.len; i++){
+            if(strchr(COMPLETE_ESCAPE, c.common.data[i]) != NULL){
+                bufPutc(replace, '\\');
+            }
+            bufPutc(replace, c.common.data[i]);
+        }
+        if((c.count == 1) && (c.common.data[c.common.len - 1] != '/')){
+            bufPutc(replace, ' ');
+        }
+        const char *typedBase = strrchr(word.data, '/');
+        typedBase = typedBase ? typedBase + 1 : word.data;
+        if((c.count > 1) && (c.common.len == strlen(typedBase))){
+            layOut(&c, cols, list);
+        }
+    }
+    bufFree(&word);
+    bufFree(&c.common);
+    bufFree(&c.shown);
+    return c.count;
+}
@@ -0,0 +1,479 @@
+/* Author: Calvin Kerns
+ * if/while/until/for: parsed once into a tree, then run from the tree.
+ * The commands in it are lexed once too, so a loop body is only expanded
+ * on each pass, never taken apart again
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+//what runNode tells the loops around it
+#define RUN_NORMAL 0
+#define RUN_BREAK 1
+#define RUN_CONTINUE 2
+
+//splits lines into ; separated segments, asking source for more lines
+struct parser {
+    LineSource source;
+    char *line;       //our copy of the current line
+    char *pos;        //start of the next segment in line, NULL when used up
+    char *pushback;   //segment put back to be read again
+    int error;
+    int quiet;        //don't report syntax errors
+};
+
+static Node *parseList(struct parser *p, const char **terms, const char **found);
+
+//returns 1 if expandArgs() has anything to do in text: a $, an escape, a glob or a <( )
+int needsExpand(const char *text){
+    return (strpbrk(text, "$\\") != NULL) || hasGlobChars(text) ||
+           (strstr(text, "<(") != NULL) || (strstr(text, ">(") != NULL);
+}
+
+static Node *newNode(int kind, const char *text){
+    Node *node = calloc(1, sizeof(Node));
+    if(node == NULL){
+        perror("malloc");
+        return NULL;
+    }
+    node->kind = kind;
+    if(text != NULL){
+        node->text = strdup(text);
+        //decided once here so plain command lines never go through expand
+        if((kind != NODE_FOR) && needsExpand(text)){
+            node->flags |= NODE_EXPAND;
+        }
+        //lines with an error are left as text for processline to report
+        if(kind != NODE_FOR){
+            node->lexed = lexCommand(node->text, node->flags & NODE_EXPAND);
+        }
+    }
+    return node;
+}
+
+void freeNode(Node *node){
+    while(node != NULL){
+        Node *next = node->next;
+        free(node->text);
+        free(node->words);
+        free(node->lexed);
+        freeNode(node->body);
+        freeNode(node->elseBody);
+        free(node);
+        node = next;
+    }
+}
+
+//find the end of the segment at str, an unquoted sep outside of $( )
+char *segmentEnd(char *str, int sep){
+    char *start = str;
+    int quotes = 0;
+    int depth = 0;
+    //only quotes, escapes, brackets and separators matter, jump between them
+    for(; *(str = lexNext(str, quotes ? LEX_QUOTE : LEX_QUOTE | LEX_GROUP | LEX_SEP)) != 0; str++){
+        if((*str == '\\') && (str[1] != 0)){
+            str += 1;
+        }
+        else if(*str == '"'){
+            quotes = !quotes;
+        }
+        else if(quotes){
+            continue;
+        }
+        else if(*str == '('){
+            depth += 1;
+        }
+        else if((*str == ')') && (depth > 0)){
+            depth -= 1;
+        }
+        else if((*str == sep) && (depth == 0)){
+            //the & of 2>&1 belongs to the redirection
+            if((sep == '&') && (str > start) && ((str[-1] == '>') || (str[-1] == '<'))){
+                continue;
+            }
+            return str;
+        }
+    }
+    return str;
+}
+
+static char *trim(char *str){
+    while(*str == ' ' || *str == '\t'){
+        str += 1;
+    }
+    char *end = str + strlen(str);
+    while((end > str) && ((end[-1] == ' ') || (end[-1] == '\t'))){
+        end -= 1;
+    }
+    *end = 0;
+    return str;
+}
+
+/*return the next non empty segment, reading more lines if more is set.
+Returns NULL once input runs out*/
+static char *nextSegment(struct parser *p, int more){
+    if(p->pushback != NULL){
+        char *seg = p->pushback;
+        p->pushback = NULL;
+        return seg;
+    }
+    while(1){
+        while((p->pos != NULL) && (*p->pos != 0)){
+            char *end = segmentEnd(p->pos, ';');
+            char *seg = p->pos;
+            p->pos = (*end == 0) ? NULL : end + 1;
+            *end = 0;
+            seg = trim(seg);
+            if(*seg != 0){
+                return seg;
+            }
+        }
+        if(!more){
+            return NULL;
+        }
+        char *line = p->source(1);
+        if(line == NULL){
+            return NULL;
+        }
+        free(p->line);
+        p->line = strdup(line);
+        p->pos = p->line;
+    }
+}
+
+//if seg starts with the word key, return what comes after it, else NULL
+static char *keyword(char *seg, const char *key){
+    size_t len = strlen(key);
+    if((strncmp(seg, key, len) == 0) && ((seg[len] == 0) || (seg[len] == ' ') || (seg[len] == '\t'))){
+        return trim(seg + len);
+    }
+    return NULL;
+}
+
+static int isKeyword(char *seg, const char **keys){
+    for(int i = 0; keys[i] != NULL; i++){
+        if(keyword(seg, keys[i]) != NULL){
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void syntaxError(struct parser *p, const char *msg){
+    if(!p->error && !p->quiet){
+        fprintf(stderr, "syntax error: %s\n", msg);
+    }
+    p->error = 1;
+}
+
+//read the segment that must start with key, anything after key is put back
+static int expectKeyword(struct parser *p, const char *key){
+    char *seg = nextSegment(p, 1);
+    char *rest;
+    if((seg == NULL) || ((rest = keyword(seg, key)) == NULL)){
+        char msg[64];
+        snprintf(msg, sizeof(msg), "expected '%s'", key);
+        syntaxError(p, msg);
+        return -1;
+    }
+    if(*rest != 0){
+        p->pushback = rest;
+    }
+    return 0;
+}
+
+//if COND then ... [elif COND then ...] [else ...] fi, cond is after the if
+static Node *parseIf(struct parser *p, char *cond){
+    static const char *terms[] = {"elif", "else", "fi", NULL};
+    static const char *fiOnly[] = {"fi", NULL};
+    const char *found = NULL;
+    Node *node = newNode(NODE_IF, cond);
+    if((node == NULL) || (expectKeyword(p, "then") != 0)){
+        return node;
+    }
+    node->body = parseList(p, terms, &found);
+    if(p->error || (found == NULL)){
+        syntaxError(p, "missing 'fi'");
+        return node;
+    }
+    if(strcmp(found, "elif") == 0){
+        //an elif is an if of its own that shares our fi
+        char *seg = nextSegment(p, 1);
+        node->elseBody = parseIf(p, keyword(seg, "elif"));
+    }
+    else if(strcmp(found, "else") == 0){
+        char *rest = keyword(nextSegment(p, 1), "else");
+        if(*rest != 0){
+            p->pushback = rest;
+        }
+        node->elseBody = parseList(p, fiOnly, &found);
+        if(!p->error && (found == NULL)){
+            syntaxError(p, "missing 'fi'");
+        }
+        else if(!p->error){
+            nextSegment(p, 1);
+        }
+    }
+    else{
+        nextSegment(p, 1);
+    }
+    return node;
+}
+
+//do ... done, shared by while, until and for
+static void parseLoopBody(struct parser *p, Node *node){
+    static const char *doneOnly[] = {"done", NULL};
+    const char *found = NULL;
+    if(expectKeyword(p, "do") != 0){
+        return;
+    }
+    node->body = parseList(p, doneOnly, &found);
+    if(!p->error && (found == NULL)){
+        syntaxError(p, "missing 'done'");
+    }
+    else if(!p->error){
+        nextSegment(p, 1);
+    }
+}
+
+//parse the statement that starts with seg
+static Node *parseStatement(struct parser *p, char *seg){
+    static const char *stray[] = {"then", "do", "done", "fi", "elif", "else", NULL};
+    char *rest;
+    Node *node;
+    if((rest = keyword(seg, "if")) != NULL){
+        return parseIf(p, rest);
+    }
+    if(((rest = keyword(seg, "while")) != NULL) || ((rest = keyword(seg, "until")) != NULL)){
+        node = newNode((*seg == 'w') ? NODE_WHILE : NODE_UNTIL, rest);
+        if(node != NULL){
+            parseLoopBody(p, node);
+        }
+        return node;
+    }
+    if((rest = keyword(seg, "for")) != NULL){
+        //for NAME in WORDS
+        char *name = rest;
+        while((*rest != 0) && (*rest != ' ') && (*rest != '\t')){
+            rest += 1;
+        }
+        if(*rest != 0){
+            *rest = 0;
+            rest = trim(rest + 1);
+        }
+        char *words = keyword(rest, "in");
+        if((*name == 0) || (words == NULL)){
+            syntaxError(p, "expected 'for NAME in WORDS'");
+            return NULL;
+        }
+        node = newNode(NODE_FOR, name);
+        if(node != NULL){
+            node->words = strdup(words);
+            node->lexed = node->words ? lexWords(node->words, 1) : NULL;
+            parseLoopBody(p, node);
+        }
+        return node;
+    }
+    if(keyword(seg, "break") != NULL){
+        return newNode(NODE_BREAK, NULL);
+    }
+    if(keyword(seg, "continue") != NULL){
+        return newNode(NODE_CONTINUE, NULL);
+    }
+    if(isKeyword(seg, stray) >= 0){
+        char msg[64];
+        snprintf(msg, sizeof(msg), "unexpected '%s'", stray[isKeyword(seg, stray)]);
+        syntaxError(p, msg);
+        return NULL;
+    }
+    return newNode(NODE_CMD, seg);
+}
+
+/*parse statements until a segment starting with one of terms, which is put
+back and reported through found. Stops at end of input with found NULL*/
+static Node *parseList(struct parser *p, const char **terms, const char **found){
+    Node *head = NULL;
+    Node **tail = &head;
+    char *seg;
+    *found = NULL;
+    while(!p->error && ((seg = nextSegment(p, 1)) != NULL)){
+        int term = isKeyword(seg, terms);
+        if(term >= 0){
+            *found = terms[term];
+            p->pushback = seg;
+            break;
+        }
+        Node *node = parseStatement(p, seg);
+        if(node != NULL){
+            *tail = node;
+            tail = &node->next;
+        }
+    }
+    return head;
+}
+
+//run a condition or command line and return its exit status
+static int runCommand(Node *node){
+    if(node->lexed != NULL){
+        processWords(node->lexed, node->text, 0, 1, WAIT);
+    }
+    else{
+        processline(node->text, 0, 1, WAIT | ((node->flags & NODE_EXPAND) ? EXPAND : 0));
+    }
+    return numberReplace;
+}
+
+/*run node and the ones after it. Loops check sigINT so ^C gets out of them*/
+int runNode(Node *node){
+    for(; (node != NULL) && (sigINT != 1); node = node->next){
+        switch(node->kind){
+        case NODE_CMD:
+            runCommand(node);
+            break;
+
+        case NODE_IF:{
+            int status = runCommand(node);
+            int res = RUN_NORMAL;
+            if(status == 0){
+                res = runNode(node->body);
+            }
+            else if(node->elseBody != NULL){
+                res = runNode(node->elseBody);
+            }
+            else{
+                numberReplace = 0;
+            }
+            if(res != RUN_NORMAL){
+                return res;
+            }
+            break;
+        }
+
+        case NODE_WHILE:
+        case NODE_UNTIL:{
+            int last = 0;
+            while(sigINT != 1){
+                int status = runCommand(node);
+                if((node->kind == NODE_WHILE) ? (status != 0) : (status == 0)){
+                    break;
+                }
+                int res = runNode(node->body);
+                last = numberReplace;
+                if(res == RUN_BREAK){
+                    break;
+                }
+            }
+            numberReplace = last;
+            break;
+        }
+
+        case NODE_FOR:{
+            //the word list is expanded once when the loop starts
+            ArenaMark mark = arenaMark(&lineArena);
+            int substitutions = substitutionMark();
+            int count = 0;
+            char **list = node->lexed ? expandLexed(node->lexed, 0, &count) : expandArgs(node->words, &count, 1);
+            //a <( ) in the list is read by the commands of the body
+            shareSubstitutions(substitutions);
+            numberReplace = 0;
+            for(int i = 0; (list != NULL) && (i < count) && (sigINT != 1); i++){
+                setVar(node->text, list[i], 0);
+                if(runNode(node->body) == RUN_BREAK){
+                    break;
+                }
+            }
+            endSubstitutions(substitutions, 1);
+            arenaRelease(&lineArena, mark);
+            break;
+        }
+
+        case NODE_BREAK:
+            return RUN_BREAK;
+
+        case NODE_CONTINUE:
+            return RUN_CONTINUE;
+        }
+    }
+    return RUN_NORMAL;
+}
+
+/*run the statements of a whole script. Like lines read one at a time, a ^C
+only stops the statement it happened in*/
+void runScript(Node *tree){
+    for(Node *node = tree; node != NULL; node = node->next){
+        Node *next = node->next;
+        sigINT = 0;
+        notifyJobs();
+        node->next = NULL;
+        runNode(node);
+        node->next = next;
+        arenaReset(&lineArena);
+    }
+}
+
+/*parse everything source has into one list of statements without running
+any of it. Returns NULL with error set if the input has a syntax error*/
+Node *parseScript(LineSource source, int *error){
+    struct parser p;
+    Node *head = NULL;
+    Node **tail = &head;
+    char *seg;
+    memset(&p, 0, sizeof(p));
+    p.source = source;
+    p.quiet = 1;
+    while(!p.error && ((seg = nextSegment(&p, 1)) != NULL)){
+        Node *node = parseStatement(&p, seg);
+        if(node != NULL){
+            *tail = node;
+            tail = &node->next;
+        }
+    }
+    free(p.line);
+    *error = p.error;
+    if(p.error){
+        freeNode(head);
+        return NULL;
+    }
+    return head;
+}
+
+//returns 1 if the line needs more than a plain processline
+static int needsParse(char *line){
+    static const char *keys[] = {"if", "while", "until", "for", "then", "do", "done",
+                                 "fi", "elif", "else", "break", "continue", NULL};
+    while((*line == ' ') || (*line == '\t')){
+        line += 1;
+    }
+    return (isKeyword(line, keys) >= 0) || (*segmentEnd(line, ';') == ';');
+}
+
+/*run one line of input. Lines that start a block keep pulling lines from
+source until the block is closed, the whole block is parsed before any of
+it runs*/
+void runLine(char *line, LineSource source){
+    if(!needsParse(line)){
+        processline(line, 0, 1, WAIT|EXPAND);
+        return;
+    }
+    struct parser p;
+    memset(&p, 0, sizeof(p));
+    p.source = source;
+    p.line = strdup(line);
+    p.pos = p.line;
+
+    char *seg;
+    while(!p.error && (sigINT != 1) && ((seg = nextSegment(&p, 0)) != NULL)){
+        Node *node = parseStatement(&p, seg);
+        if(!p.error){
+            runNode(node);
+        }
+        freeNode(node);
+    }
+    if(p.error){
+        numberReplace = 2;
+    }
+    free(p.line);
+}
@@ -4,10 +4,176 @@
 */
 
  #include <sys/types.h>
+ #include <stddef.h>
 
 #define WAIT 1
 #define NOWAIT 2
 #define EXPAND 4
+#define BACKGROUND 8        //part of a job started with &
+#define SUBSHELL 16         //builtins run in a forked child instead of the shell
+
+//how external commands are started
+#define SPAWN_POSIX 0
+#define SPAWN_FORK 1
+
+//bump allocator chunks, see arena.c
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t size;
+  size_t used;
+  char data[];
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk *first;
+  ArenaChunk *current;
+} Arena;
+
+//how far an arena was used, for arenaRelease
+typedef struct {
+  ArenaChunk *chunk;
+  size_t used;
+} ArenaMark;
+
+//growable, always null terminated character buffer
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+  Arena *arena;             //memory comes from here instead of malloc when set
+} Buffer;
+
+//kinds of control flow tree nodes
+#define NODE_CMD 1
+#define NODE_IF 2
+#define NODE_WHILE 3
+#define NODE_UNTIL 4
+#define NODE_FOR 5
+#define NODE_BREAK 6
+#define NODE_CONTINUE 7
+
+//kinds of WordPart, see expand.c
+#define PART_STAGE 1        //starts a pipeline stage, text is the stage as written
+#define PART_REDIRECT 2     //a redirection, its target word's parts follow up to PART_REDIRECT_END
+#define PART_REDIRECT_END 3
+#define PART_TEXT 4         //literal text of a word
+#define PART_QUOTE 5        //a ", the word is an arg even when it comes out empty
+#define PART_SPACE 6        //unquoted space, ends the word
+#define PART_PID 7          //$$
+#define PART_VAR 8          //${NAME}, text is NAME
+#define PART_ARG 9          //$N, text is N
+#define PART_COUNT 10       //$#
+#define PART_STATUS 11      //$?
+#define PART_GLOB 12        //text is the rest of the word from the first glob char
+#define PART_SUBST 13       //$( ), text is the command
+#define PART_PROCESS 14     //<( ) or >( ), text is the command
+
+//part flags
+#define PART_QUOTED 1       //inside "", not split into words
+#define PART_READING 2      //<( ) rather than >( )
+#define PART_NONE 0xffffffffu
+
+/*one piece of a lexed command. Offsets are into the strings that follow
+the parts, so a lexed command is one block that can be copied or mapped*/
+typedef struct {
+  int kind;
+  int flags;                //PART_ flags, or the open flags of a redirection
+  int fd;                   //redirections: the fd, and the fd copied for N>&M or -1
+  int dupFrom;
+  unsigned int text;        //offset of the null terminated text, PART_NONE for none
+  unsigned int lexed;       //commands of $( ) and <( ): offset of their own Words, or PART_NONE
+} WordPart;
+
+/*a command line lexed once so it can be expanded and run many times
+without being taken apart again*/
+typedef struct {
+  unsigned int count;       //parts
+  unsigned int stages;      //pipeline stages
+  unsigned int size;        //bytes of the whole block
+  WordPart parts[];         //followed by their strings
+} Words;
+
+//node flags
+#define NODE_EXPAND 1       //text has to go through expand
+
+/*one statement of a parsed block. text is the command line for NODE_CMD,
+the condition for if/while/until and the variable name for for*/
+typedef struct Node {
+  int kind;
+  int flags;
+  char *text;
+  char *words;              //for's word list
+  Words *lexed;             //text, or for's word list, lexed once. NULL to run it as text
+  struct Node *body;        //then or do part
+  struct Node *elseBody;    //else part, an if node for elif
+  struct Node *next;        //next statement in the same list
+} Node;
+
+/*where script lines come from: a mapped file, a string, or a file descriptor
+read in big blocks. Lines are handed out in place, without a length limit*/
+typedef struct {
+  char *data;               //mapped file or string, block holds fd input
+  size_t len;
+  size_t pos;               //start of the next line
+  int fd;                   //mapped file or block read source, -1 for strings
+  int mapped;
+  int eof;                  //fd has nothing more to read
+  Buffer block;
+  Buffer tail;              //copy of a mapped last line with no newline
+} Reader;
+
+//redirections of one command, see redirect.c
+#define REDIRECT_MAX 8
+#define REDIRECT_FDS 10     //a redirection can name fds below this, one digit
+typedef struct {
+  int fd;                   //0 to REDIRECT_FDS - 1
+  int openFlags;
+  int dupFrom;              //fd copied for N>&M, -1 when path is opened
+  char *path;
+} Redirect;
+
+typedef struct {
+  Redirect list[REDIRECT_MAX];
+  int count;
+  int opened[REDIRECT_MAX]; //files openRedirects opened for a builtin
+  int openCount;
+  int savedErr;             //the shell's stderr while a builtin has fd 2, or -1
+} Redirects;
+
+//expandTargets of takeRedirects: keep the targets as written and print no errors
+#define REDIRECT_RAW -1
+
+//character classes for lexNext, see lex.c
+#define LEX_SPACE 1         //space, tab, newline
+#define LEX_QUOTE 2         //" and backslash
+#define LEX_GROUP 4         //( and )
+#define LEX_SEP 8           //| & ;
+#define LEX_REDIRECT 16     //< and >
+#define LEX_EXPAND 32       //$ * ? [
+#define LEX_COMMENT 64      //#
+
+//kinds of trace events, see trace.c
+#define TRACE_LINE 0
+#define TRACE_EXPAND 1
+#define TRACE_GLOB 2
+#define TRACE_SUBST 3        //$( )
+#define TRACE_FORK 4
+#define TRACE_EXEC 5         //posix_spawn
+#define TRACE_WAIT 6
+#define TRACE_BUILTIN 7
+
+//open and close a trace event, only a test of traceOn while tracing is off
+#define TRACE_BEGIN(kind, name) (traceOn ? traceBegin((kind), (name)) : -1)
+#define TRACE_END(seq) do { if((seq) >= 0){ traceEnd(seq); } } while(0)
+
+//setVar flags
+#define VAR_EXPORT 1        //passed on to commands in their environment
+
+//outfd of a builtin writing into captureBuiltin's buffer, see output.c
+#define CAPTURE_FD -2
+
+//hands out the next line of input, more is set for continuation lines
+typedef char *(*LineSource)(int more);
 
 //global variables
 extern int argctr;
@@ -17,11 +183,153 @@ extern int numberReplace;
 extern int SIG;
 extern int sigINT;
 extern int alivechild;
+extern int spawnMode;
+extern int interactive;
+extern Arena lineArena;
+extern long statArenaAllocs;
+extern long statChunkMallocs;
+extern long statHeapAllocs;
+extern long statEnvBuilds;
+extern int traceOn;
+extern const char *builtinNames[];
 
 void my_strmode(mode_t mode, char *p);
 
-int expand(char *orig, char *new, int newsize);
+void *arenaAlloc(Arena *a, size_t size);
+void *arenaGrow(Arena *a, void *mem, size_t oldSize, size_t newSize);
+ArenaMark arenaMark(Arena *a);
+void arenaRelease(Arena *a, ArenaMark mark);
+void arenaReset(Arena *a);
+void reportStats(void);
+
+void bufInit(Buffer *b);
+void bufInitArena(Buffer *b, Arena *a);
+int bufReserve(Buffer *b, size_t extra);
+int bufAppend(Buffer *b, const char *str, size_t n);
+int bufPuts(Buffer *b, const char *str);
+int bufPutc(Buffer *b, char c);
+void bufTruncate(Buffer *b, size_t len);
+void bufFree(Buffer *b);
+
+long captureOutput(int fd, Buffer *out);
+long foldCapture(Buffer *out, size_t start);
+int writeAll(int fd, const char *data, size_t len);
+int captureBuiltin(char **args, int argc, Buffer *out);
+
+unsigned long hashString(const char *str);
+char *lookupCommand(const char *name);
+int hashCommand(const char *name);
+void clearCommandCache(void);
+int listCommandCache(int outfd);
+
+int hasGlobChars(const char *str);
+int globMatch(const char *pat, const char *name);
+char **globList(const char *pattern, long *count);
+long listDirectory(const char *dir, char ***names, unsigned char **types);
+int isDirectory(const char *path, unsigned char type);
+long walkTree(const char *base, int (*keep)(const char *path, int isDir, void *arg),
+              void (*callback)(const char *path, int isDir, void *arg), void *arg);
+
+int traceStart(void);
+void traceStop(void);
+long traceBegin(int kind, const char *name);
+void traceEnd(long seq);
+int traceWrite(const char *path);
+void traceUntilExit(const char *path);
+int traceBuiltin(char **args, int argc, int outfd);
+
+long substCacheGet(const char *command, Buffer *out);
+void substCachePut(const char *command, const char *output, size_t len, int status);
+int cacheBuiltin(char **args, int argc, int outfd);
+
+long historyCount(void);
+const char *historyEntry(long id, size_t *len);
+long historySearch(const char *text, long before);
+int historyAdd(const char *line);
+int historyBuiltin(char **args, int argc, int outfd);
+int canEdit(void);
+char *editLine(const char *prompt);
+void startCommandTrie(void);
+void rebuildCommandTrie(void);
+long completeLine(const char *line, size_t pos, size_t cols, size_t *start, Buffer *replace, Buffer *list);
 
-int execBuiltin(char **args, int argNumber, int outfd);
+void initVars(void);
+char *getVar(const char *name);
+int setVar(const char *name, const char *value, int flags);
+int exportVar(const char *name);
+void unsetVar(const char *name);
+int validVarName(const char *name, size_t len);
+int assignVars(char **args, int argc);
+char **varEnviron(void);
+unsigned long envHash(void);
+
+char *lexNext(const char *str, unsigned classes);
+const char *lexImplementation(void);
+
+char **expandArgs(char *orig, int *argc, int expansions);
+Words *lexCommand(char *line, int expansions);
+Words *lexWords(char *text, int expansions);
+int validWords(const Words *words, size_t size);
+const char *stageText(const Words *words, int stage);
+int expandRedirects(Words *words, int stage, Redirects *redirs);
+char **expandLexed(Words *words, int stage, int *argc);
+int substitutionMark(void);
+void shareSubstitutions(int mark);
+void endSubstitutions(int mark, int wait);
+
+pid_t launchCommand(char *path, char **argv, int inputFD, int outputFD, const Redirects *redirs, pid_t pgroup);
+pid_t forkBuiltin(char **argv, int argc, int inputFD, int outputFD, const Redirects *redirs, pid_t pgroup);
+
+char *takeRedirects(char *line, Redirects *redirs, int expandTargets);
+int checkRedirects(const Redirects *redirs);
+int openRedirects(Redirects *redirs, int *inputFD, int *outputFD);
+void closeRedirects(Redirects *redirs);
+int applyRedirects(const Redirects *redirs);
+
+int isBuiltin(const char *name);
+int builtinCaptures(const char *name);
+int execBuiltin(char **args, int argNumber, int infd, int outfd);
+int parallelBuiltin(char **args, int argc, int infd, int outfd);
+int printfBuiltin(char **args, int argc, int outfd);
+int putEscape(const char *str, Buffer *out, int *stop);
+int sstatBuiltin(char **args, int argc, int outfd);
+
+void initJobs(void);
+void reapJobs(void);
+void checkJobs(void);
+void notifyJobs(void);
+void startJob(char *line, int inputFD, int outputFD, int flags);
+pid_t jobGroup(void);
+void addJobProcess(pid_t pid);
+int jobsBuiltin(int argc, int outfd);
+int waitBuiltin(char **args, int argc);
+int bgBuiltin(char **args, int argc);
+int fgBuiltin(char **args, int argc);
 
 int processline (char *line, int inputFD, int outputFD, int flags);
+int processWords(Words *words, const char *text, int inputFD, int outputFD, int flags);
+pid_t processStage(Words *words, int stage, int inputFD, int outputFD, int flags);
+int runPipeline(char *line, int inputFD, int outputFD, int flags);
+int runPipelineWords(Words *words, int inputFD, int outputFD, int flags);
+int waitCommand(pid_t pid);
+void addStray(pid_t pid);
+int exitStatus(int status);
+void reportSignal(int status);
+
+char *segmentEnd(char *str, int sep);
+void runLine(char *line, LineSource source);
+int runNode(Node *node);
+void runScript(Node *tree);
+Node *parseScript(LineSource source, int *error);
+int needsExpand(const char *text);
+void freeNode(Node *node);
+
+Node *loadScript(const char *path, LineSource source);
+
+int readerOpenFile(Reader *r, const char *path);
+void readerOpenString(Reader *r, char *str);
+void readerOpenFd(Reader *r, int fd);
+char *readerLine(Reader *r);
+int readerRewind(Reader *r);
+void readerClose(Reader *r);
+void stripComment(char *line);
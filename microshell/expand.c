@@ -3,73 +3,426 @@
  * Used to expand given lines to assist microshell
 */
 
+#define _GNU_SOURCE
 #include "defn.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
-#include <dirent.h>
 #include <string.h>
 #include <signal.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/wait.h>
 
-// check context of filename, return 1 if matching, 0 if not.
-int checkContext(char *context, char *filename)
+// a <( ) or >( ) whose /dev/fd name went into a command line
+struct substitution
 {
-    int contextLen = strlen(context);
-    int fileLen = strlen(filename);
-    if (contextLen > fileLen)
+    int fd;     // the shell's end of the pipe, open until the command has started
+    pid_t pid;  // the command inside, 0 if it ran in the shell
+};
+
+static struct substitution *substitutions;
+static int substitutionCount;
+static int substitutionCap;
+
+// how many substitutions are open, the ones made after this belong to the next command
+int substitutionMark(void)
+{
+    return substitutionCount;
+}
+
+/* let the fds of the substitutions from mark on be inherited by the command
+about to start, until then they are close on exec so nothing else gets them*/
+void shareSubstitutions(int mark)
+{
+    for (int i = mark; i < substitutionCount; i++)
     {
-        return 0;
+        fcntl(substitutions[i].fd, F_SETFD, 0);
     }
-    for (int i = 1; i <= contextLen; i++)
+}
+
+/* close the shell's ends of the substitutions from mark on, now the command
+using them has started. With wait set their commands are reaped here, which
+can't block for long as their pipes are closed, otherwise waitCommand does it*/
+void endSubstitutions(int mark, int wait)
+{
+    for (int i = mark; i < substitutionCount; i++)
     {
-        if (filename[fileLen - i] != context[contextLen - i])
+        close(substitutions[i].fd);
+    }
+    for (int i = mark; i < substitutionCount; i++)
+    {
+        pid_t pid = substitutions[i].pid;
+        if (pid <= 0)
         {
-            return 0;
+            continue;
+        }
+        if (wait)
+        {
+            int status;
+            while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR))
+            {
+                ;
+            }
+        }
+        else
+        {
+            addStray(pid);
+        }
+    }
+    substitutionCount = mark;
+}
+
+/* start command on a pipe for <( ) (reading set, it writes to the pipe) or
+>( ) (it reads from it) and put the /dev/fd name of the shell's end in new.
+Builtins get a child of their own so a full or empty pipe can't hang the
+shell. Returns 0 or -1 on error*/
+static int startSubstitution(char *command, Words *lexed, int reading, Buffer *new)
+{
+    if (substitutionCount == substitutionCap)
+    {
+        int newCap = substitutionCap ? substitutionCap * 2 : 8;
+        struct substitution *grown = realloc(substitutions, newCap * sizeof(struct substitution));
+        if (grown == NULL)
+        {
+            perror("substitution realloc");
+            return -1;
+        }
+        substitutions = grown;
+        substitutionCap = newCap;
+    }
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) != 0)
+    {
+        perror("pipe failed");
+        return -1;
+    }
+    int flags = NOWAIT | EXPAND | SUBSHELL;
+    int in = reading ? 0 : fd[0];
+    int out = reading ? fd[1] : 1;
+    pid_t cpid = lexed ? processWords(lexed, command, in, out, flags) : processline(command, in, out, flags);
+    // the command has its end now, the shell only keeps the other one
+    close(reading ? fd[1] : fd[0]);
+    int keep = reading ? fd[0] : fd[1];
+    substitutions[substitutionCount].fd = keep;
+    substitutions[substitutionCount].pid = cpid;
+    substitutionCount += 1;
+
+    char name[32];
+    snprintf(name, sizeof(name), "/dev/fd/%d", keep);
+    return bufPuts(new, name);
+}
+
+// the ) matching an already opened (, with str just past the (. NULL if there is none
+static char *closingParenthesis(char *str)
+{
+    int parenthCount = 1;
+    for (; *str != 0; str++)
+    {
+        if (*str == '(')
+        {
+            parenthCount += 1;
+        }
+        else if ((*str == ')') && (--parenthCount == 0))
+        {
+            return str;
+        }
+    }
+    return NULL;
+}
+
+#define NOT_BUILTIN -2
+
+/* run the $( ) command in the shell when it is a builtin with no pipe, job,
+list or redirection: it writes into memory through CAPTURE_FD, with no pipe
+to fill up and no child to reap. The output is gathered in a heap buffer and
+only then added to out, builtins release the line arena around their own
+scratch space and would free what out grew into. lexed is command lexed by
+lexCommand or NULL. Returns the bytes added like captureOutput, -1 on an
+error or NOT_BUILTIN when it needs processline */
+static long builtinSubstitution(char *command, Words *lexed, Buffer *out)
+{
+    char *name = command + strspn(command, " \t");
+    size_t len = strcspn(name, " \t");
+    char first[16];
+    if ((len == 0) || (len >= sizeof(first)) || (*lexNext(command, LEX_SEP | LEX_REDIRECT) != 0))
+    {
+        return NOT_BUILTIN;
+    }
+    memcpy(first, name, len);
+    first[len] = 0;
+    if (!builtinCaptures(first))
+    {
+        return NOT_BUILTIN;
+    }
+    int argc = 0;
+    char **args = lexed ? expandLexed(lexed, 0, &argc) : expandArgs(command, &argc, 1);
+    if (args == NULL)
+    {
+        return -1;
+    }
+    Buffer captured;
+    bufInit(&captured);
+    int res = captureBuiltin(args, argc, &captured);
+    // same $? as processline gives a builtin
+    if ((res == 1) || (res == 2))
+    {
+        numberReplace = (res == 2);
+    }
+    long added = foldCapture(&captured, 0);
+    if ((added > 0) && (bufAppend(out, captured.data, added) != 0))
+    {
+        added = -1;
+    }
+    bufFree(&captured);
+    return added;
+}
+
+// one arg: a glob match is used where it is, anything else is a word in text
+struct argSlice
+{
+    char *path;     // the glob match, NULL when the arg is in text
+    size_t offset;  // where the arg starts in text
+};
+
+/* the args of a line as they are built. Words go into text one after
+another, each ended by a 0, so the finished args are slices of it*/
+struct argBuilder
+{
+    Buffer text;
+    size_t wordStart;       // where the word being built starts in text
+    int wordQuoted;         // the word had quotes, so it is an arg even when empty
+    struct argSlice *args;
+    int count;
+    int cap;
+};
+
+static int addSlice(struct argBuilder *b, char *path, size_t offset)
+{
+    if (b->count == b->cap)
+    {
+        int newCap = b->cap ? b->cap * 2 : 16;
+        struct argSlice *grown = arenaGrow(&lineArena, b->args, b->cap * sizeof(struct argSlice),
+                                           newCap * sizeof(struct argSlice));
+        if (grown == NULL)
+        {
+            return -1;
         }
+        b->args = grown;
+        b->cap = newCap;
     }
-    return 1;
+    b->args[b->count].path = path;
+    b->args[b->count].offset = offset;
+    b->count += 1;
+    return 0;
 }
 
-/*This function changes orig to something that is parseable by parsearg in ush.c
-it returns 1 if the expansion was successful and 0 otherwise. new will contain the
-expanded array of characters*/
-int expand(char *orig, char *new, int newsize)
+// finish the word being built, an empty one only counts if it had quotes
+static int endWord(struct argBuilder *b)
+{
+    if ((b->text.len > b->wordStart) || b->wordQuoted)
+    {
+        if ((bufPutc(&b->text, 0) != 0) || (addSlice(b, NULL, b->wordStart) != 0))
+        {
+            return -1;
+        }
+    }
+    b->wordStart = b->text.len;
+    b->wordQuoted = 0;
+    return 0;
+}
+
+/* split what an unquoted expansion put in text from start on into words,
+at spaces, tabs and newlines. The last piece stays open for what follows*/
+static int splitWords(struct argBuilder *b, size_t start)
+{
+    for (size_t i = start; i < b->text.len; i++)
+    {
+        char c = b->text.data[i];
+        if ((c != ' ') && (c != '\t') && (c != '\n'))
+        {
+            continue;
+        }
+        if ((i > b->wordStart) || b->wordQuoted)
+        {
+            b->text.data[i] = 0;
+            if (addSlice(b, NULL, b->wordStart) != 0)
+            {
+                return -1;
+            }
+            b->wordQuoted = 0;
+        }
+        b->wordStart = i + 1;
+    }
+    return 0;
+}
+
+/* glob the word being built, its text so far taken literally and rest (the
+raw rest of the word) as the pattern. Every match becomes an arg of its own,
+with no match the rest is added to the word without its escapes. Returns the
+number of matches or -1 on error*/
+static long globWord(struct argBuilder *b, const char *rest)
+{
+    Buffer pattern;
+    bufInitArena(&pattern, &lineArena);
+    for (size_t i = b->wordStart; i < b->text.len; i++)
+    {
+        if ((strchr("*?[\\", b->text.data[i]) != NULL) && (bufPutc(&pattern, '\\') != 0))
+        {
+            return -1;
+        }
+        if (bufPutc(&pattern, b->text.data[i]) != 0)
+        {
+            return -1;
+        }
+    }
+    if (bufPuts(&pattern, rest) != 0)
+    {
+        return -1;
+    }
+
+    long matches;
+    char **paths = globList(pattern.data, &matches);
+    if (matches > 0)
+    {
+        // the matches are the args, the word so far was part of the pattern
+        bufTruncate(&b->text, b->wordStart);
+        for (long i = 0; i < matches; i++)
+        {
+            if (addSlice(b, paths[i], 0) != 0)
+            {
+                free(paths);
+                return -1;
+            }
+        }
+        free(paths);
+        b->wordQuoted = 0;
+        return matches;
+    }
+    if (matches < 0)
+    {
+        return -1;
+    }
+    // if no matches found just copy over, dropping escapes
+    for (; *rest != 0; rest++)
+    {
+        if ((*rest == '\\') && (rest[1] != 0) && (strchr("*?[", rest[1]) != NULL))
+        {
+            rest += 1;
+        }
+        if (bufPutc(&b->text, *rest) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* a line being lexed: its parts and the strings they point into. The
+strings of the finished Words follow its parts, so offsets stay good when
+the two are put together*/
+struct lexer
+{
+    Buffer parts;
+    Buffer strings;
+    int stages;
+    int textOpen;   // the last part is text that more text can be added to
+    int compiling;  // lexCommand: syntax errors are left for when the line runs, $( ) is lexed too
+};
+
+static void lexError(struct lexer *l, const char *msg)
+{
+    if (!l->compiling)
+    {
+        fprintf(stderr, "%s\n", msg);
+    }
+}
+
+static int addPart(struct lexer *l, int kind, int flags, const char *text, size_t len, unsigned int lexed)
+{
+    WordPart part;
+    part.kind = kind;
+    part.flags = flags;
+    part.fd = -1;
+    part.dupFrom = -1;
+    part.text = (text != NULL) ? l->strings.len : PART_NONE;
+    part.lexed = lexed;
+    l->textOpen = (kind == PART_TEXT);
+    l->stages += (kind == PART_STAGE);
+    if ((text != NULL) && ((bufAppend(&l->strings, text, len) != 0) || (bufPutc(&l->strings, 0) != 0)))
+    {
+        return -1;
+    }
+    return bufAppend(&l->parts, (const char *)&part, sizeof(part));
+}
+
+// literal text, run together with the text part before it when there is one
+static int addText(struct lexer *l, const char *text, size_t len)
+{
+    if (!l->textOpen)
+    {
+        return addPart(l, PART_TEXT, 0, text, len, PART_NONE);
+    }
+    // drop the null of the open text and carry on from there
+    bufTruncate(&l->strings, l->strings.len - 1);
+    return ((bufAppend(&l->strings, text, len) != 0) || (bufPutc(&l->strings, 0) != 0)) ? -1 : 0;
+}
+
+/* the command of a $( ) or <( ) as a part. When compiling it is lexed as
+well, its Words going into the strings where the part can find it*/
+static int addCommand(struct lexer *l, int kind, int flags, char *command, size_t len)
+{
+    unsigned int lexed = PART_NONE;
+    if (l->compiling)
+    {
+        char end = command[len];
+        command[len] = 0;
+        Words *words = lexCommand(command, 1);
+        command[len] = end;
+        if (words != NULL)
+        {
+            // Words are read in place, keep them int aligned
+            while ((l->strings.len % sizeof(int)) != 0)
+            {
+                bufPutc(&l->strings, 0);
+            }
+            lexed = l->strings.len;
+            int res = bufAppend(&l->strings, (const char *)words, words->size);
+            free(words);
+            if (res != 0)
+            {
+                return -1;
+            }
+        }
+    }
+    return addPart(l, kind, flags, command, len, lexed);
+}
+
+/*Lex orig into parts: quotes are taken off as they are read and every $,
+glob and <( ) becomes a part of its own, so expanding it later is a walk
+over the parts with nothing scanned again. With expansions 0 only quotes
+and spaces mean anything. Returns 0 or -1 on a syntax error*/
+static int lexLine(struct lexer *l, char *orig, int expansions)
 {
     char *origTemp = orig;
-    char *newTemp = new;
-    char *name;
-    char *newTempTemp = new;
-    char *finalChar = newTempTemp + newsize;
     int dollar = 0;
+    int inQuotes = 0;      // inside "", where globs aren't expanded and words aren't split
 
     // iterate through orignal string
-    while ((*origTemp != 0) && (sigINT != 1))
+    while (*origTemp != 0)
     {
+        int quoted = inQuotes ? PART_QUOTED : 0;
 
-        // if we get a dollar sign, updated dollar counter, if it's the second in a row return ascii
-        if (*origTemp == '$')
+        // if we get a dollar sign, updated dollar counter, if it's the second in a row it is the pid
+        if ((*origTemp == '$') && expansions)
         {
-            // if we get second dollar sign in a row, then put ascii form of pid in new
             if (dollar == 1)
             {
-
-                char arry[6];
-                char *tempPID = arry;
-                sprintf(tempPID, "%d", getpid());
-                while (*tempPID != 0)
+                if (addPart(l, PART_PID, 0, NULL, 0, PART_NONE) != 0)
                 {
-                    // check for overflowing buffer
-                    if (finalChar == newTemp)
-                    {
-                        fprintf(stderr, "Overflowing newline in expand\n");
-                        return 0;
-                    }
-                    // else copy over to new and iterate both
-                    *newTemp = *tempPID;
-                    tempPID += 1;
-                    newTemp += 1;
+                    return -1;
                 }
                 dollar = 0;
             }
@@ -80,453 +433,743 @@ int expand(char *orig, char *new, int newsize)
             origTemp += 1;
         }
 
-        // if we get an open parenth after a $ character then find env and put into new
+        // if we get an open parenth after a $ character then it is a variable
         else if ((*origTemp == '{') && (dollar == 1))
         {
             dollar = 0;
             origTemp += 1;
-            name = origTemp;
-            while (*origTemp != '}')
+            char *end = strchr(origTemp, '}');
+            if (end == NULL)
             {
-                if (*origTemp == 0)
-                {
-                    fprintf(stderr, "No second curly brace\n");
-                    return 0;
-                }
-                origTemp += 1;
+                lexError(l, "No second curly brace");
+                return -1;
             }
-            *origTemp = 0;
-            char *env = getenv(name);
-
-            // go through environment  and copy into new
-            while (env && *env != 0)
+            if (addPart(l, PART_VAR, quoted, origTemp, end - origTemp, PART_NONE) != 0)
             {
-                // check for overflowing buffer
-                if (finalChar == newTemp)
-                {
-                    fprintf(stderr, "Overflowing newline in expand\n");
-                    return 0;
-                }
-                // else copy over to new and iterate both
-                *newTemp = *env;
-                env += 1;
-                newTemp += 1;
+                return -1;
             }
-            *origTemp = '}';
-            origTemp += 1;
+            origTemp = end + 1;
         }
 
         //$n case
         else if ((isdigit(*origTemp)) && (dollar == 1))
         {
             char *numStart = origTemp;
-            origTemp += 1;
             while (isdigit(*origTemp))
             {
                 origTemp += 1;
             }
-            // turn non digit into '\0' temporarily
-            char replace = *origTemp;
-            *origTemp = 0;
-            int num = atoi(numStart);
-            *origTemp = replace;
-            char *argString;
-            // if more than 1 arg
-            if (argctr != 1)
+            if (addPart(l, PART_ARG, quoted, numStart, origTemp - numStart, PART_NONE) != 0)
             {
-                if (num == 0)
-                {
-                    argString = *(argvs + 1);
-                    while (*argString != 0)
-                    {
-                        // check for overflowing buffer
-                        if (finalChar == newTemp)
-                        {
-                            fprintf(stderr, "Overflowing newline in expand\n");
-                            return 0;
-                        }
-                        // else copy over to new and iterate both
-                        *newTemp = *argString;
-                        argString += 1;
-                        newTemp += 1;
-                    }
-                }
+                return -1;
+            }
+            dollar = 0; // reset dollar count
+        }
 
-                // if digit isn't 0
-                else
-                {
-                    // if you asking for to large of an arg, do nothing
-                    if (num > argctr - shiftOffset - 2)
-                    {
-                        ;
-                    }
-                    else
-                    {
-                        argString = *(argvs + (num + 1) + shiftOffset);
-                        while (*argString != 0)
-                        {
-                            // check for overflowing buffer
-                            if (finalChar == newTemp)
-                            {
-                                fprintf(stderr, "Overflowing newline in expand\n");
-                                return 0;
-                            }
-                            // else copy over to new and iterate both
-                            *newTemp = *argString;
-                            argString += 1;
-                            newTemp += 1;
-                        }
-                    }
-                }
+        //$# case
+        else if ((*origTemp == '#') && (dollar == 1))
+        {
+            if (addPart(l, PART_COUNT, 0, NULL, 0, PART_NONE) != 0)
+            {
+                return -1;
             }
+            dollar = 0;
+            origTemp += 1;
+        }
 
-            // if there is 1 arg
-            else
+        // glob case, *, ? or [...] outside of quotes
+        else if (expansions && (dollar == 0) && (inQuotes == 0) &&
+                 ((*origTemp == '*') || (*origTemp == '?') || (*origTemp == '[')))
+        {
+            // rest of the word still to be expanded
+            size_t restLen = 0;
+            int plain = 1;
+            while ((origTemp[restLen] != 0) && (origTemp[restLen] != '\n') && (origTemp[restLen] != '\t') &&
+                   (origTemp[restLen] != ' ') && (origTemp[restLen] != '|'))
             {
-                if (num == 0)
+                if ((origTemp[restLen] == '$') || (origTemp[restLen] == '"'))
                 {
-                    char *argString = argvs[0];
-                    while (*argString != 0)
-                    {
-                        // check for overflowing buffer
-                        if (finalChar == newTemp)
-                        {
-                            fprintf(stderr, "Overflowing newline in expand\n");
-                            return 0;
-                        }
-                        // else copy over to new and iterate both
-                        *newTemp = *argString;
-                        argString += 1;
-                        newTemp += 1;
-                    }
+                    plain = 0;
                 }
-                // if its not $0, just give empty string
-                else
+                restLen += 1;
+            }
+            char replace = origTemp[restLen];
+            origTemp[restLen] = 0;
+            int glob = plain && hasGlobChars(origTemp);
+            origTemp[restLen] = replace;
+
+            // words with expansions or quotes after the glob char, or a lone [, stay literal
+            if (!glob)
+            {
+                if (addText(l, origTemp, 1) != 0)
                 {
-                    ;
+                    return -1;
                 }
+                origTemp += 1;
+                continue;
             }
-            dollar = 0; // reset dollar count
+            if (addPart(l, PART_GLOB, 0, origTemp, restLen, PART_NONE) != 0)
+            {
+                return -1;
+            }
+            origTemp += restLen;
         }
 
-        //$# case
-        else if ((*origTemp == '#') && (dollar == 1))
+        //$? case
+        else if ((*origTemp == '?') && (dollar == 1))
         {
-            char argString[10];
-            int NumberOfArgs;
-            if (argctr == 1)
+            if (addPart(l, PART_STATUS, 0, NULL, 0, PART_NONE) != 0)
             {
-                NumberOfArgs = 1;
+                return -1;
             }
-            else
+            origTemp += 1;
+            dollar = 0;
+        }
+
+        //<() and >() case, replaced by the /dev/fd name of a pipe to the command
+        else if (expansions && (dollar == 0) && (inQuotes == 0) && ((*origTemp == '<') || (*origTemp == '>')) &&
+                 (origTemp[1] == '('))
+        {
+            int reading = (*origTemp == '<') ? PART_READING : 0;
+            char *commandStart = origTemp + 2;
+            char *end = closingParenthesis(commandStart);
+            if (end == NULL)
             {
-                NumberOfArgs = (argctr - 1 - shiftOffset);
+                lexError(l, "No second parenthesis found");
+                return -1;
             }
-            sprintf(argString, "%d", NumberOfArgs);
-            int i = 0;
-            while (argString[i] != 0)
+            if (addCommand(l, PART_PROCESS, reading, commandStart, end - commandStart) != 0)
             {
-                // check for overflowing buffer
-                if (finalChar == newTemp)
-                {
-                    fprintf(stderr, "Overflowing newline in expand\n");
-                    return 0;
-                }
-                // else copy over to new and iterate both
-                *newTemp = argString[i];
-                i += 1;
-                newTemp += 1;
+                return -1;
             }
-            dollar = 0;
-            origTemp += 1;
+            origTemp = end + 1;
         }
 
-        //* case
-        else if (*origTemp == '*')
+        //$() case
+        else if ((*origTemp == '(') && (dollar == 1))
         {
-            int leading = 1; // 1 means the character before * checks out
-            origTemp -= 1;
-            if (!(*origTemp == ' '))
+            char *commandStart = origTemp + 1;
+            char *end = closingParenthesis(commandStart);
+            if (end == NULL)
             {
-                leading = 0;
+                lexError(l, "No second parenthesis found");
+                return -1;
             }
-            origTemp += 1;
-            char *originalString = origTemp;
-            origTemp += 1;
-            char *FileName;
-            struct dirent *DirRead;
-            DIR *openedDir = opendir(".");
-            // if it is * alone, put all files that don't start with . into new
-            if (((*origTemp == 0) | (*origTemp == '\n') | (*origTemp == ' ')) && (leading == 1))
+            if (addCommand(l, PART_SUBST, quoted, commandStart, end - commandStart) != 0)
+            {
+                return -1;
+            }
+            origTemp = end + 1;
+            dollar = 0;
+        }
+
+        // copy over from orig to new if no special case is found
+        else
+        {
+            // if we don't find second $ and no { after the first $,then put into new
+            if (dollar == 1)
             {
-                while ((DirRead = readdir(openedDir)) != NULL)
+                if (addText(l, "$", 1) != 0)
                 {
-                    FileName = DirRead->d_name;
-                    if (*FileName != '.')
-                    {
-                        while (*FileName != 0)
-                        {
-                            // check for overflowing buffer
-                            if (finalChar == newTemp)
-                            {
-                                fprintf(stderr, "Overflowing newline in expand\n");
-                                return 0;
-                            }
-                            *newTemp = *FileName;
-                            newTemp += 1;
-                            FileName += 1;
-                        }
-                        // check for overflowing buffer
-                        if (finalChar == newTemp)
-                        {
-                            fprintf(stderr, "Overflowing newline in expand\n");
-                            return 0;
-                        }
-                        *newTemp = ' ';
-                        newTemp += 1;
-                    }
+                    return -1;
                 }
-                // get rid of trailing space
-                newTemp -= 1;
+                dollar = 0;
             }
-
-            // if there is context, deal with it
-            else
+            // quotes only group, they don't go into the arg
+            if (*origTemp == '"')
             {
-                int matches = 0;
-                // make our context string
-                char *context = origTemp;
-                while ((*origTemp != 0) && (*origTemp != '\n') && (*origTemp != ' '))
+                inQuotes = !inQuotes;
+                if (addPart(l, PART_QUOTE, 0, NULL, 0, PART_NONE) != 0)
                 {
-                    origTemp += 1;
+                    return -1;
                 }
-                char temporary = *origTemp;
-                *origTemp = 0;
-
-                // compare context with filenames
-                while (((DirRead = readdir(openedDir)) != NULL) && (leading == 1))
+            }
+            else if (((*origTemp == ' ') || (*origTemp == '\t') || (*origTemp == '\n')) && !inQuotes)
+            {
+                // a run of spaces ends the word once
+                int last = (l->parts.len > 0) ? ((WordPart *)(l->parts.data + l->parts.len) - 1)->kind : 0;
+                if ((last != PART_SPACE) && (addPart(l, PART_SPACE, 0, NULL, 0, PART_NONE) != 0))
                 {
-                    for (size_t i = 0; i < strlen(context); i++)
-                    {
-                        if (context[i] == '/')
-                        {
-                            fprintf(stderr, "Found / in context string\n");
-                            return 0;
-                        }
-                    }
-                    FileName = DirRead->d_name;
-                    int contextStatus = checkContext(context, FileName);
-                    if ((*FileName != '.') && contextStatus)
-                    {
-                        matches += 1;
-                        while (*FileName != 0)
-                        {
-                            // check for overflowing buffer
-                            if (finalChar == newTemp)
-                            {
-                                fprintf(stderr, "Overflowing newline in expand\n");
-                                return 0;
-                            }
-                            *newTemp = *FileName;
-                            newTemp += 1;
-                            FileName += 1;
-                        }
-                        // check for overflowing buffer
-                        if (finalChar == newTemp)
-                        {
-                            fprintf(stderr, "Overflowing newline in expand\n");
-                            return 0;
-                        }
-                        *newTemp = ' ';
-                        newTemp += 1;
-                    }
+                    return -1;
                 }
-                // if no matches found just copy over
-                if (matches == 0)
+            }
+            else if (expansions && (*origTemp == '\\') && (*(origTemp + 1) != 0) &&
+                     (strchr("*?[", *(origTemp + 1)) != NULL))
+            {
+                origTemp += 1;
+                if (addText(l, origTemp, 1) != 0)
                 {
-                    while (*originalString != 0)
-                    {
-                        // check for overflowing buffer
-                        if (finalChar == newTemp)
-                        {
-                            fprintf(stderr, "Overflowing newline in expand\n");
-                            return 0;
-                        }
-                        *newTemp = *originalString;
-                        newTemp += 1;
-                        originalString += 1;
-                    }
+                    return -1;
                 }
-                // if found matches
-                else
+            }
+            else
+            {
+                // else copy over to new, along with the plain characters after it
+                char *special = lexNext(origTemp + 1, expansions ? LEX_SPACE | LEX_QUOTE | LEX_EXPAND | LEX_REDIRECT
+                                                                 : LEX_SPACE | LEX_QUOTE);
+                size_t run = special - origTemp;
+                if (addText(l, origTemp, run) != 0)
                 {
-                    // get rid of trailing space
-                    newTemp -= 1;
+                    return -1;
                 }
-                // replace the 0 we put in original
-                *origTemp = temporary;
+                origTemp += run - 1;
             }
-            closedir(openedDir);
+            origTemp += 1;
         }
+    }
 
-        //$? case
-        else if ((*origTemp == '?') && (dollar == 1))
+    if (inQuotes)
+    {
+        lexError(l, "No second quotes");
+        return -1;
+    }
+    // check for final dollar sign
+    if ((dollar == 1) && (addText(l, "$", 1) != 0))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static void lexerInit(struct lexer *l, int compiling)
+{
+    memset(l, 0, sizeof(*l));
+    l->compiling = compiling;
+    // compiled lines outlive the line they were lexed for
+    if (compiling)
+    {
+        bufInit(&l->parts);
+        bufInit(&l->strings);
+    }
+    else
+    {
+        bufInitArena(&l->parts, &lineArena);
+        bufInitArena(&l->strings, &lineArena);
+    }
+}
+
+// put the parts and strings together into one malloced Words, NULL if out of memory
+static Words *lexerFinish(struct lexer *l)
+{
+    size_t size = sizeof(Words) + l->parts.len + l->strings.len;
+    Words *words = (size <= UINT_MAX) ? malloc(size) : NULL;
+    if (words != NULL)
+    {
+        words->count = l->parts.len / sizeof(WordPart);
+        words->stages = l->stages;
+        words->size = size;
+        memcpy(words->parts, l->parts.data, l->parts.len);
+        memcpy(words->parts + words->count, l->strings.data, l->strings.len);
+    }
+    bufFree(&l->parts);
+    bufFree(&l->strings);
+    return words;
+}
+
+/*lex line once so it can be run again and again by processWords without
+being taken apart each time: its | stages, the redirections of each and
+their words. Returns malloced Words, or NULL when the line has to go
+through processline as text, because it starts & jobs or has a syntax
+error that should be reported when it runs*/
+Words *lexCommand(char *line, int expansions)
+{
+    if (*segmentEnd(line, '&') == '&')
+    {
+        return NULL;
+    }
+    ArenaMark mark = arenaMark(&lineArena);
+    struct lexer l;
+    lexerInit(&l, 1);
+    size_t len = strlen(line);
+    char *copy = arenaAlloc(&lineArena, len + 1);
+    int res = (copy != NULL) ? 0 : -1;
+    if (copy != NULL)
+    {
+        memcpy(copy, line, len + 1);
+    }
+    for (char *stage = copy; (res == 0) && (stage != NULL);)
+    {
+        char *end = segmentEnd(stage, '|');
+        char *next = (*end != 0) ? end + 1 : NULL;
+        *end = 0;
+        res = addPart(&l, PART_STAGE, 0, stage, end - stage, PART_NONE);
+        // the redirections first, their targets are expanded before the words like processline does
+        Redirects redirs;
+        redirs.count = 0;
+        char *rest = stage;
+        if ((res == 0) && (*lexNext(stage, LEX_REDIRECT) != 0))
         {
-            origTemp += 1;
-            char numb[50];
-            sprintf(numb, "%d", numberReplace);
-            int i = 0;
-            while (numb[i] != 0)
+            rest = takeRedirects(stage, &redirs, REDIRECT_RAW);
+            res = (rest != NULL) ? 0 : -1;
+        }
+        for (int i = 0; (res == 0) && (i < redirs.count); i++)
+        {
+            Redirect *redirect = &redirs.list[i];
+            const char *target = redirect->path;
+            res = addPart(&l, PART_REDIRECT, redirect->openFlags, target, target ? strlen(target) : 0, PART_NONE);
+            WordPart *part = (WordPart *)(l.parts.data + l.parts.len) - 1;
+            part->fd = redirect->fd;
+            part->dupFrom = redirect->dupFrom;
+            if ((res == 0) && (target != NULL))
             {
-                // check for overflowing buffer
-                if (finalChar == newTemp)
-                {
-                    fprintf(stderr, "Overflowing newline in expand\n");
-                    return 0;
-                }
-                *newTemp = numb[i];
-                newTemp += 1;
-                i += 1;
+                res = lexLine(&l, redirect->path, expansions);
+            }
+            if (res == 0)
+            {
+                res = addPart(&l, PART_REDIRECT_END, 0, NULL, 0, PART_NONE);
             }
-            dollar = 0;
         }
+        if (res == 0)
+        {
+            res = lexLine(&l, rest, expansions);
+        }
+        stage = next;
+    }
+    arenaRelease(&lineArena, mark);
+    if (res != 0)
+    {
+        bufFree(&l.parts);
+        bufFree(&l.strings);
+        return NULL;
+    }
+    return lexerFinish(&l);
+}
 
-        //$() case
-        else if ((*origTemp == '(') && (dollar == 1))
+// text lexed once as a plain list of words, for's word list. NULL on a syntax error
+Words *lexWords(char *text, int expansions)
+{
+    struct lexer l;
+    lexerInit(&l, 1);
+    if ((addPart(&l, PART_STAGE, 0, text, strlen(text), PART_NONE) != 0) || (lexLine(&l, text, expansions) != 0))
+    {
+        bufFree(&l.parts);
+        bufFree(&l.strings);
+        return NULL;
+    }
+    return lexerFinish(&l);
+}
+
+static char *partStrings(const Words *words)
+{
+    return (char *)(words->parts + words->count);
+}
+
+// the text of part lies inside the size bytes of strings, null included
+static int validText(const WordPart *part, const char *strings, size_t size)
+{
+    return (part->text < size) && (memchr(strings + part->text, 0, size - part->text) != NULL);
+}
+
+/*check words, size bytes read from a cache file, before anything runs it:
+every part, offset and nested command has to lie inside it and the stages
+and redirections have to be laid out the way lexCommand lays them out.
+Returns 1 when words can be used*/
+int validWords(const Words *words, size_t size)
+{
+    if ((size < sizeof(Words)) || (words->size < sizeof(Words)) || (words->size > size) ||
+        (words->count == 0) || (words->count > (words->size - sizeof(Words)) / sizeof(WordPart)) ||
+        (words->parts[0].kind != PART_STAGE))
+    {
+        return 0;
+    }
+    const char *strings = partStrings(words);
+    size_t stringsSize = words->size - sizeof(Words) - words->count * sizeof(WordPart);
+    unsigned int stages = 0;
+    int redirects = 0;
+    int inRedirect = 0;
+    int inWords = 0;
+    for (unsigned int i = 0; i < words->count; i++)
+    {
+        const WordPart *part = &words->parts[i];
+        if ((part->text != PART_NONE) && !validText(part, strings, stringsSize))
         {
-            origTemp += 1;
-            char *commandStart = origTemp;
-            int parenthCount = 1;
-            char c[1];
-            while (parenthCount != 0)
+            return 0;
+        }
+        switch (part->kind)
+        {
+        case PART_STAGE:
+            stages += 1;
+            redirects = 0;
+            inWords = 0;
+            if (inRedirect || (part->text == PART_NONE))
             {
-                if (*origTemp == '(')
-                {
-                    parenthCount += 1;
-                }
-                else if (*origTemp == ')')
-                {
-                    parenthCount -= 1;
-                }
-                else if (*origTemp == 0)
-                {
-                    fprintf(stderr, "No second parenthesis found\n");
-                    return 0;
-                }
-                origTemp += 1;
+                return 0;
             }
-            // replace last ) with end of string
-            origTemp -= 1;
-            *origTemp = 0;
-            int fd[2];
-            if (pipe(fd) != 0)
+            break;
+
+        case PART_REDIRECT:
+            // the fds index the fd tables of openRedirects
+            if (inRedirect || inWords || (++redirects > REDIRECT_MAX) || (part->fd < 0) || (part->fd >= REDIRECT_FDS) ||
+                (part->dupFrom < -1) || (part->dupFrom >= REDIRECT_FDS) || ((part->dupFrom < 0) == (part->text == PART_NONE)))
             {
-                perror("pipe failed");
                 return 0;
             }
+            inRedirect = 1;
+            break;
 
-            processline(commandStart, 0, fd[1], NOWAIT|EXPAND); // have process line write to fd[1]
-            *origTemp = ')';
-            origTemp += 1;
-            int spaceReplaced = 0;
-            close(fd[1]); // close before reading
-            while (read(fd[0], c, 1) == 1)
+        case PART_REDIRECT_END:
+            if (!inRedirect)
+            {
+                return 0;
+            }
+            inRedirect = 0;
+            break;
+
+        case PART_QUOTE:
+        case PART_SPACE:
+        case PART_PID:
+        case PART_COUNT:
+        case PART_STATUS:
+            inWords |= !inRedirect;
+            break;
+
+        case PART_ARG:
+            // $N indexes the args, N is digits only
+            if ((part->text == PART_NONE) || (strspn(strings + part->text, "0123456789") != strlen(strings + part->text)))
+            {
+                return 0;
+            }
+            inWords |= !inRedirect;
+            break;
+
+        case PART_TEXT:
+        case PART_VAR:
+        case PART_GLOB:
+            if (part->text == PART_NONE)
+            {
+                return 0;
+            }
+            inWords |= !inRedirect;
+            break;
+
+        case PART_SUBST:
+        case PART_PROCESS:
+            // a nested command is int aligned inside the strings and has to be valid itself
+            if ((part->text == PART_NONE) ||
+                ((part->lexed != PART_NONE) && (((part->lexed % sizeof(int)) != 0) || (part->lexed >= stringsSize) ||
+                                                !validWords((const Words *)(strings + part->lexed), stringsSize - part->lexed))))
             {
-                if (c[0] == '\n')
+                return 0;
+            }
+            inWords |= !inRedirect;
+            break;
+
+        default:
+            return 0;
+        }
+    }
+    return !inRedirect && (stages == words->stages);
+}
+
+/*expand parts into b, up to the first stage or redirection part. Returns 0
+or -1 on an error or ^C*/
+static int expandParts(struct argBuilder *b, const WordPart *parts, unsigned int count, char *strings)
+{
+    for (unsigned int i = 0; (i < count) && (sigINT != 1); i++)
+    {
+        const WordPart *part = &parts[i];
+        char *text = (part->text != PART_NONE) ? strings + part->text : NULL;
+        int quoted = part->flags & PART_QUOTED;
+        size_t start = b->text.len;
+        switch (part->kind)
+        {
+        case PART_STAGE:
+        case PART_REDIRECT:
+        case PART_REDIRECT_END:
+            return 0;
+
+        case PART_TEXT:
+            if (bufPuts(&b->text, text) != 0)
+            {
+                return -1;
+            }
+            break;
+
+        case PART_QUOTE:
+            b->wordQuoted = 1;
+            break;
+
+        case PART_SPACE:
+            if (endWord(b) != 0)
+            {
+                return -1;
+            }
+            break;
+
+        case PART_PID:{
+            char arry[12];
+            sprintf(arry, "%d", getpid());
+            if (bufPuts(&b->text, arry) != 0)
+            {
+                return -1;
+            }
+            break;
+        }
+
+        case PART_VAR:{
+            // the value goes into the word, unquoted it is split at spaces
+            char *env = getVar(text);
+            if ((env && (bufPuts(&b->text, env) != 0)) || (!quoted && (splitWords(b, start) != 0)))
+            {
+                return -1;
+            }
+            break;
+        }
+
+        case PART_ARG:{
+            int num = atoi(text);
+            char *argString = NULL;
+            // if more than 1 arg
+            if (argctr != 1)
+            {
+                if (num == 0)
                 {
-                    // check for overflowing buffer
-                    if (finalChar == newTemp)
-                    {
-                        fprintf(stderr, "Overflowing newline in expand\n");
-                        return 0;
-                    }
-                    *newTemp = ' ';
-                    newTemp += 1;
-                    spaceReplaced = 1;
+                    argString = *(argvs + 1);
                 }
-                else
+
+                // if you asking for to large of an arg, do nothing
+                else if (num <= argctr - shiftOffset - 2)
                 {
-                    // check for overflowing buffer
-                    if (finalChar == newTemp)
-                    {
-                        fprintf(stderr, "Overflowing newline in expand\n");
-                        return 0;
-                    }
-                    *newTemp = c[0];
-                    newTemp += 1;
-                    spaceReplaced = 0;
+                    argString = *(argvs + (num + 1) + shiftOffset);
                 }
             }
-            if (spaceReplaced)
+
+            // if there is 1 arg, only $0 has anything
+            else if (num == 0)
             {
-                newTemp -= 1;
-                *newTemp = 0;
+                argString = argvs[0];
             }
-            dollar = 0;
-            close(fd[0]);
-            int status;
-            //kill any zombies
-            while(wait(&status) > 0){
-            ;
+            if ((argString && (bufPuts(&b->text, argString) != 0)) || (!quoted && (splitWords(b, start) != 0)))
+            {
+                return -1;
             }
+            break;
+        }
 
-            if(WIFEXITED(status)){
-                numberReplace = WEXITSTATUS(status);
+        case PART_COUNT:{
+            char argString[10];
+            int NumberOfArgs = (argctr == 1) ? 1 : (argctr - 1 - shiftOffset);
+            sprintf(argString, "%d", NumberOfArgs);
+            if (bufPuts(&b->text, argString) != 0)
+            {
+                return -1;
             }
-            else if(WIFSIGNALED(status)){
-                int SIG = WTERMSIG(status);
-                numberReplace = 128 + SIG;
+            break;
+        }
+
+        case PART_STATUS:{
+            char numb[50];
+            sprintf(numb, "%d", numberReplace);
+            if (bufPuts(&b->text, numb) != 0)
+            {
+                return -1;
             }
+            break;
         }
 
-        // copy over from orig to new if no special case is found
-        else
-        {
-            if ((*origTemp == '\\') && (*(origTemp + 1) == '*'))
+        case PART_GLOB:{
+            long trace = TRACE_BEGIN(TRACE_GLOB, text);
+            long matches = globWord(b, text);
+            TRACE_END(trace);
+            if (matches < 0)
             {
-                origTemp += 1;
+                return -1;
             }
-            // check for overflowing buffer
-            if (finalChar == newTemp)
+            break;
+        }
+
+        case PART_PROCESS:{
+            Words *lexed = (part->lexed != PART_NONE) ? (Words *)(strings + part->lexed) : NULL;
+            if (startSubstitution(text, lexed, part->flags & PART_READING, &b->text) != 0)
             {
-                fprintf(stderr, "Overflowing newline in expand\n");
-                return 0;
+                return -1;
             }
-            // if we don't find second $ and no { after the first $,then put into new
-            if (dollar == 1)
+            break;
+        }
+
+        case PART_SUBST:{
+            Words *lexed = (part->lexed != PART_NONE) ? (Words *)(strings + part->lexed) : NULL;
+            long trace = TRACE_BEGIN(TRACE_SUBST, text);
+            // output of an earlier run when the cache builtin allows it, see substcache.c
+            long captured = substCacheGet(text, &b->text);
+            if (captured < 0)
             {
-                *newTemp = '$';
-                newTemp += 1;
-                // check for overflowing buffer
-                if (finalChar == newTemp)
+                captured = builtinSubstitution(text, lexed, &b->text);
+            }
+            if (captured == NOT_BUILTIN)
+            {
+                int fd[2];
+                if (pipe(fd) != 0)
                 {
-                    fprintf(stderr, "Overflowing newline in expand\n");
-                    return 0;
+                    perror("pipe failed");
+                    TRACE_END(trace);
+                    return -1;
+                }
+
+                // have the command write to fd[1]
+                pid_t cpid = lexed ? processWords(lexed, text, 0, fd[1], NOWAIT)
+                                   : processline(text, 0, fd[1], NOWAIT|EXPAND);
+                close(fd[1]); // close before reading
+                // read the output in large chunks straight into the word, unquoted it is split at spaces
+                captured = captureOutput(fd[0], &b->text);
+                close(fd[0]);
+                //builtins ran in place and already set $?
+                if(cpid > 0){
+                    numberReplace = waitCommand(cpid);
+                }
+                if (captured >= 0)
+                {
+                    substCachePut(text, b->text.data + start, b->text.len - start, numberReplace);
                 }
-                dollar = 0;
             }
-            // else copy over to new and iterate
-            *newTemp = *origTemp;
-            newTemp += 1;
-            origTemp += 1;
+            TRACE_END(trace);
+
+            if ((captured < 0) || (!quoted && (splitWords(b, start) != 0)))
+            {
+                return -1;
+            }
+            break;
+        }
         }
     }
+    return (sigINT == 1) ? -1 : 0;
+}
 
-    // check for final dollar sign
-    if (dollar == 1)
+// index of the PART_STAGE that starts stage of words
+static unsigned int findStage(const Words *words, int stage)
+{
+    unsigned int i = 0;
+    for (; i < words->count; i++)
     {
-        // check for overflowing buffer
-        if (finalChar == newTemp)
+        if ((words->parts[i].kind == PART_STAGE) && (stage-- == 0))
         {
-            fprintf(stderr, "Overflowing newline in expand\n");
-            return 0;
+            break;
         }
-        *newTemp = '$';
-        newTemp += 1;
     }
+    return i;
+}
+
+// stage as it was written, for trace names
+const char *stageText(const Words *words, int stage)
+{
+    unsigned int i = findStage(words, stage);
+    return (i < words->count) ? partStrings(words) + words->parts[i].text : "";
+}
+
+static void builderInit(struct argBuilder *b)
+{
+    memset(b, 0, sizeof(*b));
+    bufInitArena(&b->text, &lineArena);
+}
+
+// the words of b as a null terminated argv on lineArena, NULL if out of memory
+static char **finishArgs(struct argBuilder *b, int *argc)
+{
+    if (endWord(b) != 0)
+    {
+        return NULL;
+    }
+    // the slices become argv
+    char **argv = arenaAlloc(&lineArena, (b->count + 1) * sizeof(char *));
+    if (argv == NULL)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < b->count; i++)
+    {
+        argv[i] = b->args[i].path ? b->args[i].path : b->text.data + b->args[i].offset;
+    }
+    argv[b->count] = NULL;
+    *argc = b->count;
+    return argv;
+}
+
+/*Expand orig and split it into args: glob matches and unquoted expansions
+become args of their own. With expansions 0 only quotes and spaces mean
+anything. Returns a null terminated argv on lineArena with argc set, or NULL
+on an error or ^C*/
+char **expandArgs(char *orig, int *argc, int expansions)
+{
+    long trace = TRACE_BEGIN(TRACE_EXPAND, orig);
+    char **argv = NULL;
+    struct lexer l;
+    struct argBuilder b;
+    lexerInit(&l, 0);
+    builderInit(&b);
+    if ((lexLine(&l, orig, expansions) == 0) && (bufReserve(&b.text, strlen(orig)) == 0) &&
+        (expandParts(&b, (WordPart *)l.parts.data, l.parts.len / sizeof(WordPart), l.strings.data) == 0))
+    {
+        argv = finishArgs(&b, argc);
+    }
+    TRACE_END(trace);
+    return argv;
+}
 
-    *newTemp = 0;
+/*expand the redirection targets of stage of words into redirs, each has to
+come out as exactly one arg. Returns 0 or -1 after printing an error*/
+int expandRedirects(Words *words, int stage, Redirects *redirs)
+{
+    char *strings = partStrings(words);
+    redirs->count = 0;
+    for (unsigned int i = findStage(words, stage) + 1; (i < words->count) && (words->parts[i].kind == PART_REDIRECT); i++)
+    {
+        const WordPart *part = &words->parts[i];
+        Redirect *redirect = &redirs->list[redirs->count++];
+        redirect->fd = part->fd;
+        redirect->openFlags = part->flags;
+        redirect->dupFrom = part->dupFrom;
+        redirect->path = NULL;
+        if (part->text != PART_NONE)
+        {
+            struct argBuilder b;
+            int count = 0;
+            char **args = NULL;
+            builderInit(&b);
+            if (expandParts(&b, part + 1, words->count - i - 1, strings) == 0)
+            {
+                args = finishArgs(&b, &count);
+            }
+            if (args == NULL)
+            {
+                return -1;
+            }
+            if (count != 1)
+            {
+                fprintf(stderr, "%s: ambiguous redirect\n", strings + part->text);
+                return -1;
+            }
+            redirect->path = args[0];
+        }
+        while (words->parts[i].kind != PART_REDIRECT_END)
+        {
+            i += 1;
+        }
+    }
+    return 0;
+}
 
-    // if we find null that means we got through without errors so return 1 to mean success.
-    return 1;
+/*expand the words of stage of words, lexed by lexCommand or lexWords, the
+way processline expands and splits text. Returns a null terminated argv on
+lineArena with argc set, or NULL on an error or ^C*/
+char **expandLexed(Words *words, int stage, int *argc)
+{
+    unsigned int i = findStage(words, stage);
+    long trace = TRACE_BEGIN(TRACE_EXPAND, (i < words->count) ? partStrings(words) + words->parts[i].text : NULL);
+    // past the stage and its redirections
+    for (i += 1; (i < words->count) && (words->parts[i].kind == PART_REDIRECT); i++)
+    {
+        while (words->parts[i].kind != PART_REDIRECT_END)
+        {
+            i += 1;
+        }
+    }
+    char **argv = NULL;
+    struct argBuilder b;
+    builderInit(&b);
+    if (expandParts(&b, words->parts + i, words->count - i, partStrings(words)) == 0)
+    {
+        argv = finishArgs(&b, argc);
+    }
+    TRACE_END(trace);
+    return argv;
 }
@@ -0,0 +1,580 @@
+/* Author: Calvin Kerns
+ * Filename globbing for expand: *, ?, [...] in any path component and **
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define DIRCACHE_START 16
+
+/*sorted listing of one directory, kept for the life of the shell and
+trusted for as long as the directory's mtime doesn't change*/
+struct dirListing {
+    int used;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    int racy;               //listed too close to mtime to trust next time
+    size_t count;
+    char **names;           //sorted, point into block
+    unsigned char *types;   //d_type of each name
+    char *block;
+};
+
+//open addressing table of listings keyed on device and inode
+static struct dirListing *dirCache;
+static size_t cacheSize;
+static size_t cacheUsed;
+
+static struct dirListing *findListing(struct dirListing *table, size_t size, dev_t dev, ino_t ino){
+    size_t i = ((unsigned long)ino * 0x9E3779B97F4A7C15UL ^ (unsigned long)dev) & (size - 1);
+    while(table[i].used && ((table[i].dev != dev) || (table[i].ino != ino))){
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+static int growCache(void){
+    size_t newSize = cacheSize ? cacheSize * 2 : DIRCACHE_START;
+    struct dirListing *newTable = calloc(newSize, sizeof(struct dirListing));
+    if(newTable == NULL){
+        return -1;
+    }
+    for(size_t i = 0; i < cacheSize; i++){
+        if(dirCache[i].used){
+            *findListing(newTable, newSize, dirCache[i].dev, dirCache[i].ino) = dirCache[i];
+        }
+    }
+    free(dirCache);
+    dirCache = newTable;
+    cacheSize = newSize;
+    return 0;
+}
+
+//returns 1 if str has an unescaped *, ?, or a [ with a closing ]
+int hasGlobChars(const char *str){
+    for(const char *p = str; *p != 0; p++){
+        if((*p == '\\') && (p[1] != 0)){
+            p += 1;
+        }
+        else if((*p == '*') || (*p == '?')){
+            return 1;
+        }
+        else if((*p == '[') && (strchr(p + 1, ']') != NULL)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*match a [...] class at pat against c. Returns a pointer past the closing ]
+and sets matched, or NULL if the class never closes (then [ is literal)*/
+static const char *matchClass(const char *pat, char c, int *matched){
+    int negate = 0;
+    *matched = 0;
+    pat += 1;
+    if((*pat == '!') || (*pat == '^')){
+        negate = 1;
+        pat += 1;
+    }
+    //a ] right after the [ is part of the set
+    int first = 1;
+    while(first || (*pat != ']')){
+        first = 0;
+        if(*pat == 0){
+            return NULL;
+        }
+        char low = *pat;
+        if((low == '\\') && (pat[1] != 0)){
+            pat += 1;
+            low = *pat;
+        }
+        char high = low;
+        if((pat[1] == '-') && (pat[2] != ']') && (pat[2] != 0)){
+            pat += 2;
+            high = *pat;
+            if((high == '\\') && (pat[1] != 0)){
+                pat += 1;
+                high = *pat;
+            }
+        }
+        if(((unsigned char)c >= (unsigned char)low) && ((unsigned char)c <= (unsigned char)high)){
+            *matched = 1;
+        }
+        pat += 1;
+    }
+    if(negate){
+        *matched = !*matched;
+    }
+    return pat + 1;
+}
+
+/*returns 1 if name matches the single path component pattern. A * is
+matched by remembering the last star and retrying from one character
+further on a mismatch, so there is no recursion*/
+int globMatch(const char *pat, const char *name){
+    const char *starPat = NULL;
+    const char *starName = NULL;
+    while(*name != 0){
+        int matched;
+        const char *next;
+        if(*pat == '*'){
+            starPat = ++pat;
+            starName = name;
+            continue;
+        }
+        if(*pat == '?'){
+            pat += 1;
+            name += 1;
+            continue;
+        }
+        if((*pat == '[') && ((next = matchClass(pat, *name, &matched)) != NULL)){
+            if(matched){
+                pat = next;
+                name += 1;
+                continue;
+            }
+        }
+        else{
+            const char *lit = pat;
+            if((*lit == '\\') && (lit[1] != 0)){
+                lit += 1;
+            }
+            if((*lit != 0) && (*lit == *name)){
+                pat = lit + 1;
+                name += 1;
+                continue;
+            }
+        }
+        //mismatch, let the last * eat one more character
+        if(starPat == NULL){
+            return 0;
+        }
+        pat = starPat;
+        name = ++starName;
+    }
+    while(*pat == '*'){
+        pat += 1;
+    }
+    return *pat == 0;
+}
+
+static int cmpNames(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void freeListing(struct dirListing *list){
+    free(list->names);
+    free(list->types);
+    free(list->block);
+    list->names = NULL;
+    list->types = NULL;
+    list->block = NULL;
+    list->count = 0;
+}
+
+//read dir into list, names sorted, . and .. left out
+static int readListing(const char *dir, struct dirListing *list){
+    DIR *opened = opendir(dir);
+    if(opened == NULL){
+        return -1;
+    }
+    Buffer block;
+    Buffer types;
+    bufInit(&block);
+    bufInit(&types);
+    size_t count = 0;
+    struct dirent *entry;
+    while((entry = readdir(opened)) != NULL){
+        char *name = entry->d_name;
+        if((name[0] == '.') && ((name[1] == 0) || ((name[1] == '.') && (name[2] == 0)))){
+            continue;
+        }
+        if((bufAppend(&block, name, strlen(name) + 1) != 0) || (bufPutc(&types, entry->d_type) != 0)){
+            closedir(opened);
+            bufFree(&block);
+            bufFree(&types);
+            return -1;
+        }
+        count += 1;
+    }
+    closedir(opened);
+
+    //sort an array of (name, type) pairs by name, then split it back up
+    struct { char *name; unsigned char type; } *pairs = malloc(sizeof(*pairs) * (count + 1));
+    list->names = malloc(sizeof(char *) * (count + 1));
+    list->types = malloc(count + 1);
+    if((pairs == NULL) || (list->names == NULL) || (list->types == NULL)){
+        free(pairs);
+        bufFree(&block);
+        bufFree(&types);
+        freeListing(list);
+        return -1;
+    }
+    char *name = block.data;
+    for(size_t i = 0; i < count; i++){
+        pairs[i].name = name;
+        pairs[i].type = types.data[i];
+        name += strlen(name) + 1;
+    }
+    qsort(pairs, count, sizeof(*pairs), cmpNames);
+    for(size_t i = 0; i < count; i++){
+        list->names[i] = pairs[i].name;
+        list->types[i] = pairs[i].type;
+    }
+    free(pairs);
+    bufFree(&types);
+    list->block = block.data;
+    list->count = count;
+    return 0;
+}
+
+/*return the sorted listing of dir, from the cache if the directory hasn't
+changed since we last read it. Only one stat is needed to check that*/
+static struct dirListing *getListing(const char *dir){
+    struct stat stats;
+    if((stat(dir, &stats) != 0) || !S_ISDIR(stats.st_mode)){
+        return NULL;
+    }
+    if(((cacheUsed + 1) * 10 >= cacheSize * 7) && (growCache() != 0)){
+        return NULL;
+    }
+    struct dirListing *list = findListing(dirCache, cacheSize, stats.st_dev, stats.st_ino);
+    if(list->used){
+        if(!list->racy && (list->mtime.tv_sec == stats.st_mtim.tv_sec) &&
+           (list->mtime.tv_nsec == stats.st_mtim.tv_nsec)){
+            return list;
+        }
+        freeListing(list);
+    }
+    else{
+        list->used = 1;
+        list->dev = stats.st_dev;
+        list->ino = stats.st_ino;
+        cacheUsed += 1;
+    }
+    if(readListing(dir, list) != 0){
+        /*keep the slot so the probe chains through it still work, but never
+        trust it, or this directory would list as empty until it changed*/
+        list->racy = 1;
+        return NULL;
+    }
+    list->mtime = stats.st_mtim;
+    //a change in the same second as our read might not move mtime, so a
+    //directory modified that recently gets read again next time
+    list->racy = (time(NULL) - stats.st_mtim.tv_sec) < 2;
+    return list;
+}
+
+/*sorted names in dir, without . and .., and their d_types, from the
+listing cache. Returns how many or -1, they stay good until dir is listed
+again*/
+long listDirectory(const char *dir, char ***names, unsigned char **types){
+    struct dirListing *list = getListing(dir);
+    if(list == NULL){
+        return -1;
+    }
+    *names = list->names;
+    *types = list->types;
+    return list->count;
+}
+
+//d_type fast path, only falls back to stat when the filesystem didn't say
+int isDirectory(const char *path, unsigned char type){
+    struct stat stats;
+    if(type == DT_DIR){
+        return 1;
+    }
+    if((type != DT_UNKNOWN) && (type != DT_LNK)){
+        return 0;
+    }
+    return (stat(path, &stats) == 0) && S_ISDIR(stats.st_mode);
+}
+
+//length of the literal text at the start of pat, stopping at any special char
+static size_t literalPrefix(const char *pat){
+    size_t len = 0;
+    while((pat[len] != 0) && (strchr("*?[\\", pat[len]) == NULL)){
+        len += 1;
+    }
+    return len;
+}
+
+//copy pat without its backslash escapes
+static void unescape(const char *pat, Buffer *out){
+    while(*pat != 0){
+        if((*pat == '\\') && (pat[1] != 0)){
+            pat += 1;
+        }
+        bufPutc(out, *pat);
+        pat += 1;
+    }
+}
+
+//list of paths matched so far
+typedef struct {
+    char **paths;
+    size_t count;
+    size_t cap;
+} PathList;
+
+/*the paths themselves go on lineArena, so the final matches can be handed
+out as args without another copy*/
+static int addPath(PathList *list, const char *path, size_t len){
+    if(list->count == list->cap){
+        size_t newCap = list->cap ? list->cap * 2 : 16;
+        char **grown = realloc(list->paths, newCap * sizeof(char *));
+        if(grown == NULL){
+            return -1;
+        }
+        list->paths = grown;
+        list->cap = newCap;
+    }
+    char *copy = arenaAlloc(&lineArena, len + 1);
+    if(copy == NULL){
+        return -1;
+    }
+    memcpy(copy, path, len);
+    copy[len] = 0;
+    list->paths[list->count++] = copy;
+    return 0;
+}
+
+static void freePaths(PathList *list){
+    free(list->paths);
+    list->paths = NULL;
+    list->count = 0;
+    list->cap = 0;
+}
+
+/*match one pattern component against the entries of every path in from,
+adding hits to to. last is 0 when more components follow, so only
+directories are kept*/
+static void matchComponent(PathList *from, const char *comp, int last, PathList *to){
+    Buffer path;
+    bufInit(&path);
+    size_t prefix = literalPrefix(comp);
+    int showHidden = (comp[0] == '.');
+    for(size_t i = 0; (i < from->count) && (sigINT != 1); i++){
+        char *base = from->paths[i];
+        struct dirListing *list = getListing(*base ? base : ".");
+        if(list == NULL){
+            continue;
+        }
+        //names are sorted, so a literal prefix narrows the search to one run
+        size_t lo = 0;
+        size_t hi = list->count;
+        if(prefix > 0){
+            while(lo < hi){
+                size_t mid = (lo + hi) / 2;
+                if(strncmp(list->names[mid], comp, prefix) < 0){
+                    lo = mid + 1;
+                }
+                else{
+                    hi = mid;
+                }
+            }
+            hi = list->count;
+        }
+        for(size_t j = lo; j < hi; j++){
+            char *name = list->names[j];
+            if((prefix > 0) && (strncmp(name, comp, prefix) != 0)){
+                break;
+            }
+            if(((name[0] == '.') && !showHidden) || !globMatch(comp, name)){
+                continue;
+            }
+            bufTruncate(&path, 0);
+            if(*base){
+                bufPuts(&path, base);
+                if(base[strlen(base) - 1] != '/'){
+                    bufPutc(&path, '/');
+                }
+            }
+            bufPuts(&path, name);
+            if(!last && !isDirectory(path.data, list->types[j])){
+                continue;
+            }
+            addPath(to, path.data, path.len);
+        }
+    }
+    bufFree(&path);
+}
+
+//append a literal component to every path in from, keeping ones that exist
+static void literalComponent(PathList *from, const char *comp, int last, PathList *to){
+    Buffer path;
+    bufInit(&path);
+    struct stat stats;
+    for(size_t i = 0; i < from->count; i++){
+        char *base = from->paths[i];
+        bufTruncate(&path, 0);
+        if(*base){
+            bufPuts(&path, base);
+            if(base[strlen(base) - 1] != '/'){
+                bufPutc(&path, '/');
+            }
+        }
+        unescape(comp, &path);
+        if(lstat(path.data, &stats) != 0){
+            continue;
+        }
+        if(!last && (stat(path.data, &stats) != 0 || !S_ISDIR(stats.st_mode))){
+            continue;
+        }
+        addPath(to, path.data, path.len);
+    }
+    bufFree(&path);
+}
+
+//what a ** walk keeps, final is the component after ** when it is the last one
+struct recurseMatch {
+    const char *final;
+    int dirsOnly;
+    PathList *to;
+};
+
+static int keepRecursive(const char *path, int isDir, void *arg){
+    struct recurseMatch *match = arg;
+    if(match->dirsOnly && !isDir){
+        return 0;
+    }
+    if(match->final == NULL){
+        return 1;
+    }
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    return globMatch(match->final, name);
+}
+
+static void addRecursive(const char *path, int isDir, void *arg){
+    (void)isDir;
+    struct recurseMatch *match = arg;
+    addPath(match->to, path, strlen(path));
+}
+
+/*a ** component matches any number of directories, including none. final
+is the component after it if that one ends the pattern, it is matched right
+against the names the walk finds instead of listing every directory again.
+Without final, dirsOnly keeps just the directories so the rest of the pattern
+can go on from each of them*/
+static void recursiveComponent(PathList *from, const char *final, int dirsOnly, PathList *to){
+    struct recurseMatch match = {final, dirsOnly, to};
+    for(size_t i = 0; (i < from->count) && (sigINT != 1); i++){
+        walkTree(from->paths[i], keepRecursive, addRecursive, &match);
+    }
+}
+
+static int cmpPaths(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*expand pattern against the filesystem. Returns the matches sorted, in an
+array the caller frees, with count set. The paths live on lineArena until
+it is released. NULL with count 0 if nothing matched, NULL with count -1 on
+error*/
+char **globList(const char *pattern, long *count){
+    PathList current = {NULL, 0, 0};
+    PathList next = {NULL, 0, 0};
+    char *copy = strdup(pattern);
+    *count = -1;
+    if(copy == NULL){
+        return NULL;
+    }
+
+    //start from / for absolute patterns, otherwise the current directory
+    char *comp = copy;
+    if(*comp == '/'){
+        addPath(&current, "/", 1);
+        while(*comp == '/'){
+            comp += 1;
+        }
+    }
+    else{
+        addPath(&current, "", 0);
+    }
+    int trailingSlash = 0;
+
+    while((*comp != 0) && (current.count > 0)){
+        char *slash = strchr(comp, '/');
+        if(slash != NULL){
+            *slash = 0;
+        }
+        char *rest = slash ? slash + 1 : NULL;
+        while((rest != NULL) && (*rest == '/')){
+            rest += 1;
+        }
+        int last = (rest == NULL) || (*rest == 0);
+        if(last && (slash != NULL)){
+            //a pattern like */ only matches directories
+            trailingSlash = 1;
+            last = 0;
+        }
+        if(strcmp(comp, "**") == 0){
+            if((rest != NULL) && (*rest != 0) && (strchr(rest, '/') == NULL)){
+                //**/name, one walk finds every match
+                recursiveComponent(&current, rest, 0, &next);
+                rest += strlen(rest);
+            }
+            else if(rest == NULL){
+                //** alone is everything below
+                recursiveComponent(&current, NULL, 0, &next);
+            }
+            else{
+                //more to match, go on from every directory (and the start itself)
+                for(size_t i = 0; !trailingSlash && (i < current.count); i++){
+                    addPath(&next, current.paths[i], strlen(current.paths[i]));
+                }
+                recursiveComponent(&current, NULL, 1, &next);
+            }
+        }
+        else if(hasGlobChars(comp)){
+            matchComponent(&current, comp, last, &next);
+        }
+        else{
+            literalComponent(&current, comp, last, &next);
+        }
+        freePaths(&current);
+        current = next;
+        next.paths = NULL;
+        next.count = 0;
+        next.cap = 0;
+        comp = (rest != NULL) ? rest : comp + strlen(comp);
+    }
+    free(copy);
+
+    if(sigINT == 1){
+        freePaths(&current);
+        return NULL;
+    }
+    //a single ** walk already comes back sorted
+    size_t sorted = 1;
+    while((sorted < current.count) && (strcmp(current.paths[sorted - 1], current.paths[sorted]) <= 0)){
+        sorted += 1;
+    }
+    if(sorted < current.count){
+        qsort(current.paths, current.count, sizeof(char *), cmpPaths);
+    }
+    for(size_t i = 0; trailingSlash && (i < current.count); i++){
+        size_t len = strlen(current.paths[i]);
+        char *withSlash = arenaAlloc(&lineArena, len + 2);
+        if(withSlash == NULL){
+            freePaths(&current);
+            return NULL;
+        }
+        memcpy(withSlash, current.paths[i], len);
+        memcpy(withSlash + len, "/", 2);
+        current.paths[i] = withSlash;
+    }
+    *count = current.count;
+    if(current.count == 0){
+        freePaths(&current);
+        return NULL;
+    }
+    return current.paths;
+}
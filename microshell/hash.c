@@ -0,0 +1,202 @@
+/* Author: Calvin Kerns
+ * Command lookup cache so PATH is only walked once per command name
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//used by execvp when PATH isn't set
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define HASH_START 64
+
+//one cached command, path is NULL if the command wasn't found
+struct cmdEntry {
+    char *name;
+    char *path;
+    unsigned long hash;
+    int hits;
+    int relative;           //a relative PATH entry was looked in, so cd can change path
+};
+
+static struct cmdEntry *cmdTable;
+static size_t tableSize;
+static size_t tableUsed;
+
+//FNV-1a string hash
+unsigned long hashString(const char *str){
+    unsigned long hash = 14695981039346656037UL;
+    while(*str != 0){
+        hash ^= (unsigned char)*str;
+        hash *= 1099511628211UL;
+        str += 1;
+    }
+    return hash;
+}
+
+//find slot for name, either the matching entry or the empty slot it belongs in
+static struct cmdEntry *findSlot(struct cmdEntry *table, size_t size, const char *name, unsigned long hash){
+    size_t i = hash & (size - 1);
+    while(table[i].name != NULL){
+        if((table[i].hash == hash) && (strcmp(table[i].name, name) == 0)){
+            break;
+        }
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+//double the table once it is 70% full, returns -1 if out of memory
+static int growTable(void){
+    size_t newSize = tableSize ? tableSize * 2 : HASH_START;
+    struct cmdEntry *newTable = calloc(newSize, sizeof(struct cmdEntry));
+    if(newTable == NULL){
+        perror("hash table");
+        return -1;
+    }
+    for(size_t i = 0; i < tableSize; i++){
+        if(cmdTable[i].name != NULL){
+            *findSlot(newTable, newSize, cmdTable[i].name, cmdTable[i].hash) = cmdTable[i];
+        }
+    }
+    free(cmdTable);
+    cmdTable = newTable;
+    tableSize = newSize;
+    return 0;
+}
+
+/*walk PATH the same way execvp does, returns malloced path or NULL.
+relative is set when a PATH entry not starting with / was looked in on
+the way, the answer then depends on the current directory*/
+static char *searchPath(const char *name, int *relative){
+    const char *path = getVar("PATH");
+    if(path == NULL){
+        path = DEFAULT_PATH;
+    }
+    size_t nameLen = strlen(name);
+    Buffer full;
+    bufInit(&full);
+    struct stat stats;
+    *relative = 0;
+    while(1){
+        const char *end = strchrnul(path, ':');
+        *relative |= (*path != '/');
+        bufTruncate(&full, 0);
+        //an empty PATH entry means the current directory
+        if(end == path){
+            bufPutc(&full, '.');
+        }
+        else{
+            bufAppend(&full, path, end - path);
+        }
+        bufPutc(&full, '/');
+        if(bufAppend(&full, name, nameLen) != 0){
+            break;
+        }
+        if((stat(full.data, &stats) == 0) && S_ISREG(stats.st_mode) && (access(full.data, X_OK) == 0)){
+            return full.data;
+        }
+        if(*end == 0){
+            break;
+        }
+        path = end + 1;
+    }
+    bufFree(&full);
+    return NULL;
+}
+
+//find or add the entry for name, a new entry is resolved right away
+static struct cmdEntry *getEntry(const char *name){
+    if((tableUsed + 1) * 10 >= tableSize * 7){
+        if(growTable() != 0){
+            return NULL;
+        }
+    }
+    unsigned long hash = hashString(name);
+    struct cmdEntry *entry = findSlot(cmdTable, tableSize, name, hash);
+    if(entry->name == NULL){
+        entry->name = strdup(name);
+        entry->hash = hash;
+        entry->path = searchPath(name, &entry->relative);
+        entry->hits = 0;
+        tableUsed += 1;
+    }
+    return entry;
+}
+
+/*return the full path of name, walking PATH only the first time we see it.
+Names with a / are returned as is. Returns NULL if the command isn't found,
+misses are remembered too so they don't walk PATH again. An answer that
+came through a relative PATH entry is looked up again every time*/
+char *lookupCommand(const char *name){
+    if(strchr(name, '/') != NULL){
+        return (char *)name;
+    }
+    struct cmdEntry *entry = getEntry(name);
+    if(entry == NULL){
+        return NULL;
+    }
+    if(entry->relative && (entry->hits > 0)){
+        free(entry->path);
+        entry->path = searchPath(name, &entry->relative);
+    }
+    entry->hits += 1;
+    return entry->path;
+}
+
+//walk PATH again for name and reset its hits, returns 0 if it wasn't found
+int hashCommand(const char *name){
+    if(strchr(name, '/') != NULL){
+        return access(name, X_OK) == 0;
+    }
+    int known = (tableSize > 0) && (findSlot(cmdTable, tableSize, name, hashString(name))->name != NULL);
+    struct cmdEntry *entry = getEntry(name);
+    if(entry == NULL){
+        return 0;
+    }
+    if(known){
+        free(entry->path);
+        entry->path = searchPath(name, &entry->relative);
+    }
+    entry->hits = 0;
+    return entry->path != NULL;
+}
+
+//forget every cached command, called when PATH changes
+void clearCommandCache(void){
+    for(size_t i = 0; i < tableSize; i++){
+        free(cmdTable[i].name);
+        free(cmdTable[i].path);
+    }
+    memset(cmdTable, 0, tableSize * sizeof(struct cmdEntry));
+    tableUsed = 0;
+}
+
+//write hits, name and path of every cached command to outfd
+int listCommandCache(int outfd){
+    Buffer out;
+    bufInit(&out);
+    char line[64];
+    for(size_t i = 0; i < tableSize; i++){
+        if(cmdTable[i].name == NULL){
+            continue;
+        }
+        snprintf(line, sizeof(line), "%4d\t", cmdTable[i].hits);
+        bufPuts(&out, line);
+        bufPuts(&out, cmdTable[i].name);
+        bufPutc(&out, '\t');
+        bufPuts(&out, cmdTable[i].path ? cmdTable[i].path : "(not found)");
+        bufPutc(&out, '\n');
+    }
+    int res = 0;
+    if((out.len > 0) && (writeAll(outfd, out.data, out.len) != 0)){
+        perror("write error");
+        res = -1;
+    }
+    bufFree(&out);
+    return res;
+}
@@ -0,0 +1,600 @@
+/* Author: Calvin Kerns
+ * Command history: one line per entry in an append only file that any
+ * number of shells add to, each with a single locked write. The file is
+ * memory mapped, and a trigram index of it is kept in a second file next
+ * to it so a substring search only looks at entries that can match.
+ * Entries newer than the index file are indexed in memory when the history
+ * is first used, and the index file is rewritten once there are many
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#define INDEX_MAGIC 0x48485355   //"USHH"
+#define INDEX_VERSION 1
+//trigrams are hashed into this many posting lists
+#define HIST_BUCKETS 65536
+//entries indexed in memory before the index file is rewritten
+#define HIST_TAIL_MAX 4096
+//bytes before the end of the indexed part that have to match the history
+#define HIST_CHECK 64
+#define HIST_LIST 16
+
+/*start of an index file. Offsets of the entries follow, then where each
+bucket's postings start, then the postings: every bucket is a list of the
+entries with one of its trigrams, newest first, as varint deltas*/
+struct indexHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t covered;       //bytes of the history file indexed
+    uint64_t check;         //FNV-1a of the last HIST_CHECK of them
+    uint32_t entries;
+    uint32_t buckets;
+    uint64_t postingsSize;
+};
+
+//entries of one bucket indexed in memory, oldest first
+struct postingList {
+    uint32_t *ids;
+    uint32_t count;
+    uint32_t cap;
+};
+
+static char histPath[PATH_MAX];
+static char indexPath[PATH_MAX + 8];
+static int histFd = -1;
+static int opened;
+static char *histMap;
+static size_t mapLen;
+static size_t indexedEnd;          //the history up to here is in entries
+
+//the index file, mapped
+static char *indexMap;
+static size_t indexLen;
+static uint32_t fileEntries;
+static const uint64_t *fileOffsets;
+static const uint64_t *bucketStart;
+static const unsigned char *postings;
+
+//entries after the index file
+static uint64_t *tailOffsets;
+static uint32_t tailCount;
+static uint32_t tailCap;
+static struct postingList *tailPostings;
+static int indexBroken;            //out of memory, searches look at every entry
+
+/*where the last search stopped in a list of the index file, so going on to
+the next older match doesn't decode the list from the start again*/
+static const unsigned char *resumeAt;
+static uint32_t resumeId;
+static unsigned resumeBucket;
+
+static unsigned long checkHash(const char *data, size_t len){
+    unsigned long hash = 14695981039346656037UL;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+static unsigned bucketOf(const char *tri){
+    uint32_t value = ((uint32_t)(unsigned char)tri[0] << 16) | ((uint32_t)(unsigned char)tri[1] << 8) |
+                     (unsigned char)tri[2];
+    return (value * 2654435761u) >> 16;
+}
+
+static size_t putVarint(unsigned char *out, uint32_t value){
+    size_t n = 0;
+    while(value >= 0x80){
+        out[n++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    out[n++] = value;
+    return n;
+}
+
+//NULL when the varint runs into end or past 32 bits
+static const unsigned char *getVarint(const unsigned char *in, const unsigned char *end, uint32_t *value){
+    uint32_t result = 0;
+    int shift = 0;
+    while((in < end) && (*in & 0x80) && (shift < 28)){
+        result |= (uint32_t)(*in++ & 0x7f) << shift;
+        shift += 7;
+    }
+    if((in == end) || (*in & 0x80) || ((shift == 28) && (*in > 0x0f))){
+        return NULL;
+    }
+    *value = result | ((uint32_t)*in++ << shift);
+    return in;
+}
+
+/*$USH_HISTFILE, or ~/.ush_history. An empty USH_HISTFILE turns history
+off. Returns 0 once the file is open*/
+static int openHistory(void){
+    if(opened){
+        return (histFd >= 0) ? 0 : -1;
+    }
+    opened = 1;
+    const char *path = getVar("USH_HISTFILE");
+    const char *home = getVar("HOME");
+    if(path != NULL){
+        snprintf(histPath, sizeof(histPath), "%s", path);
+    }
+    else if(home != NULL){
+        snprintf(histPath, sizeof(histPath), "%s/.ush_history", home);
+    }
+    if(histPath[0] == 0){
+        return -1;
+    }
+    snprintf(indexPath, sizeof(indexPath), "%s.idx", histPath);
+    histFd = open(histPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if(histFd < 0){
+        perror(histPath);
+        return -1;
+    }
+    return 0;
+}
+
+static void dropIndexFile(void){
+    if(indexMap != NULL){
+        munmap(indexMap, indexLen);
+    }
+    indexMap = NULL;
+    indexLen = 0;
+    resumeAt = NULL;
+    fileEntries = 0;
+    fileOffsets = NULL;
+    bucketStart = NULL;
+    postings = NULL;
+}
+
+static void dropTail(void){
+    if(tailPostings != NULL){
+        for(size_t i = 0; i < HIST_BUCKETS; i++){
+            free(tailPostings[i].ids);
+        }
+        free(tailPostings);
+    }
+    free(tailOffsets);
+    tailPostings = NULL;
+    tailOffsets = NULL;
+    tailCount = tailCap = 0;
+    indexBroken = 0;
+}
+
+/*map the index file if it still describes the start of the history, which
+then carries on from where it ends. Otherwise everything is indexed again*/
+static void loadIndex(struct stat *histStats){
+    dropIndexFile();
+    dropTail();
+    indexedEnd = 0;
+    int fd = open(indexPath, O_RDONLY | O_CLOEXEC);
+    struct stat stats;
+    if(fd < 0){
+        return;
+    }
+    if((fstat(fd, &stats) != 0) || ((size_t)stats.st_size < sizeof(struct indexHeader))){
+        close(fd);
+        return;
+    }
+    //index files are replaced whole, never written in place
+    char *map = mmap(NULL, stats.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED){
+        return;
+    }
+    const struct indexHeader *header = (const struct indexHeader *)map;
+    size_t checked = (header->covered < HIST_CHECK) ? header->covered : HIST_CHECK;
+    int valid = (header->magic == INDEX_MAGIC) && (header->version == INDEX_VERSION) &&
+                (header->buckets == HIST_BUCKETS) &&
+                (header->dev == (uint64_t)histStats->st_dev) && (header->ino == (uint64_t)histStats->st_ino) &&
+                (header->covered <= mapLen) && (header->postingsSize <= (uint64_t)stats.st_size) &&
+                (sizeof(struct indexHeader) + ((uint64_t)header->entries + 1 + HIST_BUCKETS + 1) * sizeof(uint64_t) +
+                 header->postingsSize == (uint64_t)stats.st_size);
+    valid = valid && (header->covered > 0) && (histMap[header->covered - 1] == '\n') &&
+            (checkHash(histMap + header->covered - checked, checked) == header->check);
+    //every entry is a line of the part covered, every bucket a run of the postings
+    const uint64_t *offsets = (const uint64_t *)(map + sizeof(struct indexHeader));
+    const uint64_t *starts = offsets + header->entries + 1;
+    valid = valid && (offsets[0] == 0) && (offsets[header->entries] == header->covered) &&
+            (starts[0] == 0) && (starts[HIST_BUCKETS] == header->postingsSize);
+    for(uint32_t i = 0; valid && (i < header->entries); i++){
+        valid = offsets[i] < offsets[i + 1];
+    }
+    for(size_t b = 0; valid && (b < HIST_BUCKETS); b++){
+        valid = starts[b] <= starts[b + 1];
+    }
+    if(!valid){
+        munmap(map, stats.st_size);
+        return;
+    }
+    indexMap = map;
+    indexLen = stats.st_size;
+    fileEntries = header->entries;
+    fileOffsets = offsets;
+    bucketStart = starts;
+    postings = (const unsigned char *)(bucketStart + HIST_BUCKETS + 1);
+    indexedEnd = header->covered;
+}
+
+static int addPosting(struct postingList *list, uint32_t id){
+    if((list->count > 0) && (list->ids[list->count - 1] == id)){
+        return 0;
+    }
+    if(list->count == list->cap){
+        uint32_t newCap = list->cap ? list->cap * 2 : 4;
+        uint32_t *grown = realloc(list->ids, newCap * sizeof(uint32_t));
+        if(grown == NULL){
+            return -1;
+        }
+        list->ids = grown;
+        list->cap = newCap;
+    }
+    list->ids[list->count++] = id;
+    return 0;
+}
+
+//take the complete lines after indexedEnd in as tail entries
+static void indexTail(void){
+    if((tailPostings == NULL) && !indexBroken){
+        tailPostings = calloc(HIST_BUCKETS, sizeof(struct postingList));
+        indexBroken = (tailPostings == NULL);
+    }
+    while(indexedEnd < mapLen){
+        char *line = histMap + indexedEnd;
+        char *newline = memchr(line, '\n', mapLen - indexedEnd);
+        //a line still being written by another shell waits for its newline
+        if(newline == NULL){
+            break;
+        }
+        if(tailCount == tailCap){
+            uint32_t newCap = tailCap ? tailCap * 2 : 256;
+            uint64_t *grown = realloc(tailOffsets, newCap * sizeof(uint64_t));
+            if(grown == NULL){
+                perror("history");
+                break;
+            }
+            tailOffsets = grown;
+            tailCap = newCap;
+        }
+        uint32_t id = fileEntries + tailCount;
+        tailOffsets[tailCount++] = indexedEnd;
+        for(char *tri = line; !indexBroken && (tri + 2 < newline); tri++){
+            indexBroken = addPosting(&tailPostings[bucketOf(tri)], id) != 0;
+        }
+        indexedEnd = newline + 1 - histMap;
+    }
+}
+
+/*write the index file for everything indexed so far: the tail lists go in
+front of each bucket's list from the old file, whose first id is the only
+part that changes*/
+static int saveIndex(struct stat *histStats){
+    char temp[PATH_MAX + 32];
+    uint32_t entries = fileEntries + tailCount;
+    uint64_t *starts = malloc((HIST_BUCKETS + 1) * sizeof(uint64_t));
+    uint64_t *offsets = malloc((entries + 1) * sizeof(uint64_t));
+    Buffer lists;
+    bufInit(&lists);
+    int failed = (starts == NULL) || (offsets == NULL) || indexBroken;
+    for(size_t b = 0; !failed && (b < HIST_BUCKETS); b++){
+        unsigned char bytes[5];
+        uint32_t previous = 0;
+        int first = 1;
+        starts[b] = lists.len;
+        const struct postingList *list = &tailPostings[b];
+        for(uint32_t i = list->count; !failed && (i > 0); i--){
+            uint32_t id = list->ids[i - 1];
+            failed = bufAppend(&lists, (char *)bytes, putVarint(bytes, first ? id : previous - id)) != 0;
+            previous = id;
+            first = 0;
+        }
+        if((postings != NULL) && (bucketStart[b] < bucketStart[b + 1])){
+            uint32_t id;
+            const unsigned char *rest = getVarint(postings + bucketStart[b], postings + bucketStart[b + 1], &id);
+            failed = failed || (rest == NULL) || (id >= fileEntries) ||
+                     (bufAppend(&lists, (char *)bytes, putVarint(bytes, first ? id : previous - id)) != 0) ||
+                     (bufAppend(&lists, (const char *)rest, postings + bucketStart[b + 1] - rest) != 0);
+        }
+    }
+    if(failed){
+        free(starts);
+        free(offsets);
+        bufFree(&lists);
+        return -1;
+    }
+    starts[HIST_BUCKETS] = lists.len;
+    if(fileEntries > 0){
+        memcpy(offsets, fileOffsets, fileEntries * sizeof(uint64_t));
+    }
+    if(tailCount > 0){
+        memcpy(offsets + fileEntries, tailOffsets, tailCount * sizeof(uint64_t));
+    }
+    offsets[entries] = indexedEnd;
+
+    struct indexHeader header;
+    size_t checked = (indexedEnd < HIST_CHECK) ? indexedEnd : HIST_CHECK;
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.dev = histStats->st_dev;
+    header.ino = histStats->st_ino;
+    header.covered = indexedEnd;
+    header.check = checkHash(histMap + indexedEnd - checked, checked);
+    header.entries = entries;
+    header.buckets = HIST_BUCKETS;
+    header.postingsSize = lists.len;
+
+    //a temp file renamed over the old one, so other shells never map half an index
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", indexPath, (int)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd >= 0){
+        int ok = (writeAll(fd, (char *)&header, sizeof(header)) == 0) &&
+                 (writeAll(fd, (char *)offsets, (entries + 1) * sizeof(uint64_t)) == 0) &&
+                 (writeAll(fd, (char *)starts, (HIST_BUCKETS + 1) * sizeof(uint64_t)) == 0) &&
+                 (writeAll(fd, lists.data, lists.len) == 0);
+        close(fd);
+        if(!ok || (rename(temp, indexPath) != 0)){
+            unlink(temp);
+            fd = -1;
+        }
+    }
+    free(starts);
+    free(offsets);
+    bufFree(&lists);
+    return (fd >= 0) ? 0 : -1;
+}
+
+/*bring the mapping and the index up to the end of the history file, which
+other shells may have added to. Returns -1 if there is no history*/
+static int refresh(void){
+    struct stat stats;
+    if((openHistory() != 0) || (fstat(histFd, &stats) != 0)){
+        return -1;
+    }
+    size_t size = stats.st_size;
+    if((size != mapLen) || (histMap == NULL)){
+        if(histMap != NULL){
+            munmap(histMap, mapLen);
+        }
+        histMap = NULL;
+        mapLen = 0;
+        if(size > 0){
+            histMap = mmap(NULL, size, PROT_READ, MAP_SHARED, histFd, 0);
+            if(histMap == MAP_FAILED){
+                histMap = NULL;
+                return -1;
+            }
+            mapLen = size;
+        }
+        //cut short or replaced under us, start over
+        if(mapLen < indexedEnd){
+            dropIndexFile();
+            dropTail();
+            indexedEnd = 0;
+        }
+    }
+    if(histMap == NULL){
+        return 0;
+    }
+    if((indexMap == NULL) && (tailCount == 0) && (indexedEnd == 0)){
+        loadIndex(&stats);
+    }
+    indexTail();
+    if((tailCount >= HIST_TAIL_MAX) && (saveIndex(&stats) == 0)){
+        loadIndex(&stats);
+        indexTail();
+    }
+    return 0;
+}
+
+//entries in the history
+long historyCount(void){
+    if(refresh() != 0){
+        return 0;
+    }
+    return (long)fileEntries + tailCount;
+}
+
+/*text of entry id, counting from 0 for the oldest, with its length in len.
+It isn't null terminated and stays good until the history is used again*/
+const char *historyEntry(long id, size_t *len){
+    uint64_t start;
+    uint64_t end;
+    if((id < 0) || (id >= (long)fileEntries + tailCount)){
+        return NULL;
+    }
+    if(id < fileEntries){
+        start = fileOffsets[id];
+        end = fileOffsets[id + 1];
+    }
+    else{
+        uint32_t i = id - fileEntries;
+        start = tailOffsets[i];
+        end = (i + 1 < tailCount) ? tailOffsets[i + 1] : indexedEnd;
+    }
+    *len = end - start - 1;
+    return histMap + start;
+}
+
+static int entryHas(long id, const char *text, size_t len){
+    size_t entryLen;
+    const char *entry = historyEntry(id, &entryLen);
+    return memmem(entry, entryLen, text, len) != NULL;
+}
+
+/*newest entry older than before that contains text, or -1. A negative
+before searches from the newest. Only the entries in the shortest list of
+one of text's trigrams are looked at, text under three bytes is looked for
+in every entry*/
+long historySearch(const char *text, long before){
+    if(refresh() != 0){
+        return -1;
+    }
+    long count = (long)fileEntries + tailCount;
+    size_t len = strlen(text);
+    if((before < 0) || (before > count)){
+        before = count;
+    }
+    if(len == 0){
+        return -1;
+    }
+    if((len < 3) || indexBroken){
+        for(long id = before - 1; id >= 0; id--){
+            if(entryHas(id, text, len)){
+                return id;
+            }
+        }
+        return -1;
+    }
+
+    //list bytes stand in for the length of the index file's lists
+    unsigned best = 0;
+    uint64_t bestSize = UINT64_MAX;
+    for(size_t i = 0; i + 2 < len; i++){
+        unsigned b = bucketOf(text + i);
+        uint64_t size = tailPostings[b].count;
+        if(postings != NULL){
+            size += bucketStart[b + 1] - bucketStart[b];
+        }
+        if(size < bestSize){
+            best = b;
+            bestSize = size;
+        }
+    }
+    const struct postingList *list = &tailPostings[best];
+    for(uint32_t i = list->count; i > 0; i--){
+        long id = list->ids[i - 1];
+        if((id < before) && entryHas(id, text, len)){
+            return id;
+        }
+    }
+    if(postings == NULL){
+        return -1;
+    }
+    const unsigned char *p = postings + bucketStart[best];
+    const unsigned char *end = postings + bucketStart[best + 1];
+    uint32_t id = 0;
+    int first = 1;
+    if((resumeAt != NULL) && (resumeBucket == best) && (before <= resumeId)){
+        p = resumeAt;
+        id = resumeId;
+        first = 0;
+    }
+    while(p < end){
+        uint32_t value;
+        p = getVarint(p, end, &value);
+        if(p == NULL){
+            break;
+        }
+        id = first ? value : id - value;
+        first = 0;
+        //a delta past the oldest entry wraps around, the list is broken
+        if(id >= fileEntries){
+            break;
+        }
+        if((id < before) && entryHas(id, text, len)){
+            resumeAt = p;
+            resumeId = id;
+            resumeBucket = best;
+            return id;
+        }
+    }
+    return -1;
+}
+
+/*add line to the end of the history file. Lines starting with a space and
+repeats of the entry before are left out. One locked O_APPEND write puts
+the whole line in at once, whatever other shells are writing*/
+int historyAdd(const char *line){
+    size_t len = strlen(line);
+    if((len == 0) || (line[0] == ' ') || (line[0] == '\t') || (strchr(line, '\n') != NULL)){
+        return 0;
+    }
+    long count = historyCount();
+    size_t lastLen;
+    const char *last = historyEntry(count - 1, &lastLen);
+    if((last != NULL) && (lastLen == len) && (memcmp(last, line, len) == 0)){
+        return 0;
+    }
+    if(histFd < 0){
+        return -1;
+    }
+    char *entry = arenaAlloc(&lineArena, len + 1);
+    if(entry == NULL){
+        return -1;
+    }
+    memcpy(entry, line, len);
+    entry[len] = '\n';
+    flock(histFd, LOCK_EX);
+    int res = writeAll(histFd, entry, len + 1);
+    flock(histFd, LOCK_UN);
+    if(res != 0){
+        perror("history");
+    }
+    return res;
+}
+
+//add entry id to out numbered from 1, writing out to outfd once it fills up
+static int listEntry(Buffer *out, long id, int outfd){
+    size_t len;
+    const char *entry = historyEntry(id, &len);
+    char number[32];
+    int numberLen = snprintf(number, sizeof(number), "%6ld  ", id + 1);
+    if((bufAppend(out, number, numberLen) != 0) || (bufAppend(out, entry, len) != 0) || (bufPutc(out, '\n') != 0)){
+        return -1;
+    }
+    if(out->len >= 65536){
+        int res = writeAll(outfd, out->data, out->len);
+        bufTruncate(out, 0);
+        return res;
+    }
+    return 0;
+}
+
+/*history [COUNT] | history search TEXT. Prints the last COUNT entries,
+16 without one, or every entry containing TEXT newest first. Returns like
+execBuiltin*/
+int historyBuiltin(char **args, int argc, int outfd){
+    long count = historyCount();
+    Buffer out;
+    int res = 0;
+    bufInitArena(&out, &lineArena);
+    if((argc == 3) && (strcmp(args[1], "search") == 0)){
+        for(long id = historySearch(args[2], -1); (id >= 0) && (res == 0); id = historySearch(args[2], id)){
+            res = listEntry(&out, id, outfd);
+        }
+    }
+    else if(argc <= 2){
+        char *end = NULL;
+        long shown = (argc == 2) ? strtol(args[1], &end, 10) : HIST_LIST;
+        if(((end != NULL) && (*end != 0)) || (shown < 0)){
+            fprintf(stderr, "history: bad count %s\n", args[1]);
+            return 2;
+        }
+        for(long id = (shown < count) ? count - shown : 0; (id < count) && (res == 0); id++){
+            res = listEntry(&out, id, outfd);
+        }
+    }
+    else{
+        fprintf(stderr, "usage: history [COUNT] | history search TEXT\n");
+        return 2;
+    }
+    if((res == 0) && (out.len > 0)){
+        res = writeAll(outfd, out.data, out.len);
+    }
+    return (res == 0) ? 1 : 2;
+}
@@ -0,0 +1,395 @@
+/* Author: Calvin Kerns
+ * Background jobs started with &, the job table and the jobs, wait, fg and
+ * bg builtins. SIGCHLD only raises a flag, the table is updated by
+ * reapJobs at safe points so the handler never touches it
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#define JOB_RUNNING 1
+#define JOB_STOPPED 2
+#define JOB_DONE 3
+
+//one process of a job, a job has one per pipeline stage
+struct jobProcess {
+    pid_t pid;
+    int state;
+    int status;     //raw wait status once it is done
+};
+
+struct job {
+    int id;
+    pid_t pgid;
+    int state;
+    char *text;
+    struct jobProcess *procs;
+    int count;
+    int cap;
+};
+
+static struct job *jobs;
+static int jobCount;
+static int jobCap;
+static struct job *starting;      //job whose processes are being launched
+static volatile sig_atomic_t childChanged;
+
+static void sigchldHandler(int signal_num){
+    childChanged = 1;
+    (void)signal_num;
+}
+
+//install the SIGCHLD handler, restarting so reads and waits aren't cut short
+void initJobs(void){
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sigchldHandler;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &action, NULL);
+}
+
+//the job's state from its processes: done when all are, stopped if any is
+static int jobState(struct job *job){
+    int done = 1;
+    for(int i = 0; i < job->count; i++){
+        if(job->procs[i].state == JOB_STOPPED){
+            return JOB_STOPPED;
+        }
+        if(job->procs[i].state != JOB_DONE){
+            done = 0;
+        }
+    }
+    return done ? JOB_DONE : JOB_RUNNING;
+}
+
+//$? of a finished job is the status of its last process
+static int jobStatus(struct job *job){
+    return (job->count > 0) ? exitStatus(job->procs[job->count - 1].status) : 0;
+}
+
+/*collect every job process that exited, stopped or continued since the
+last call. Only pids in the table are waited on, foreground commands are
+left to the waitpid that started them*/
+void reapJobs(void){
+    childChanged = 0;
+    for(int i = 0; i < jobCount; i++){
+        struct job *job = &jobs[i];
+        for(int j = 0; j < job->count; j++){
+            struct jobProcess *proc = &job->procs[j];
+            int status;
+            if(proc->state == JOB_DONE){
+                continue;
+            }
+            pid_t got = waitpid(proc->pid, &status, WNOHANG | WUNTRACED | WCONTINUED);
+            if(got != proc->pid){
+                continue;
+            }
+            if(WIFSTOPPED(status)){
+                proc->state = JOB_STOPPED;
+            }
+            else if(WIFCONTINUED(status)){
+                proc->state = JOB_RUNNING;
+            }
+            else{
+                proc->state = JOB_DONE;
+                proc->status = status;
+            }
+        }
+        job->state = jobState(job);
+    }
+}
+
+//reap if SIGCHLD came in since the last look
+void checkJobs(void){
+    if(childChanged){
+        reapJobs();
+    }
+}
+
+static void removeJob(struct job *job){
+    free(job->text);
+    free(job->procs);
+    int index = job - jobs;
+    memmove(job, job + 1, (jobCount - index - 1) * sizeof(struct job));
+    jobCount -= 1;
+}
+
+static void printJob(struct job *job, int outfd){
+    char prefix[64];
+    if(job->state == JOB_DONE){
+        int status = jobStatus(job);
+        if(status == 0){
+            snprintf(prefix, sizeof(prefix), "[%d]  Done\t\t", job->id);
+        }
+        else{
+            snprintf(prefix, sizeof(prefix), "[%d]  Exit %d\t\t", job->id, status);
+        }
+    }
+    else{
+        snprintf(prefix, sizeof(prefix), "[%d]  %s\t\t", job->id,
+                 (job->state == JOB_STOPPED) ? "Stopped" : "Running");
+    }
+    //one write through writeAll, so jobs works in $( ) run in the shell too
+    Buffer line;
+    bufInit(&line);
+    bufPuts(&line, prefix);
+    bufPuts(&line, job->text);
+    if(bufPutc(&line, '\n') == 0){
+        writeAll(outfd, line.data, line.len);
+    }
+    bufFree(&line);
+}
+
+/*before a prompt, tell the user about jobs that finished and forget them.
+Scripts forget them without a word between their lines, so the table only
+holds jobs still running*/
+void notifyJobs(void){
+    checkJobs();
+    for(int i = 0; i < jobCount; ){
+        if(jobs[i].state == JOB_DONE){
+            if(interactive){
+                printJob(&jobs[i], 2);
+            }
+            removeJob(&jobs[i]);
+        }
+        else{
+            i += 1;
+        }
+    }
+}
+
+/*pgid to launch the next process of the job being started with: 0 makes
+the first one a group leader and the rest join it. -1 when no job is being
+started*/
+pid_t jobGroup(void){
+    if(starting == NULL){
+        return -1;
+    }
+    return starting->pgid;
+}
+
+//record a process launched for the job being started
+void addJobProcess(pid_t pid){
+    struct job *job = starting;
+    if(job == NULL){
+        return;
+    }
+    if(job->count == job->cap){
+        int newCap = job->cap ? job->cap * 2 : 4;
+        struct jobProcess *grown = realloc(job->procs, newCap * sizeof(struct jobProcess));
+        if(grown == NULL){
+            perror("job realloc");
+            return;
+        }
+        job->procs = grown;
+        job->cap = newCap;
+    }
+    job->procs[job->count].pid = pid;
+    job->procs[job->count].state = JOB_RUNNING;
+    job->procs[job->count].status = 0;
+    job->count += 1;
+    if(job->pgid == 0){
+        job->pgid = pid;
+    }
+}
+
+/*start line as a background job in its own process group, builtins in it
+get a child of their own too*/
+void startJob(char *line, int inputFD, int outputFD, int flags){
+    if(jobCount == jobCap){
+        int newCap = jobCap ? jobCap * 2 : 8;
+        struct job *grown = realloc(jobs, newCap * sizeof(struct job));
+        if(grown == NULL){
+            perror("job realloc");
+            return;
+        }
+        jobs = grown;
+        jobCap = newCap;
+    }
+    struct job *job = &jobs[jobCount];
+    memset(job, 0, sizeof(struct job));
+    job->id = (jobCount > 0) ? jobs[jobCount - 1].id + 1 : 1;
+    job->state = JOB_RUNNING;
+    //shown by jobs without the spaces around the &
+    line += strspn(line, " \t");
+    size_t len = strlen(line);
+    while((len > 0) && ((line[len - 1] == ' ') || (line[len - 1] == '\t'))){
+        len -= 1;
+    }
+    job->text = strndup(line, len);
+    jobCount += 1;
+
+    starting = job;
+    processline(line, inputFD, outputFD, (flags & EXPAND) | NOWAIT | BACKGROUND | SUBSHELL);
+    starting = NULL;
+
+    if(job->count == 0){
+        //nothing could be started
+        removeJob(job);
+        return;
+    }
+    numberReplace = 0;
+    if(interactive){
+        fprintf(stderr, "[%d] %d\n", job->id, (int)job->pgid);
+    }
+}
+
+/*find a job by "N" or "%N", NULL spec means the newest one. Prints an
+error naming the builtin if there is no such job*/
+static struct job *findJob(const char *builtin, const char *spec){
+    if(spec == NULL){
+        if(jobCount == 0){
+            fprintf(stderr, "%s: no current job\n", builtin);
+            return NULL;
+        }
+        return &jobs[jobCount - 1];
+    }
+    int id = atoi((*spec == '%') ? spec + 1 : spec);
+    for(int i = 0; i < jobCount; i++){
+        if(jobs[i].id == id){
+            return &jobs[i];
+        }
+    }
+    fprintf(stderr, "%s: %s: no such job\n", builtin, spec);
+    return NULL;
+}
+
+/*sleep until job is done (or stopped when stop is set) or ^C. SIGCHLD is
+blocked between checking and sleeping so a child exiting in that gap still
+wakes sigsuspend. Returns index for convenience*/
+static int waitJob(int index, int stop){
+    sigset_t block;
+    sigset_t old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+    while(1){
+        reapJobs();
+        struct job *job = &jobs[index];
+        if((job->state == JOB_DONE) || (stop && (job->state == JOB_STOPPED)) || (sigINT == 1)){
+            break;
+        }
+        sigsuspend(&old);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return index;
+}
+
+//jobs: list the table, finished jobs are dropped once they are shown
+int jobsBuiltin(int argc, int outfd){
+    if(argc != 1){
+        fprintf(stderr, "Incorrect amount of arguments\n");
+        return 2;
+    }
+    reapJobs();
+    for(int i = 0; i < jobCount; ){
+        printJob(&jobs[i], outfd);
+        if(jobs[i].state == JOB_DONE){
+            removeJob(&jobs[i]);
+        }
+        else{
+            i += 1;
+        }
+    }
+    return 1;
+}
+
+/*wait: with no args wait for every job, otherwise for each one named. $?
+is the status of the last one waited for*/
+int waitBuiltin(char **args, int argc){
+    int status = 0;
+    if(argc == 1){
+        while((jobCount > 0) && (sigINT != 1)){
+            int index = waitJob(jobCount - 1, 0);
+            if(jobs[index].state != JOB_DONE){
+                break;
+            }
+            status = jobStatus(&jobs[index]);
+            removeJob(&jobs[index]);
+        }
+        numberReplace = status;
+        return 3;
+    }
+    for(int i = 1; i < argc; i++){
+        struct job *job = findJob("wait", args[i]);
+        if(job == NULL){
+            return 2;
+        }
+        int index = waitJob(job - jobs, 0);
+        if(jobs[index].state != JOB_DONE){
+            break;
+        }
+        status = jobStatus(&jobs[index]);
+        removeJob(&jobs[index]);
+    }
+    numberReplace = status;
+    return 3;
+}
+
+//bg: let a stopped job carry on in the background
+int bgBuiltin(char **args, int argc){
+    if(argc > 2){
+        fprintf(stderr, "Incorrect amount of arguments\n");
+        return 2;
+    }
+    struct job *job = findJob("bg", (argc == 2) ? args[1] : NULL);
+    if(job == NULL){
+        return 2;
+    }
+    if(kill(-job->pgid, SIGCONT) != 0){
+        perror("bg");
+        return 2;
+    }
+    for(int i = 0; i < job->count; i++){
+        if(job->procs[i].state == JOB_STOPPED){
+            job->procs[i].state = JOB_RUNNING;
+        }
+    }
+    job->state = jobState(job);
+    return 1;
+}
+
+/*fg: continue a job and wait for it as if it had been started without &.
+On a terminal the job's group is given the terminal while it runs*/
+int fgBuiltin(char **args, int argc){
+    if(argc > 2){
+        fprintf(stderr, "Incorrect amount of arguments\n");
+        return 2;
+    }
+    struct job *job = findJob("fg", (argc == 2) ? args[1] : NULL);
+    if(job == NULL){
+        return 2;
+    }
+    int terminal = interactive && isatty(0);
+    if(terminal){
+        tcsetpgrp(0, job->pgid);
+    }
+    if(kill(-job->pgid, SIGCONT) != 0){
+        perror("fg");
+    }
+    int index = waitJob(job - jobs, 1);
+    if(terminal){
+        //taking the terminal back from the background would stop the shell
+        signal(SIGTTOU, SIG_IGN);
+        tcsetpgrp(0, getpgrp());
+        signal(SIGTTOU, SIG_DFL);
+    }
+    job = &jobs[index];
+    if(job->state == JOB_STOPPED){
+        printJob(job, 2);
+        numberReplace = 148;
+        return 3;
+    }
+    numberReplace = (job->state == JOB_DONE) ? jobStatus(job) : 130;
+    if(job->state == JOB_DONE){
+        removeJob(job);
+    }
+    return 3;
+}
@@ -0,0 +1,167 @@
+/* Author: Calvin Kerns
+ * Character class scanner shared by the stages that take a line apart:
+ * comment cutting, ; & | splitting, redirections and expansion. Each asks
+ * for the next byte in the classes it cares about and jumps straight to
+ * it, 32 or 16 bytes at a time with AVX2 or SSE2 and a byte at a time
+ * elsewhere. The version is picked on first use from what the cpu has
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LEX_X86 1
+#endif
+
+//the terminating null, every scan stops there
+#define LEX_END 0x80
+#define LEX_CLASSES 0x80
+//most bytes one combination of classes can have
+#define LEX_SET_MAX 20
+
+/*bytes wanted by one combination of classes, built the first time it's
+asked for. Each is also kept repeated across a vector so scans don't have
+to set them up on every call*/
+struct lexSet {
+    unsigned char splat[LEX_SET_MAX][32] __attribute__((aligned(32)));
+    int built;
+    int count;
+};
+
+typedef const char *(*LexScan)(const char *str, unsigned classes, const struct lexSet *set);
+
+static unsigned char lexTable[256];
+static struct lexSet lexSets[LEX_CLASSES];
+
+static void buildTable(void){
+    static const struct {unsigned char class; const char *chars;} members[] = {
+        {LEX_SPACE, " \t\n"},
+        {LEX_QUOTE, "\"\\"},
+        {LEX_GROUP, "()"},
+        {LEX_SEP, "|&;"},
+        {LEX_REDIRECT, "<>"},
+        {LEX_EXPAND, "$*?["},
+        {LEX_COMMENT, "#"},
+    };
+    for(size_t i = 0; i < sizeof(members) / sizeof(members[0]); i++){
+        for(const char *c = members[i].chars; *c != 0; c++){
+            lexTable[(unsigned char)*c] |= members[i].class;
+        }
+    }
+    lexTable[0] = LEX_END;
+}
+
+static const struct lexSet *lexSet(unsigned classes){
+    struct lexSet *set = &lexSets[classes & (LEX_CLASSES - 1)];
+    if(!set->built){
+        for(int c = 1; c < 256; c++){
+            if(lexTable[c] & classes){
+                memset(set->splat[set->count++], c, sizeof(set->splat[0]));
+            }
+        }
+        set->built = 1;
+    }
+    return set;
+}
+
+static const char *scanScalar(const char *str, unsigned classes, const struct lexSet *set){
+    (void)set;
+    classes |= LEX_END;
+    while((lexTable[(unsigned char)*str] & classes) == 0){
+        str += 1;
+    }
+    return str;
+}
+
+#ifdef LEX_X86
+/*the vector versions load whole aligned blocks, so they can read past the
+null but never into the next page. Bytes before str are masked off*/
+__attribute__((target("sse2")))
+static const char *scanSSE2(const char *str, unsigned classes, const struct lexSet *set){
+    (void)classes;
+    uintptr_t offset = (uintptr_t)str & 15;
+    const __m128i *block = (const __m128i *)(str - offset);
+    unsigned hits = 0xffffu << offset;
+    while(1){
+        __m128i data = _mm_load_si128(block);
+        __m128i found = _mm_cmpeq_epi8(data, _mm_setzero_si128());
+        for(int i = 0; i < set->count; i++){
+            found = _mm_or_si128(found, _mm_cmpeq_epi8(data, _mm_load_si128((const __m128i *)set->splat[i])));
+        }
+        hits &= (unsigned)_mm_movemask_epi8(found);
+        if(hits != 0){
+            return (const char *)block + __builtin_ctz(hits);
+        }
+        hits = 0xffffu;
+        block += 1;
+    }
+}
+
+__attribute__((target("avx2")))
+static const char *scanAVX2(const char *str, unsigned classes, const struct lexSet *set){
+    (void)classes;
+    uintptr_t offset = (uintptr_t)str & 31;
+    const __m256i *block = (const __m256i *)(str - offset);
+    uint32_t hits = 0xffffffffu << offset;
+    while(1){
+        __m256i data = _mm256_load_si256(block);
+        __m256i found = _mm256_cmpeq_epi8(data, _mm256_setzero_si256());
+        for(int i = 0; i < set->count; i++){
+            found = _mm256_or_si256(found, _mm256_cmpeq_epi8(data, _mm256_load_si256((const __m256i *)set->splat[i])));
+        }
+        hits &= (uint32_t)_mm256_movemask_epi8(found);
+        if(hits != 0){
+            return (const char *)block + __builtin_ctz(hits);
+        }
+        hits = 0xffffffffu;
+        block += 1;
+    }
+}
+#endif
+
+static const char *scanResolve(const char *str, unsigned classes, const struct lexSet *set);
+static LexScan scan = scanResolve;
+
+/*pick the widest version the cpu runs. USH_LEX=scalar, sse2 or avx2 forces
+one, for comparing them*/
+static const char *scanResolve(const char *str, unsigned classes, const struct lexSet *set){
+    const char *force = getenv("USH_LEX");
+    scan = scanScalar;
+#ifdef LEX_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2") && ((force == NULL) || (strcmp(force, "scalar") != 0))){
+        scan = scanSSE2;
+    }
+    if(__builtin_cpu_supports("avx2") && ((force == NULL) || (strcmp(force, "avx2") == 0))){
+        scan = scanAVX2;
+    }
+#else
+    (void)force;
+#endif
+    return scan(str, classes, set);
+}
+
+//name of the version in use, after the first scan
+const char *lexImplementation(void){
+#ifdef LEX_X86
+    if(scan == scanAVX2){
+        return "avx2";
+    }
+    if(scan == scanSSE2){
+        return "sse2";
+    }
+#endif
+    return (scan == scanScalar) ? "scalar" : "unresolved";
+}
+
+/*first byte at or after str in one of the LEX_ classes, or the null at the
+end of str*/
+char *lexNext(const char *str, unsigned classes){
+    if(lexTable[0] == 0){
+        buildTable();
+    }
+    return (char *)scan(str, classes, lexSet(classes));
+}
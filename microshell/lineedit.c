@@ -0,0 +1,432 @@
+/* Author: Calvin Kerns
+ * Line editor for typing commands on a terminal: moving and deleting by
+ * character and word, up and down through the history and ^R reverse
+ * search of it, tab completion of commands and files. The terminal is only
+ * in raw mode while a line is being edited. A byte is a column, long lines
+ * scroll sideways
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define KEY_EOF -1
+#define KEY_ESC 27
+#define KEY_BACKSPACE 127
+//escape sequences are turned into these
+#define KEY_UP 1000
+#define KEY_DOWN 1001
+#define KEY_LEFT 1002
+#define KEY_RIGHT 1003
+#define KEY_HOME 1004
+#define KEY_END 1005
+#define KEY_DELETE 1006
+//how long to wait for the rest of an escape sequence, in milliseconds
+#define ESC_WAIT 50
+
+static struct termios original;
+static int rawOn;
+
+static Buffer line;
+static size_t pos;
+static const char *prompt;
+static long histTop;            //entries when the line was started
+static long histPos;            //entry shown, histTop for the line being typed
+static Buffer saved;            //the line being typed while going through the history
+static Buffer screen;
+
+//1 if input and the prompt are both a terminal that can take escape sequences
+int canEdit(void){
+    const char *term = getenv("TERM");
+    return isatty(0) && isatty(2) && (term != NULL) && (strcmp(term, "dumb") != 0) &&
+           (tcgetattr(0, &original) == 0);
+}
+
+static int enableRaw(void){
+    struct termios raw;
+    if(tcgetattr(0, &original) != 0){
+        return -1;
+    }
+    raw = original;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    if(tcsetattr(0, TCSADRAIN, &raw) != 0){
+        return -1;
+    }
+    rawOn = 1;
+    return 0;
+}
+
+static void disableRaw(void){
+    if(rawOn){
+        tcsetattr(0, TCSADRAIN, &original);
+        rawOn = 0;
+    }
+}
+
+//one byte of input, or -1 at the end of it. wait is how long to give it, -1 for ever
+static int readByte(int wait){
+    unsigned char c;
+    if(wait >= 0){
+        struct pollfd input = {0, POLLIN, 0};
+        if(poll(&input, 1, wait) <= 0){
+            return -1;
+        }
+    }
+    while(1){
+        ssize_t got = read(0, &c, 1);
+        if(got == 1){
+            return c;
+        }
+        if((got < 0) && (errno == EINTR)){
+            continue;
+        }
+        return -1;
+    }
+}
+
+//next key, with the escape sequences of arrows, home, end and delete decoded
+static int readKey(void){
+    int c = readByte(-1);
+    if(c != KEY_ESC){
+        return c;
+    }
+    int kind = readByte(ESC_WAIT);
+    if((kind != '[') && (kind != 'O')){
+        return KEY_ESC;
+    }
+    int code = readByte(ESC_WAIT);
+    switch(code){
+        case 'A': return KEY_UP;
+        case 'B': return KEY_DOWN;
+        case 'C': return KEY_RIGHT;
+        case 'D': return KEY_LEFT;
+        case 'H': return KEY_HOME;
+        case 'F': return KEY_END;
+    }
+    //ESC [ n ~
+    if((code >= '0') && (code <= '9') && (readByte(ESC_WAIT) == '~')){
+        switch(code){
+            case '1': case '7': return KEY_HOME;
+            case '4': case '8': return KEY_END;
+            case '3': return KEY_DELETE;
+        }
+    }
+    return 0;
+}
+
+static size_t screenCols(void){
+    struct winsize size;
+    return ((ioctl(2, TIOCGWINSZ, &size) == 0) && (size.ws_col > 0)) ? size.ws_col : 80;
+}
+
+/*draw label and text on the current terminal line with the cursor at
+cursor in text, scrolled so the cursor is on screen*/
+static void drawLine(const char *label, const char *text, size_t len, size_t cursor){
+    size_t cols = screenCols();
+    size_t labelLen = strlen(label);
+    while((labelLen + cursor >= cols) && (cursor > 0)){
+        text += 1;
+        len -= 1;
+        cursor -= 1;
+    }
+    if(labelLen + len > cols){
+        len = (cols > labelLen) ? cols - labelLen : 0;
+    }
+    char move[32];
+    bufTruncate(&screen, 0);
+    bufPutc(&screen, '\r');
+    bufPuts(&screen, label);
+    bufAppend(&screen, text, len);
+    bufPuts(&screen, "\x1b[0K\r");
+    if(labelLen + cursor > 0){
+        snprintf(move, sizeof(move), "\x1b[%zuC", labelLen + cursor);
+        bufPuts(&screen, move);
+    }
+    if(screen.data != NULL){
+        writeAll(2, screen.data, screen.len);
+    }
+}
+
+static void redraw(void){
+    drawLine(prompt, line.data, line.len, pos);
+}
+
+static void setLine(const char *text, size_t len){
+    bufTruncate(&line, 0);
+    bufAppend(&line, text, len);
+    pos = line.len;
+}
+
+static void insertChar(char c){
+    if(bufPutc(&line, c) != 0){
+        return;
+    }
+    memmove(line.data + pos + 1, line.data + pos, line.len - pos - 1);
+    line.data[pos++] = c;
+}
+
+//take out the bytes from start up to the cursor
+static void deleteBack(size_t start){
+    memmove(line.data + start, line.data + pos, line.len - pos + 1);
+    line.len -= pos - start;
+    pos = start;
+}
+
+/*tab: complete the word before the cursor, listing the choices under the
+line when there are several and none of them is longer. A bell if none*/
+static void completeWord(void){
+    size_t start;
+    Buffer replace;
+    Buffer list;
+    Buffer rest;
+    bufInit(&replace);
+    bufInit(&list);
+    bufInit(&rest);
+    long count = completeLine(line.data, pos, screenCols(), &start, &replace, &list);
+    if(count == 0){
+        writeAll(2, "\a", 1);
+    }
+    else if((replace.len != pos - start) || (memcmp(replace.data, line.data + start, replace.len) != 0)){
+        bufAppend(&rest, line.data + pos, line.len - pos);
+        bufTruncate(&line, start);
+        bufAppend(&line, replace.data, replace.len);
+        pos = line.len;
+        if(rest.data != NULL){
+            bufAppend(&line, rest.data, rest.len);
+        }
+    }
+    if(list.len > 0){
+        writeAll(2, "\n", 1);
+        writeAll(2, list.data, list.len);
+    }
+    bufFree(&replace);
+    bufFree(&list);
+    bufFree(&rest);
+}
+
+//show entry id of the history, or the line being typed once past the newest
+static void showEntry(long id){
+    if(histPos == histTop){
+        bufTruncate(&saved, 0);
+        bufAppend(&saved, line.data, line.len);
+    }
+    histPos = id;
+    if(id == histTop){
+        setLine(saved.data ? saved.data : "", saved.len);
+        return;
+    }
+    size_t len;
+    const char *entry = historyEntry(id, &len);
+    if(entry != NULL){
+        setLine(entry, len);
+    }
+}
+
+//1 if entries a and b have the same text
+static int sameEntry(long a, long b){
+    size_t aLen;
+    size_t bLen;
+    const char *aText = historyEntry(a, &aLen);
+    const char *bText = historyEntry(b, &bLen);
+    return (aText != NULL) && (bText != NULL) && (aLen == bLen) && (memcmp(aText, bText, aLen) == 0);
+}
+
+/*^R: search the history backwards as a search string is typed. ^R again
+goes to the next older match, ^G or ^C puts the line back. Any other key
+ends the search with the match on the line and is returned to be handled
+as usual, 0 when there is nothing more to do*/
+static int reverseSearch(void){
+    Buffer query;
+    Buffer before;
+    Buffer label;
+    long match = -1;
+    int failed = 0;
+    bufInit(&query);
+    bufInit(&before);
+    bufInit(&label);
+    bufAppend(&query, "", 0);
+    bufAppend(&before, line.data, line.len);
+    while(1){
+        size_t len = 0;
+        const char *text = (match >= 0) ? historyEntry(match, &len) : "";
+        const char *found = (query.len > 0) ? memmem(text, len, query.data, query.len) : NULL;
+        bufTruncate(&label, 0);
+        bufPuts(&label, failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`");
+        bufAppend(&label, query.data, query.len);
+        bufPuts(&label, "': ");
+        drawLine(label.data, text, len, found ? (size_t)(found - text) : 0);
+
+        int key = readKey();
+        long next = -1;
+        if(key == KEY_CTRL('R')){
+            if(query.len == 0){
+                continue;
+            }
+            //older matches with the same text as this one are skipped
+            next = historySearch(query.data, match);
+            while((next >= 0) && (match >= 0) && sameEntry(next, match)){
+                next = historySearch(query.data, next);
+            }
+        }
+        else if((key == KEY_BACKSPACE) || (key == KEY_CTRL('H'))){
+            bufTruncate(&query, (query.len > 0) ? query.len - 1 : 0);
+            next = (query.len > 0) ? historySearch(query.data, -1) : -1;
+            failed = 0;
+            match = next;
+            continue;
+        }
+        else if((key >= ' ') && (key < KEY_BACKSPACE)){
+            bufPutc(&query, key);
+            //a longer query can still match the entry shown
+            next = historySearch(query.data, (match >= 0) ? match + 1 : -1);
+        }
+        else{
+            if((key == KEY_CTRL('G')) || (key == KEY_CTRL('C')) || (key == KEY_EOF)){
+                setLine(before.data, before.len);
+                key = (key == KEY_EOF) ? KEY_EOF : 0;
+            }
+            else if(match >= 0){
+                text = historyEntry(match, &len);
+                setLine(text, len);
+            }
+            bufFree(&query);
+            bufFree(&before);
+            bufFree(&label);
+            return (key == KEY_ESC) ? 0 : key;
+        }
+        failed = next < 0;
+        if(next >= 0){
+            match = next;
+        }
+    }
+}
+
+/*read a line from the terminal with prompt p shown, editing it in place.
+Returns the line, good until the next call, or NULL at the end of input*/
+char *editLine(const char *p){
+    prompt = p;
+    bufTruncate(&line, 0);
+    if(bufReserve(&line, 0) != 0){
+        return NULL;
+    }
+    pos = 0;
+    histTop = histPos = historyCount();
+    if(enableRaw() != 0){
+        perror("terminal");
+        return NULL;
+    }
+    redraw();
+    while(1){
+        int key = readKey();
+        if(key == KEY_CTRL('R')){
+            key = reverseSearch();
+        }
+        switch(key){
+            case '\r':
+            case '\n':
+                pos = line.len;
+                redraw();
+                writeAll(2, "\n", 1);
+                disableRaw();
+                return line.data;
+            case KEY_EOF:
+                disableRaw();
+                writeAll(2, "\n", 1);
+                return NULL;
+            case KEY_CTRL('D'):
+                if(line.len == 0){
+                    disableRaw();
+                    writeAll(2, "\n", 1);
+                    return NULL;
+                }
+                //fall through
+            case KEY_DELETE:
+                if(pos < line.len){
+                    pos += 1;
+                    deleteBack(pos - 1);
+                }
+                break;
+            case KEY_CTRL('C'):
+                //drop the line and start a new one
+                writeAll(2, "^C\n", 3);
+                setLine("", 0);
+                histPos = histTop;
+                break;
+            case KEY_BACKSPACE:
+            case KEY_CTRL('H'):
+                if(pos > 0){
+                    deleteBack(pos - 1);
+                }
+                break;
+            case KEY_CTRL('W'): {
+                size_t start = pos;
+                while((start > 0) && (line.data[start - 1] == ' ')){
+                    start -= 1;
+                }
+                while((start > 0) && (line.data[start - 1] != ' ')){
+                    start -= 1;
+                }
+                deleteBack(start);
+                break;
+            }
+            case KEY_CTRL('U'):
+                deleteBack(0);
+                break;
+            case KEY_CTRL('K'):
+                bufTruncate(&line, pos);
+                break;
+            case KEY_CTRL('A'):
+            case KEY_HOME:
+                pos = 0;
+                break;
+            case KEY_CTRL('E'):
+            case KEY_END:
+                pos = line.len;
+                break;
+            case KEY_CTRL('B'):
+            case KEY_LEFT:
+                pos -= (pos > 0);
+                break;
+            case KEY_CTRL('F'):
+            case KEY_RIGHT:
+                pos += (pos < line.len);
+                break;
+            case KEY_CTRL('P'):
+            case KEY_UP:
+                if(histPos > 0){
+                    showEntry(histPos - 1);
+                }
+                break;
+            case KEY_CTRL('N'):
+            case KEY_DOWN:
+                if(histPos < histTop){
+                    showEntry(histPos + 1);
+                }
+                break;
+            case KEY_CTRL('L'):
+                writeAll(2, "\x1b[H\x1b[2J", 7);
+                break;
+            case '\t':
+                completeWord();
+                break;
+            default:
+                if((key >= ' ') && (key != KEY_BACKSPACE) && (key < 256)){
+                    insertChar(key);
+                }
+                break;
+        }
+        redraw();
+    }
+}
@@ -0,0 +1,42 @@
+/* Author: Calvin Kerns
+ * Where builtins send their output: everything they print is gathered in a
+ * buffer and handed to writeAll in one go. A builtin run for $( ) in the
+ * shell gets CAPTURE_FD as its outfd and writes into memory instead
+*/
+
+#include "defn.h"
+#include <unistd.h>
+#include <errno.h>
+
+//where writes to CAPTURE_FD go, NULL outside captureBuiltin
+static Buffer *captureTarget;
+
+/*write all len bytes of data to fd, carrying on after short writes and
+signals. Returns 0 or -1 if fd stopped taking data*/
+int writeAll(int fd, const char *data, size_t len){
+    if(fd == CAPTURE_FD){
+        return (captureTarget != NULL) ? bufAppend(captureTarget, data, len) : -1;
+    }
+    while(len > 0){
+        ssize_t wrote = write(fd, data, len);
+        if(wrote < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        data += wrote;
+        len -= wrote;
+    }
+    return 0;
+}
+
+/*run builtin args with its output appended to out rather than written to
+a pipe nobody reads until it returns. Returns what execBuiltin does*/
+int captureBuiltin(char **args, int argc, Buffer *out){
+    Buffer *outer = captureTarget;
+    captureTarget = out;
+    int res = execBuiltin(args, argc, 0, CAPTURE_FD);
+    captureTarget = outer;
+    return res;
+}
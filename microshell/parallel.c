@@ -0,0 +1,355 @@
+/* Author: Calvin Kerns
+ * parallel builtin: runs a command template once per item with a bounded
+ * number of children at a time
+ *   parallel [-j N] [-k] command ... [::: item ...]
+ * {} in the command words is replaced by the item (it is added as a last
+ * word if there is no {}). The words are already expanded, so an item is
+ * used as it is and never split or expanded again. Without ::: the items
+ * are the lines of stdin. Builtins run in a child of their own. Output of
+ * each item is collected and written out whole, as items finish or in item
+ * order with -k
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+//GNU parallel's cap on the failure count it exits with
+#define PARALLEL_MAX_FAILED 101
+
+//a running item
+struct slot {
+    pid_t pid;
+    int fd;         //read end of the item's output pipe
+    int item;
+};
+
+struct parallelRun {
+    char **words;       //the command, expanded by the shell already
+    int wordCount;
+    int hasBraces;
+    char **items;
+    int itemCount;
+    int inputFD;        //stdin for the items
+    int outputFD;
+    int keepOrder;
+    Buffer *outputs;    //collected output per item
+    int *statuses;
+    char *finished;
+    int nextOut;        //first item not written yet with -k
+};
+
+//word with every {} in it replaced by item, on the line arena
+static char *fillWord(const char *word, const char *item){
+    Buffer filled;
+    bufInitArena(&filled, &lineArena);
+    for(const char *brace = strstr(word, "{}"); brace != NULL; brace = strstr(word, "{}")){
+        if((bufAppend(&filled, word, brace - word) != 0) || (bufPuts(&filled, item) != 0)){
+            return NULL;
+        }
+        word = brace + 2;
+    }
+    if(bufPuts(&filled, word) != 0){
+        return NULL;
+    }
+    return filled.data;
+}
+
+/*the argv for item: the command words with every {} replaced by it, or it
+added as the last word. NULL if out of memory*/
+static char **itemArgs(struct parallelRun *run, char *item, int *argc){
+    char **argv = arenaAlloc(&lineArena, (run->wordCount + 2) * sizeof(char *));
+    if(argv == NULL){
+        return NULL;
+    }
+    *argc = 0;
+    for(int i = 0; i < run->wordCount; i++){
+        argv[*argc] = (strstr(run->words[i], "{}") != NULL) ? fillWord(run->words[i], item) : run->words[i];
+        if(argv[(*argc)++] == NULL){
+            return NULL;
+        }
+    }
+    if(!run->hasBraces){
+        argv[(*argc)++] = item;
+    }
+    argv[*argc] = NULL;
+    return argv;
+}
+
+/*expand and start item with its stdout on a pipe. Returns 0 with the slot
+filled in, or -1 with the item's status set if it couldn't be started*/
+static int startItem(struct parallelRun *run, int item, struct slot *slot){
+    ArenaMark mark = arenaMark(&lineArena);
+    int argc = 0;
+    run->statuses[item] = 127;
+    char **argv = itemArgs(run, run->items[item], &argc);
+    if(argv == NULL){
+        run->statuses[item] = 1;
+        arenaRelease(&lineArena, mark);
+        return -1;
+    }
+    int builtin = isBuiltin(argv[0]);
+    char *path = builtin ? NULL : lookupCommand(argv[0]);
+    if(!builtin && (path == NULL)){
+        fprintf(stderr, "parallel: %s: command not found\n", argv[0]);
+        arenaRelease(&lineArena, mark);
+        return -1;
+    }
+    int fd[2];
+    if(pipe2(fd, O_CLOEXEC) != 0){
+        perror("parallel: pipe");
+        arenaRelease(&lineArena, mark);
+        return -1;
+    }
+    if(builtin){
+        slot->pid = forkBuiltin(argv, argc, run->inputFD, fd[1], NULL, -1);
+    }
+    else{
+        slot->pid = launchCommand(path, argv, run->inputFD, fd[1], NULL, -1);
+    }
+    close(fd[1]);
+    arenaRelease(&lineArena, mark);
+    if(slot->pid < 0){
+        close(fd[0]);
+        return -1;
+    }
+    slot->fd = fd[0];
+    slot->item = item;
+    return 0;
+}
+
+//item is done, write out whatever output can go now
+static void finishItem(struct parallelRun *run, int item){
+    run->finished[item] = 1;
+    if(!run->keepOrder){
+        writeAll(run->outputFD, run->outputs[item].data, run->outputs[item].len);
+        bufFree(&run->outputs[item]);
+        return;
+    }
+    while((run->nextOut < run->itemCount) && run->finished[run->nextOut]){
+        Buffer *out = &run->outputs[run->nextOut];
+        writeAll(run->outputFD, out->data, out->len);
+        bufFree(out);
+        run->nextOut += 1;
+    }
+}
+
+/*the items read from fd, one per non-empty line. They point into input,
+which has to outlive them*/
+static char **readItems(int fd, Buffer *input, int *count){
+    char block[65536];
+    ssize_t got;
+    while((got = read(fd, block, sizeof(block))) != 0){
+        if(got < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("parallel: read");
+            return NULL;
+        }
+        if(bufAppend(input, block, got) != 0){
+            return NULL;
+        }
+    }
+    int cap = 64;
+    char **items = malloc(cap * sizeof(char *));
+    *count = 0;
+    char *line = input->data;
+    while((items != NULL) && (line != NULL) && (*line != 0)){
+        char *end = strchr(line, '\n');
+        if(end != NULL){
+            *end = 0;
+        }
+        if(*line != 0){
+            if(*count == cap){
+                cap *= 2;
+                char **grown = realloc(items, cap * sizeof(char *));
+                if(grown == NULL){
+                    free(items);
+                    return NULL;
+                }
+                items = grown;
+            }
+            items[(*count)++] = line;
+        }
+        line = (end != NULL) ? end + 1 : NULL;
+    }
+    return items;
+}
+
+//run every item with at most jobs at once, returns the number that failed
+static int runItems(struct parallelRun *run, int jobs){
+    struct slot *slots = calloc(jobs, sizeof(struct slot));
+    struct pollfd *polls = calloc(jobs, sizeof(struct pollfd));
+    int active = 0;
+    int next = 0;
+    int failed = 0;
+    if((slots == NULL) || (polls == NULL)){
+        free(slots);
+        free(polls);
+        return run->itemCount;
+    }
+
+    while(((next < run->itemCount) && (sigINT != 1)) || (active > 0)){
+        //fill the free slots
+        while((active < jobs) && (next < run->itemCount) && (sigINT != 1)){
+            int item = next++;
+            if(startItem(run, item, &slots[active]) == 0){
+                active += 1;
+            }
+            else{
+                failed += (run->statuses[item] != 0);
+                finishItem(run, item);
+            }
+        }
+        if(active == 0){
+            continue;
+        }
+
+        for(int i = 0; i < active; i++){
+            polls[i].fd = slots[i].fd;
+            polls[i].events = POLLIN;
+            polls[i].revents = 0;
+        }
+        if(poll(polls, active, -1) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("parallel: poll");
+            break;
+        }
+        for(int i = active - 1; i >= 0; i--){
+            if(polls[i].revents == 0){
+                continue;
+            }
+            struct slot *slot = &slots[i];
+            Buffer *out = &run->outputs[slot->item];
+            if(bufReserve(out, 65536) != 0){
+                break;
+            }
+            ssize_t got = read(slot->fd, out->data + out->len, out->cap - out->len - 1);
+            if(got > 0){
+                out->len += got;
+                out->data[out->len] = 0;
+                continue;
+            }
+            if((got < 0) && (errno == EINTR)){
+                continue;
+            }
+            //output closed, the item is as good as done
+            close(slot->fd);
+            int status = 0;
+            while((waitpid(slot->pid, &status, 0) < 0) && (errno == EINTR)){
+                ;
+            }
+            run->statuses[slot->item] = exitStatus(status);
+            failed += (run->statuses[slot->item] != 0);
+            finishItem(run, slot->item);
+            //keep the slots packed, polls of later slots were handled already
+            slots[i] = slots[--active];
+        }
+    }
+    free(slots);
+    free(polls);
+    return failed;
+}
+
+int parallelBuiltin(char **args, int argc, int infd, int outfd){
+    struct parallelRun run;
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int pos = 1;
+    memset(&run, 0, sizeof(run));
+
+    //options come before the command
+    for(; (pos < argc) && (args[pos][0] == '-'); pos++){
+        if(strcmp(args[pos], "-k") == 0){
+            run.keepOrder = 1;
+        }
+        else if(strncmp(args[pos], "-j", 2) == 0){
+            char *count = args[pos][2] ? &args[pos][2] : ((pos + 1 < argc) ? args[++pos] : "");
+            jobs = atol(count);
+            if(jobs < 1){
+                fprintf(stderr, "parallel: -j needs a positive number\n");
+                return 2;
+            }
+        }
+        else{
+            fprintf(stderr, "parallel: unknown option %s\n", args[pos]);
+            return 2;
+        }
+    }
+    int start = pos;
+    while((pos < argc) && (strcmp(args[pos], ":::") != 0)){
+        pos += 1;
+    }
+    if(pos == start){
+        fprintf(stderr, "usage: parallel [-j N] [-k] command ... [::: item ...]\n");
+        return 2;
+    }
+
+    run.words = &args[start];
+    run.wordCount = pos - start;
+    for(int i = start; i < pos; i++){
+        run.hasBraces |= (strstr(args[i], "{}") != NULL);
+    }
+    run.outputFD = outfd;
+
+    Buffer input;
+    bufInit(&input);
+    char **stdinItems = NULL;
+    if(pos < argc){
+        run.items = &args[pos + 1];
+        run.itemCount = argc - pos - 1;
+        run.inputFD = infd;
+    }
+    else{
+        stdinItems = readItems(infd, &input, &run.itemCount);
+        if(stdinItems == NULL){
+            bufFree(&input);
+            return 2;
+        }
+        run.items = stdinItems;
+        //stdin was used up for the items
+        run.inputFD = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    run.outputs = calloc(run.itemCount + 1, sizeof(Buffer));
+    run.statuses = calloc(run.itemCount + 1, sizeof(int));
+    run.finished = calloc(run.itemCount + 1, 1);
+    int failed = run.itemCount;
+    if((run.outputs != NULL) && (run.statuses != NULL) && (run.finished != NULL)){
+        failed = runItems(&run, jobs);
+    }
+
+    //PARALLELSTATUS has every item's status in item order
+    Buffer all;
+    bufInitArena(&all, &lineArena);
+    for(int i = 0; (run.statuses != NULL) && (i < run.itemCount); i++){
+        char number[16];
+        snprintf(number, sizeof(number), (i == 0) ? "%d" : " %d", run.statuses[i]);
+        bufPuts(&all, number);
+    }
+    setVar("PARALLELSTATUS", all.data ? all.data : "", 0);
+
+    for(int i = 0; (run.outputs != NULL) && (i < run.itemCount); i++){
+        bufFree(&run.outputs[i]);
+    }
+    free(run.outputs);
+    free(run.statuses);
+    free(run.finished);
+    free(stdinItems);
+    bufFree(&input);
+    if(stdinItems != NULL){
+        close(run.inputFD);
+    }
+    numberReplace = (failed > PARALLEL_MAX_FAILED) ? PARALLEL_MAX_FAILED : failed;
+    return 3;
+}
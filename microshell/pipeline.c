@@ -0,0 +1,229 @@
+/* Author: Calvin Kerns
+ * Runs | pipelines: every pipe is made up front, all the stages are started
+ * and then each one is waited for by pid
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+//stages of NOWAIT pipelines besides the last and <( ) commands, waitCommand reaps them
+static pid_t *strays;
+static int strayCount;
+static int strayCap;
+
+//turn a wait status into the $? value for it
+int exitStatus(int status){
+    if(WIFEXITED(status)){
+        return WEXITSTATUS(status);
+    }
+    if(WIFSIGNALED(status)){
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+//say what killed a command, ^C is left quiet
+void reportSignal(int status){
+    if(WIFSIGNALED(status) && (WTERMSIG(status) != SIGINT)){
+        dprintf(1, "%s", strsignal(WTERMSIG(status)));
+        if(WCOREDUMP(status)){
+            dprintf(1, " (core dumped)");
+        }
+        dprintf(1, "\n");
+    }
+}
+
+static int waitFor(pid_t pid, int *status){
+    long trace = -1;
+    if(traceOn){
+        char name[24];
+        snprintf(name, sizeof(name), "pid %d", (int)pid);
+        trace = traceBegin(TRACE_WAIT, name);
+    }
+    pid_t got;
+    while(((got = waitpid(pid, status, 0)) < 0) && (errno == EINTR)){
+        ;
+    }
+    TRACE_END(trace);
+    return (got == pid) ? 0 : -1;
+}
+
+/*wait for a command processline started with NOWAIT and return its $?
+value. Earlier stages of a pipeline started that way are reaped as well*/
+int waitCommand(pid_t pid){
+    int status = 0;
+    int res = 0;
+    if((pid > 0) && (waitFor(pid, &status) == 0)){
+        res = exitStatus(status);
+    }
+    for(int i = 0; i < strayCount; i++){
+        waitFor(strays[i], &status);
+    }
+    strayCount = 0;
+    return res;
+}
+
+//leave pid for the next waitCommand to reap
+void addStray(pid_t pid){
+    if(strayCount == strayCap){
+        int newCap = strayCap ? strayCap * 2 : 16;
+        pid_t *grown = realloc(strays, newCap * sizeof(pid_t));
+        if(grown == NULL){
+            //can't keep track of it, wait now instead
+            int status;
+            waitFor(pid, &status);
+            return;
+        }
+        strays = grown;
+        strayCap = newCap;
+    }
+    strays[strayCount++] = pid;
+}
+
+//USH_PIPE_SIZE asks the kernel for bigger pipes, unset leaves them alone
+static int pipeSize(void){
+    char *size = getVar("USH_PIPE_SIZE");
+    return (size != NULL) ? atoi(size) : 0;
+}
+
+/*run count stages as a pipeline: texts through processline, or without
+them the stages of words through processStage. Builtins in every stage but
+the last run in a child of their own, so one writing into a full pipe or
+reading from an empty one can't hang the shell. A builtin in the last stage
+runs in the shell once everything feeding it has started, unless the whole
+pipeline is a job. With WAIT every stage is waited for by pid, PIPESTATUS
+gets all their statuses and $? the last one. Without it the last stage's
+pid is returned for waitCommand, or with BACKGROUND the stages are left to
+the job table*/
+static int runStages(int count, char **texts, Words *words, int inputFD, int outputFD, int flags){
+    ArenaMark mark = arenaMark(&lineArena);
+    int *pipes = arenaAlloc(&lineArena, 2 * count * sizeof(int));
+    pid_t *pids = arenaAlloc(&lineArena, count * sizeof(pid_t));
+    int *statuses = arenaAlloc(&lineArena, count * sizeof(int));
+    if((pipes == NULL) || (pids == NULL) || (statuses == NULL)){
+        arenaRelease(&lineArena, mark);
+        return 0;
+    }
+
+    //all the pipes first, close on exec so no child holds an end it doesn't use
+    int size = pipeSize();
+    for(int i = 0; i < count - 1; i++){
+        if(pipe2(&pipes[2 * i], O_CLOEXEC) != 0){
+            perror("pipe failed");
+            for(int j = 0; j < 2 * i; j++){
+                close(pipes[j]);
+            }
+            numberReplace = 1;
+            arenaRelease(&lineArena, mark);
+            return 0;
+        }
+        if(size > 0){
+            //the limit is /proc/sys/fs/pipe-max-size, keep the default past it
+            fcntl(pipes[2 * i + 1], F_SETPIPE_SZ, size);
+        }
+    }
+
+    for(int i = 0; i < count; i++){
+        int in = (i == 0) ? inputFD : pipes[2 * (i - 1)];
+        int out = (i == count - 1) ? outputFD : pipes[2 * i + 1];
+        int stageFlags = NOWAIT | (flags & (EXPAND | BACKGROUND | SUBSHELL));
+        if(i < count - 1){
+            stageFlags |= SUBSHELL;
+        }
+        numberReplace = 0;
+        pids[i] = texts ? processline(texts[i], in, out, stageFlags) : processStage(words, i, in, out, stageFlags);
+        statuses[i] = numberReplace;
+        if(i > 0){
+            close(in);
+        }
+        if(i < count - 1){
+            close(out);
+        }
+    }
+
+    if(flags & BACKGROUND){
+        //the stages joined the job being started as they were launched
+        arenaRelease(&lineArena, mark);
+        return pids[count - 1];
+    }
+    if(!(flags & WAIT)){
+        for(int i = 0; i < count - 1; i++){
+            if(pids[i] > 0){
+                addStray(pids[i]);
+            }
+        }
+        pid_t last = pids[count - 1];
+        arenaRelease(&lineArena, mark);
+        return last;
+    }
+
+    Buffer all;
+    bufInitArena(&all, &lineArena);
+    for(int i = 0; i < count; i++){
+        int status;
+        if((pids[i] > 0) && (waitFor(pids[i], &status) == 0)){
+            statuses[i] = exitStatus(status);
+            if(i == count - 1){
+                reportSignal(status);
+            }
+        }
+        char number[16];
+        snprintf(number, sizeof(number), (i == 0) ? "%d" : " %d", statuses[i]);
+        bufPuts(&all, number);
+    }
+    alivechild = 0;
+    //<( ) commands of the stages are done with too
+    waitCommand(0);
+    if(all.data != NULL){
+        setVar("PIPESTATUS", all.data, 0);
+    }
+    numberReplace = statuses[count - 1];
+    arenaRelease(&lineArena, mark);
+    return 0;
+}
+
+//run line as a pipeline of commands split on unquoted | outside $( ), see runStages
+int runPipeline(char *line, int inputFD, int outputFD, int flags){
+    ArenaMark mark = arenaMark(&lineArena);
+    size_t len = strlen(line);
+    char *copy = arenaAlloc(&lineArena, len + 1);
+    if(copy == NULL){
+        return 0;
+    }
+    memcpy(copy, line, len + 1);
+
+    int count = 1;
+    for(char *pos = segmentEnd(copy, '|'); *pos != 0; pos = segmentEnd(pos + 1, '|')){
+        count += 1;
+    }
+    char **stages = arenaAlloc(&lineArena, count * sizeof(char *));
+    if(stages == NULL){
+        arenaRelease(&lineArena, mark);
+        return 0;
+    }
+    char *pos = copy;
+    for(int i = 0; i < count; i++){
+        char *end = segmentEnd(pos, '|');
+        stages[i] = pos;
+        if(*end != 0){
+            *end = 0;
+            pos = end + 1;
+        }
+    }
+    int res = runStages(count, stages, NULL, inputFD, outputFD, flags);
+    arenaRelease(&lineArena, mark);
+    return res;
+}
+
+//run the stages of words, lexed by lexCommand, as a pipeline
+int runPipelineWords(Words *words, int inputFD, int outputFD, int flags){
+    return runStages(words->stages, NULL, words, inputFD, outputFD, flags);
+}
@@ -0,0 +1,320 @@
+/* Author: Calvin Kerns
+ * printf builtin, and the backslash escapes echo -e shares with it
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+//set when an argument wasn't a valid number, printf then exits 1
+static int badNumber;
+
+/*append the character for the escape at str (just past the backslash) to
+out. Octal is \NNN or, for %b and echo -e, \0NNN. \c sets stop. Returns how
+many characters of str were used*/
+static int escapeChar(const char *str, Buffer *out, int *stop, int leadingZero){
+    int used = 1;
+    int value;
+    switch(*str){
+    case 'a': value = '\a'; break;
+    case 'b': value = '\b'; break;
+    case 'e': value = 27; break;
+    case 'f': value = '\f'; break;
+    case 'n': value = '\n'; break;
+    case 'r': value = '\r'; break;
+    case 't': value = '\t'; break;
+    case 'v': value = '\v'; break;
+    case '\\': value = '\\'; break;
+    case 'c':
+        *stop = 1;
+        return 1;
+    case 'x':
+        if(!isxdigit((unsigned char)str[1])){
+            //not an escape after all
+            bufPutc(out, '\\');
+            return 0;
+        }
+        value = 0;
+        while((used < 3) && isxdigit((unsigned char)str[used])){
+            char digit = tolower((unsigned char)str[used]);
+            value = value * 16 + (isdigit((unsigned char)digit) ? digit - '0' : digit - 'a' + 10);
+            used += 1;
+        }
+        break;
+    default:
+        if((*str >= '0') && (*str <= '7')){
+            int start = (leadingZero && (*str == '0')) ? 1 : 0;
+            value = 0;
+            used = start;
+            while((used < start + 3) && (str[used] >= '0') && (str[used] <= '7')){
+                value = value * 8 + (str[used] - '0');
+                used += 1;
+            }
+            break;
+        }
+        //unknown escapes are kept as they are
+        bufPutc(out, '\\');
+        return 0;
+    }
+    bufPutc(out, (char)value);
+    return used;
+}
+
+/*append str to out with echo -e / %b escapes done. Sets stop when \c asks
+for the rest of the output to be dropped. Returns 0 or -1 out of memory*/
+int putEscape(const char *str, Buffer *out, int *stop){
+    while((*str != 0) && !*stop){
+        const char *slash = strchr(str, '\\');
+        size_t plain = (slash != NULL) ? (size_t)(slash - str) : strlen(str);
+        if(bufAppend(out, str, plain) != 0){
+            return -1;
+        }
+        str += plain;
+        if(*str == '\\'){
+            str += 1;
+            if(*str == 0){
+                bufPutc(out, '\\');
+                break;
+            }
+            str += escapeChar(str, out, stop, 1);
+        }
+    }
+    return 0;
+}
+
+/*parse a numeric argument the way printf(1) does: a leading quote gives
+the code of the next character, anything else must be a whole number*/
+static long long intArg(const char *arg, int isUnsigned){
+    if((arg[0] == '\'') || (arg[0] == '"')){
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    errno = 0;
+    long long value = isUnsigned ? (long long)strtoull(arg, &end, 0) : strtoll(arg, &end, 0);
+    if((end == arg) || (*end != 0) || (errno != 0)){
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        badNumber = 1;
+    }
+    return value;
+}
+
+static long double floatArg(const char *arg){
+    if((arg[0] == '\'') || (arg[0] == '"')){
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    errno = 0;
+    long double value = strtold(arg, &end);
+    if((end == arg) || (*end != 0) || (errno != 0)){
+        fprintf(stderr, "printf: %s: invalid number\n", arg);
+        badNumber = 1;
+    }
+    return value;
+}
+
+/*snprintf one conversion straight into the spare room of out. stars holds
+the values for the * widths and precisions spec has, in order*/
+static int appendFormat(Buffer *out, const char *spec, const int *stars, int starCount,
+                        int kind, long long number, long double real, const char *str){
+    for(int attempt = 0; attempt < 2; attempt++){
+        size_t room = out->cap - out->len;
+        char *at = out->data + out->len;
+        int n;
+        if(kind == 'i'){
+            n = (starCount == 2) ? snprintf(at, room, spec, stars[0], stars[1], number) :
+                (starCount == 1) ? snprintf(at, room, spec, stars[0], number) : snprintf(at, room, spec, number);
+        }
+        else if(kind == 'f'){
+            n = (starCount == 2) ? snprintf(at, room, spec, stars[0], stars[1], real) :
+                (starCount == 1) ? snprintf(at, room, spec, stars[0], real) : snprintf(at, room, spec, real);
+        }
+        else{
+            n = (starCount == 2) ? snprintf(at, room, spec, stars[0], stars[1], str) :
+                (starCount == 1) ? snprintf(at, room, spec, stars[0], str) : snprintf(at, room, spec, str);
+        }
+        if(n < 0){
+            return -1;
+        }
+        if((size_t)n < room){
+            out->len += n;
+            return 0;
+        }
+        if(bufReserve(out, n + 1) != 0){
+            return -1;
+        }
+    }
+    return -1;
+}
+
+/*handle one % conversion at fmt (just past the %) with arguments from
+args, advancing *next past the ones used. Returns how much of fmt was
+used, or -1 for a bad conversion*/
+static int conversion(const char *fmt, char **args, int argc, int *next, Buffer *out, int *stop){
+    char spec[64];
+    size_t len = 0;
+    int stars[2];
+    int starCount = 0;
+    const char *pos = fmt;
+    spec[len++] = '%';
+
+    //flags, width and precision, * takes them from the arguments
+    while(strchr("-+ #0'", *pos) && (*pos != 0) && (len < 16)){
+        spec[len++] = *pos++;
+    }
+    if(*pos == '*'){
+        stars[starCount++] = (*next < argc) ? (int)intArg(args[(*next)++], 0) : 0;
+        spec[len++] = *pos++;
+    }
+    while(isdigit((unsigned char)*pos) && (len < 32)){
+        spec[len++] = *pos++;
+    }
+    if(*pos == '.'){
+        spec[len++] = *pos++;
+        if(*pos == '*'){
+            stars[starCount++] = (*next < argc) ? (int)intArg(args[(*next)++], 0) : 0;
+            spec[len++] = *pos++;
+        }
+        while(isdigit((unsigned char)*pos) && (len < 48)){
+            spec[len++] = *pos++;
+        }
+    }
+    //length modifiers mean nothing here, the widest type is always used
+    while(strchr("hlLqjzt", *pos) && (*pos != 0)){
+        pos += 1;
+    }
+
+    char type = *pos;
+    const char *arg = (*next < argc) ? args[*next] : NULL;
+    if((type != '%') && (arg != NULL)){
+        *next += 1;
+    }
+    switch(type){
+    case 'd':
+    case 'i':
+        spec[len++] = 'l';
+        spec[len++] = 'l';
+        spec[len++] = type;
+        spec[len] = 0;
+        appendFormat(out, spec, stars, starCount, 'i', arg ? intArg(arg, 0) : 0, 0, NULL);
+        break;
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+        spec[len++] = 'l';
+        spec[len++] = 'l';
+        spec[len++] = type;
+        spec[len] = 0;
+        appendFormat(out, spec, stars, starCount, 'i', arg ? intArg(arg, 1) : 0, 0, NULL);
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec[len++] = 'L';
+        spec[len++] = type;
+        spec[len] = 0;
+        appendFormat(out, spec, stars, starCount, 'f', 0, arg ? floatArg(arg) : 0, NULL);
+        break;
+    case 'c':{
+        char one[2] = {arg ? arg[0] : 0, 0};
+        spec[len++] = 's';
+        spec[len] = 0;
+        appendFormat(out, spec, stars, starCount, 's', 0, 0, one);
+        break;
+    }
+    case 's':
+        spec[len++] = 's';
+        spec[len] = 0;
+        appendFormat(out, spec, stars, starCount, 's', 0, 0, arg ? arg : "");
+        break;
+    case 'b':{
+        //%b is %s with the argument's escapes done first
+        Buffer escaped;
+        bufInit(&escaped);
+        if(putEscape(arg ? arg : "", &escaped, stop) != 0){
+            bufFree(&escaped);
+            return -1;
+        }
+        spec[len++] = 's';
+        spec[len] = 0;
+        appendFormat(out, spec, stars, starCount, 's', 0, 0, escaped.data ? escaped.data : "");
+        bufFree(&escaped);
+        break;
+    }
+    case '%':
+        bufPutc(out, '%');
+        break;
+    default:
+        fprintf(stderr, "printf: %%%c: invalid conversion\n", type ? type : ' ');
+        return -1;
+    }
+    return pos - fmt + 1;
+}
+
+/*printf format [args ...]: the format is used again as long as arguments
+are left, missing ones count as empty or 0*/
+int printfBuiltin(char **args, int argc, int outfd){
+    if(argc < 2){
+        fprintf(stderr, "usage: printf format [arguments ...]\n");
+        return 2;
+    }
+    ArenaMark mark = arenaMark(&lineArena);
+    Buffer out;
+    bufInitArena(&out, &lineArena);
+    const char *format = args[1];
+    int next = 2;
+    int stop = 0;
+    int failed = 0;
+    badNumber = 0;
+    if(bufReserve(&out, 256) != 0){
+        arenaRelease(&lineArena, mark);
+        return 2;
+    }
+
+    do{
+        int used = next;
+        for(const char *pos = format; (*pos != 0) && !stop && !failed; ){
+            if(*pos == '\\'){
+                pos += 1;
+                if(*pos == 0){
+                    bufPutc(&out, '\\');
+                    break;
+                }
+                pos += escapeChar(pos, &out, &stop, 0);
+            }
+            else if(*pos == '%'){
+                int consumed = conversion(pos + 1, args, argc, &next, &out, &stop);
+                if(consumed < 0){
+                    failed = 1;
+                    break;
+                }
+                pos += consumed + 1;
+            }
+            else{
+                const char *special = strpbrk(pos, "\\%");
+                size_t plain = (special != NULL) ? (size_t)(special - pos) : strlen(pos);
+                bufAppend(&out, pos, plain);
+                pos += plain;
+            }
+        }
+        //a format that takes no arguments is only used once
+        if(next == used){
+            break;
+        }
+    } while((next < argc) && !stop && !failed);
+
+    int res = writeAll(outfd, out.data, out.len);
+    arenaRelease(&lineArena, mark);
+    if((res != 0) || failed || badNumber){
+        return 2;
+    }
+    return 1;
+}
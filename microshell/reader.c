@@ -0,0 +1,214 @@
+/* Author: Calvin Kerns
+ * Script input: hands out lines straight out of a mapped file, a string or
+ * big block reads, with no copy and no cap on line length
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define READ_BLOCK 65536
+
+/*cut line off at a # that starts a comment. An odd run of $ right before
+it makes it $# instead, same as counting dollars one character at a time*/
+void stripComment(char *line){
+    char *hash = line;
+    while(*(hash = lexNext(hash, LEX_COMMENT)) != 0){
+        size_t dollars = 0;
+        while((hash - dollars > line) && (hash[-(long)dollars - 1] == '$')){
+            dollars += 1;
+        }
+        if((dollars % 2) == 0){
+            *hash = 0;
+            return;
+        }
+        hash += 1;
+    }
+}
+
+//map the whole file, a zero length file just has no lines
+static int mapFile(Reader *r){
+    struct stat stats;
+    if(fstat(r->fd, &stats) != 0){
+        return -1;
+    }
+    r->pos = 0;
+    r->len = stats.st_size;
+    r->data = NULL;
+    if(!S_ISREG(stats.st_mode)){
+        return -1;
+    }
+    if(r->len == 0){
+        r->mapped = 1;
+        return 0;
+    }
+    //private and writable so newlines and comments can be nulled in place
+    r->data = mmap(NULL, r->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, r->fd, 0);
+    if(r->data == MAP_FAILED){
+        r->data = NULL;
+        return -1;
+    }
+    madvise(r->data, r->len, MADV_SEQUENTIAL);
+    r->mapped = 1;
+    return 0;
+}
+
+static void initReader(Reader *r){
+    memset(r, 0, sizeof(Reader));
+    r->fd = -1;
+    bufInit(&r->block);
+    bufInit(&r->tail);
+}
+
+/*read lines from the file at path, mapped when it is a regular file and
+read in blocks otherwise (pipes, /dev/stdin). Returns 0 or -1 with errno set
+if it couldn't be opened*/
+int readerOpenFile(Reader *r, const char *path){
+    initReader(r);
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(r->fd < 0){
+        return -1;
+    }
+    if(mapFile(r) != 0){
+        r->data = NULL;
+        r->len = 0;
+    }
+    return 0;
+}
+
+//read lines out of str, which gets written over
+void readerOpenString(Reader *r, char *str){
+    initReader(r);
+    r->data = str;
+    r->len = strlen(str);
+}
+
+//read lines from fd in blocks
+void readerOpenFd(Reader *r, int fd){
+    initReader(r);
+    r->fd = fd;
+}
+
+//next line out of a mapped file or string
+static char *memoryLine(Reader *r){
+    if(r->pos >= r->len){
+        return NULL;
+    }
+    char *line = r->data + r->pos;
+    size_t left = r->len - r->pos;
+    char *newline = memchr(line, '\n', left);
+    if(newline != NULL){
+        *newline = 0;
+        r->pos += newline - line + 1;
+        stripComment(line);
+        return line;
+    }
+    r->pos = r->len;
+    if(!r->mapped){
+        //strings are already null terminated
+        stripComment(line);
+        return line;
+    }
+    //there may be no room after the last byte of a mapping, copy it out
+    bufTruncate(&r->tail, 0);
+    if(bufAppend(&r->tail, line, left) != 0){
+        return NULL;
+    }
+    stripComment(r->tail.data);
+    return r->tail.data;
+}
+
+/*next line from fd. The buffer only holds the unread part, so a line stays
+good until the next call, like fgets into a static buffer did*/
+static char *blockLine(Reader *r){
+    Buffer *b = &r->block;
+    while(1){
+        if(r->pos < b->len){
+            char *line = b->data + r->pos;
+            size_t left = b->len - r->pos;
+            char *newline = memchr(line, '\n', left);
+            if(newline != NULL){
+                *newline = 0;
+                r->pos += newline - line + 1;
+                stripComment(line);
+                return line;
+            }
+            if(r->eof){
+                r->pos = b->len;
+                stripComment(line);
+                return line;
+            }
+        }
+        else if(r->eof){
+            return NULL;
+        }
+
+        //drop what has been handed out already and read some more
+        if(r->pos > 0){
+            memmove(b->data, b->data + r->pos, b->len - r->pos);
+            bufTruncate(b, b->len - r->pos);
+            r->pos = 0;
+        }
+        if(bufReserve(b, READ_BLOCK) != 0){
+            return NULL;
+        }
+        ssize_t got = read(r->fd, b->data + b->len, b->cap - b->len - 1);
+        if(got < 0){
+            perror("read");
+        }
+        if(got <= 0){
+            r->eof = 1;
+        }
+        else{
+            b->len += got;
+            b->data[b->len] = 0;
+        }
+    }
+}
+
+/*next line with the newline and any comment taken off. Returns NULL at the
+end of input*/
+char *readerLine(Reader *r){
+    if((r->data != NULL) || r->mapped){
+        return memoryLine(r);
+    }
+    if(r->fd < 0){
+        return NULL;
+    }
+    return blockLine(r);
+}
+
+/*start over from the first line. Mapped files are mapped again since lines
+were cut up in place. Returns -1 if the input can't be rewound*/
+int readerRewind(Reader *r){
+    if(r->mapped){
+        if(r->data != NULL){
+            munmap(r->data, r->len);
+        }
+        return mapFile(r);
+    }
+    if((r->fd < 0) || (lseek(r->fd, 0, SEEK_SET) != 0)){
+        return -1;
+    }
+    bufTruncate(&r->block, 0);
+    r->pos = 0;
+    r->eof = 0;
+    return 0;
+}
+
+void readerClose(Reader *r){
+    if(r->mapped && (r->data != NULL)){
+        munmap(r->data, r->len);
+    }
+    if(r->fd > 2){
+        close(r->fd);
+    }
+    bufFree(&r->block);
+    bufFree(&r->tail);
+    initReader(r);
+}
@@ -0,0 +1,278 @@
+/* Author: Calvin Kerns
+ * Redirections: <, >, >>, N> and N>&M, with N and M single digits, are
+ * taken out of a command before it is split into args. Builtins run in the
+ * shell get the files as their infd and outfd, external commands open them
+ * in the child
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ctype.h>
+
+//end of the word at str, quotes and $( ) are kept whole like expandArgs does
+static char *wordEnd(char *str){
+    int quotes = 0;
+    int depth = 0;
+    for(; *(str = lexNext(str, quotes ? LEX_QUOTE : LEX_QUOTE | LEX_GROUP | LEX_SPACE)) != 0; str++){
+        if(*str == '"'){
+            quotes = !quotes;
+        }
+        else if(quotes){
+            continue;
+        }
+        else if(*str == '('){
+            depth += 1;
+        }
+        else if((*str == ')') && (depth > 0)){
+            depth -= 1;
+        }
+        else if(((*str == ' ') || (*str == '\t')) && (depth == 0)){
+            break;
+        }
+    }
+    return str;
+}
+
+/*the file name for a redirection: the word expanded if asked, without its
+quotes. It has to come out as exactly one arg*/
+static char *redirectTarget(char *word, size_t len, int expandTargets){
+    char *text = arenaAlloc(&lineArena, len + 1);
+    if(text == NULL){
+        return NULL;
+    }
+    memcpy(text, word, len);
+    text[len] = 0;
+    int count = 0;
+    char **args = expandArgs(text, &count, expandTargets);
+    if(args == NULL){
+        return NULL;
+    }
+    if(count != 1){
+        fprintf(stderr, "%s: ambiguous redirect\n", text);
+        return NULL;
+    }
+    return args[0];
+}
+
+/*take every unquoted redirection out of line, outside $( ), into redirs.
+Returns a copy of line on the arena with them blanked out, or NULL after
+printing an error. The targets are expanded when expandTargets is set, with
+REDIRECT_RAW they are kept as written for lexCommand and nothing is printed*/
+char *takeRedirects(char *line, Redirects *redirs, int expandTargets){
+    size_t len = strlen(line);
+    char *copy = arenaAlloc(&lineArena, len + 1);
+    if(copy == NULL){
+        return NULL;
+    }
+    memcpy(copy, line, len + 1);
+
+    int quotes = 0;
+    int depth = 0;
+    for(char *pos = copy; *(pos = lexNext(pos, quotes ? LEX_QUOTE : LEX_QUOTE | LEX_GROUP | LEX_REDIRECT)) != 0; pos++){
+        if((*pos == '\\') && (pos[1] != 0)){
+            pos += 1;
+            continue;
+        }
+        if(*pos == '"'){
+            quotes = !quotes;
+        }
+        if(quotes){
+            continue;
+        }
+        if(*pos == '('){
+            depth += 1;
+        }
+        else if((*pos == ')') && (depth > 0)){
+            depth -= 1;
+        }
+        //<( and >( are process substitutions, expand deals with them
+        if(((*pos != '<') && (*pos != '>')) || (depth > 0) || (pos[1] == '(')){
+            continue;
+        }
+
+        Redirect redirect;
+        char *start = pos;
+        redirect.fd = (*pos == '<') ? 0 : 1;
+        redirect.dupFrom = -1;
+        redirect.path = NULL;
+        //a lone digit right before the operator picks the fd, as in 2>
+        if((pos > copy) && isdigit((unsigned char)pos[-1]) &&
+           ((pos - 1 == copy) || isspace((unsigned char)pos[-2]))){
+            redirect.fd = pos[-1] - '0';
+            start = pos - 1;
+        }
+        if(*pos == '<'){
+            redirect.openFlags = O_RDONLY;
+            pos += 1;
+        }
+        else if(pos[1] == '>'){
+            redirect.openFlags = O_WRONLY | O_CREAT | O_APPEND;
+            pos += 2;
+        }
+        else{
+            redirect.openFlags = O_WRONLY | O_CREAT | O_TRUNC;
+            pos += 1;
+        }
+
+        char *end;
+        if(pos[0] == '&'){
+            //N>&M copies fd M, which is one digit like N
+            if(!isdigit((unsigned char)pos[1]) || isdigit((unsigned char)pos[2])){
+                if(expandTargets != REDIRECT_RAW){
+                    fprintf(stderr, "syntax error: >& needs an fd from 0 to %d\n", REDIRECT_FDS - 1);
+                }
+                return NULL;
+            }
+            redirect.dupFrom = pos[1] - '0';
+            end = pos + 2;
+        }
+        else{
+            char *word = pos + strspn(pos, " \t");
+            end = wordEnd(word);
+            if((end == word) || (((*word == '<') || (*word == '>')) && (word[1] != '('))){
+                if(expandTargets != REDIRECT_RAW){
+                    fprintf(stderr, "syntax error: redirection needs a file name\n");
+                }
+                return NULL;
+            }
+            if(expandTargets == REDIRECT_RAW){
+                redirect.path = arenaAlloc(&lineArena, end - word + 1);
+                if(redirect.path != NULL){
+                    memcpy(redirect.path, word, end - word);
+                    redirect.path[end - word] = 0;
+                }
+            }
+            else{
+                redirect.path = redirectTarget(word, end - word, expandTargets);
+            }
+            if(redirect.path == NULL){
+                return NULL;
+            }
+        }
+        if(redirs->count == REDIRECT_MAX){
+            if(expandTargets != REDIRECT_RAW){
+                fprintf(stderr, "too many redirections\n");
+            }
+            return NULL;
+        }
+        redirs->list[redirs->count++] = redirect;
+        memset(start, ' ', end - start);
+        pos = end - 1;
+    }
+    return copy;
+}
+
+/*check that every fd above 2 copied with N>&M is one the shell was started
+with or an earlier redirection of the same command set up. The shell's own
+files are close on exec and must not leak into a command that way. Returns
+0 or -1 after printing an error*/
+int checkRedirects(const Redirects *redirs){
+    for(int i = 0; i < redirs->count; i++){
+        int from = redirs->list[i].dupFrom;
+        int set = (from <= 2);
+        for(int j = 0; !set && (j < i); j++){
+            set = (redirs->list[j].fd == from);
+        }
+        int flags = set ? 0 : fcntl(from, F_GETFD);
+        if((flags < 0) || (flags & FD_CLOEXEC)){
+            fprintf(stderr, "%d: Bad file descriptor\n", from);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int openTarget(const Redirect *redirect){
+    int fd = open(redirect->path, redirect->openFlags | O_CLOEXEC, 0666);
+    if(fd < 0){
+        perror(redirect->path);
+    }
+    return fd;
+}
+
+/*open the redirections of a builtin run in the shell. inputFD and outputFD
+are replaced by the files for 0 and 1, fd 2 itself is swapped until
+closeRedirects. Files for fds above 2 are only created or checked, builtins
+don't write to them. Returns 0 or -1 after printing an error*/
+int openRedirects(Redirects *redirs, int *inputFD, int *outputFD){
+    int current[REDIRECT_FDS];
+    for(int i = 0; i < REDIRECT_FDS; i++){
+        current[i] = i;
+    }
+    current[0] = *inputFD;
+    current[1] = *outputFD;
+    redirs->openCount = 0;
+    redirs->savedErr = -1;
+    for(int i = 0; i < redirs->count; i++){
+        Redirect *redirect = &redirs->list[i];
+        if(redirect->dupFrom >= 0){
+            current[redirect->fd] = current[redirect->dupFrom];
+            continue;
+        }
+        int fd = openTarget(redirect);
+        if(fd < 0){
+            closeRedirects(redirs);
+            return -1;
+        }
+        redirs->opened[redirs->openCount++] = fd;
+        current[redirect->fd] = fd;
+    }
+    if(current[2] != 2){
+        fflush(stderr);
+        redirs->savedErr = fcntl(2, F_DUPFD_CLOEXEC, 3);
+        if((redirs->savedErr < 0) || (dup2(current[2], 2) < 0)){
+            perror("redirect");
+            closeRedirects(redirs);
+            return -1;
+        }
+    }
+    *inputFD = current[0];
+    *outputFD = current[1];
+    return 0;
+}
+
+//close what openRedirects opened and give the shell its stderr back
+void closeRedirects(Redirects *redirs){
+    if(redirs->savedErr >= 0){
+        fflush(stderr);
+        dup2(redirs->savedErr, 2);
+        close(redirs->savedErr);
+        redirs->savedErr = -1;
+    }
+    for(int i = 0; i < redirs->openCount; i++){
+        close(redirs->opened[i]);
+    }
+    redirs->openCount = 0;
+}
+
+/*set up the redirections in a child that is about to exec or
+run a builtin. Returns 0 or -1 after printing an error*/
+int applyRedirects(const Redirects *redirs){
+    for(int i = 0; (redirs != NULL) && (i < redirs->count); i++){
+        const Redirect *redirect = &redirs->list[i];
+        if(redirect->dupFrom >= 0){
+            if(dup2(redirect->dupFrom, redirect->fd) < 0){
+                perror("redirect");
+                return -1;
+            }
+            continue;
+        }
+        int fd = openTarget(redirect);
+        if(fd < 0){
+            return -1;
+        }
+        if(fd != redirect->fd){
+            dup2(fd, redirect->fd);
+            close(fd);
+        }
+        else{
+            //got the fd it was meant for, keep it past exec
+            fcntl(fd, F_SETFD, 0);
+        }
+    }
+    return 0;
+}
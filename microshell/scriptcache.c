@@ -0,0 +1,379 @@
+/* Author: Calvin Kerns
+ * Compiled script cache: the parsed statement tree of a script is saved
+ * to a file and memory mapped on later runs, so they skip parsing. The
+ * lexed words of each command are saved with it so they skip lexing too
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define CACHE_MAGIC 0x43485355   //"USHC"
+#define CACHE_VERSION 4
+#define NO_INDEX UINT32_MAX
+//a cache directory path plus /<16 hex digits>.ushc
+#define CACHE_PATH_MAX (PATH_MAX + 64)
+
+//start of a cache file, everything the script is checked against
+struct cacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t partSize;      //sizeof(WordPart) and sizeof(Words), the words are saved as they are in memory
+    uint32_t wordsSize;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint64_t hash;          //FNV-1a of the script's bytes
+    uint32_t nodeCount;
+    uint32_t root;
+    uint64_t stringsSize;   //strings follow the node array
+};
+
+//a Node with its pointers turned into indexes and string offsets
+struct cacheNode {
+    int32_t kind;
+    int32_t flags;
+    uint32_t text;
+    uint32_t words;
+    uint32_t body;
+    uint32_t elseBody;
+    uint32_t next;
+    uint32_t lexed;         //offset of the node's Words in the strings, 8 aligned
+};
+
+//nodes and strings built up while saving a tree
+struct cacheWriter {
+    struct cacheNode *nodes;
+    uint32_t count;
+    uint32_t cap;
+    Buffer strings;
+    int failed;
+};
+
+//FNV-1a over the whole file, returns 0 if it couldn't be read
+static uint64_t hashFile(const char *path){
+    char block[65536];
+    uint64_t hash = 14695981039346656037UL;
+    ssize_t got;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0){
+        return 0;
+    }
+    while((got = read(fd, block, sizeof(block))) > 0){
+        for(ssize_t i = 0; i < got; i++){
+            hash ^= (unsigned char)block[i];
+            hash *= 1099511628211UL;
+        }
+    }
+    close(fd);
+    return (got < 0) ? 0 : hash;
+}
+
+/*name of the cache file for script in $USH_CACHE_DIR, $XDG_CACHE_HOME/ush
+or ~/.cache/ush, creating the directory if needed. out has CACHE_PATH_MAX
+bytes. Returns 0 on success, -1 if a path would be too long*/
+static int cachePath(const char *script, char out[CACHE_PATH_MAX]){
+    char real[PATH_MAX];
+    char dir[PATH_MAX];
+    const char *base;
+    int len;
+    if(realpath(script, real) == NULL){
+        return -1;
+    }
+    if((base = getenv("USH_CACHE_DIR")) != NULL){
+        len = snprintf(dir, sizeof(dir), "%s", base);
+    }
+    else if((base = getenv("XDG_CACHE_HOME")) != NULL){
+        len = snprintf(dir, sizeof(dir), "%s/ush", base);
+    }
+    else if((base = getenv("HOME")) != NULL){
+        len = snprintf(dir, sizeof(dir), "%s/.cache", base);
+        if((len < 0) || ((size_t)len >= sizeof(dir))){
+            return -1;
+        }
+        mkdir(dir, 0700);
+        len = snprintf(dir, sizeof(dir), "%s/.cache/ush", base);
+    }
+    else{
+        return -1;
+    }
+    if((len < 0) || ((size_t)len >= sizeof(dir))){
+        return -1;
+    }
+    if((mkdir(dir, 0700) != 0) && (access(dir, W_OK) != 0)){
+        return -1;
+    }
+    len = snprintf(out, CACHE_PATH_MAX, "%s/%016lx.ushc", dir, hashString(real));
+    return ((len < 0) || (len >= CACHE_PATH_MAX)) ? -1 : 0;
+}
+
+static uint32_t addString(struct cacheWriter *w, const char *str){
+    if(str == NULL){
+        return NO_INDEX;
+    }
+    uint32_t offset = w->strings.len;
+    if(bufAppend(&w->strings, str, strlen(str) + 1) != 0){
+        w->failed = 1;
+    }
+    return offset;
+}
+
+//copy a lexed command into the strings as it is, its offsets are already relative
+static uint32_t addWords(struct cacheWriter *w, const Words *words){
+    static const char zeros[8];
+    if(words == NULL){
+        return NO_INDEX;
+    }
+    if((bufAppend(&w->strings, zeros, (8 - (w->strings.len & 7)) & 7) != 0) ||
+       (bufAppend(&w->strings, (const char *)words, words->size) != 0)){
+        w->failed = 1;
+        return NO_INDEX;
+    }
+    return w->strings.len - words->size;
+}
+
+//flatten node and everything it reaches, returns its index
+static uint32_t addNode(struct cacheWriter *w, Node *node){
+    if((node == NULL) || w->failed){
+        return NO_INDEX;
+    }
+    if(w->count == w->cap){
+        uint32_t newCap = w->cap ? w->cap * 2 : 64;
+        struct cacheNode *grown = realloc(w->nodes, newCap * sizeof(struct cacheNode));
+        if(grown == NULL){
+            w->failed = 1;
+            return NO_INDEX;
+        }
+        w->nodes = grown;
+        w->cap = newCap;
+    }
+    uint32_t index = w->count++;
+    struct cacheNode flat;
+    memset(&flat, 0, sizeof(flat));
+    flat.kind = node->kind;
+    flat.flags = node->flags;
+    flat.text = addString(w, node->text);
+    flat.words = addString(w, node->words);
+    flat.lexed = addWords(w, node->lexed);
+    flat.body = addNode(w, node->body);
+    flat.elseBody = addNode(w, node->elseBody);
+    flat.next = addNode(w, node->next);
+    //the array may have moved while children were added
+    w->nodes[index] = flat;
+    return index;
+}
+
+//write tree for script next to the other cache files, errors are ignored
+static void saveScriptCache(const char *script, struct stat *stats, uint64_t hash, Node *tree){
+    char path[CACHE_PATH_MAX];
+    char temp[CACHE_PATH_MAX + 32];
+    struct cacheWriter w;
+    if(cachePath(script, path) != 0){
+        return;
+    }
+    memset(&w, 0, sizeof(w));
+    bufInit(&w.strings);
+    uint32_t root = addNode(&w, tree);
+
+    struct cacheHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.version = CACHE_VERSION;
+    header.partSize = sizeof(WordPart);
+    header.wordsSize = sizeof(Words);
+    header.dev = stats->st_dev;
+    header.ino = stats->st_ino;
+    header.size = stats->st_size;
+    header.mtimeSec = stats->st_mtim.tv_sec;
+    header.mtimeNsec = stats->st_mtim.tv_nsec;
+    header.hash = hash;
+    header.nodeCount = w.count;
+    header.root = root;
+    header.stringsSize = w.strings.len;
+
+    //write a temp file and rename it so other shells never see half a cache
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", path, (int)getpid());
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if((fd >= 0) && !w.failed){
+        size_t nodeBytes = w.count * sizeof(struct cacheNode);
+        int ok = (write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)) &&
+                 (write(fd, w.nodes, nodeBytes) == (ssize_t)nodeBytes) &&
+                 (write(fd, w.strings.data, w.strings.len) == (ssize_t)w.strings.len);
+        close(fd);
+        if(!ok || (rename(temp, path) != 0)){
+            unlink(temp);
+        }
+    }
+    else if(fd >= 0){
+        close(fd);
+        unlink(temp);
+    }
+    free(w.nodes);
+    bufFree(&w.strings);
+}
+
+//a string offset of a node is NO_INDEX or a null terminated string inside strings
+static int validString(uint32_t offset, const char *strings, uint64_t size){
+    return (offset == NO_INDEX) || ((offset < size) && (memchr(strings + offset, 0, size - offset) != NULL));
+}
+
+/*check every node of a mapped cache before its tree is built: kinds, string
+and word offsets inside the strings, and links that make a tree, every node
+reached from one place at most and never the root. A cache that was cut
+short or scribbled on is then just a miss*/
+static int validNodes(const struct cacheNode *flat, uint32_t count, uint32_t root, const char *strings, uint64_t size){
+    if(root >= count){
+        return 0;
+    }
+    unsigned char *seen = calloc(count, 1);
+    if(seen == NULL){
+        return 0;
+    }
+    seen[root] = 1;
+    int valid = 1;
+    for(uint32_t i = 0; valid && (i < count); i++){
+        const struct cacheNode *node = &flat[i];
+        uint32_t links[3] = {node->body, node->elseBody, node->next};
+        valid = (node->kind >= NODE_CMD) && (node->kind <= NODE_CONTINUE) &&
+                validString(node->text, strings, size) && validString(node->words, strings, size) &&
+                //everything but break and continue runs its text, for needs its words one way or the other
+                ((node->kind >= NODE_BREAK) || (node->text != NO_INDEX)) &&
+                ((node->kind != NODE_FOR) || (node->words != NO_INDEX) || (node->lexed != NO_INDEX)) &&
+                ((node->lexed == NO_INDEX) ||
+                 (((node->lexed & 7) == 0) && (node->lexed < size) &&
+                  validWords((const Words *)(strings + node->lexed), size - node->lexed)));
+        for(int j = 0; valid && (j < 3); j++){
+            if(links[j] != NO_INDEX){
+                valid = (links[j] < count) && !seen[links[j]];
+                if(valid){
+                    seen[links[j]] = 1;
+                }
+            }
+        }
+    }
+    free(seen);
+    return valid;
+}
+
+/*map the cache for script and rebuild its tree, pointing the text of each
+node straight into the mapping. The mapping is private and writable because
+processline pokes temporary nulls into the lines it runs. Returns NULL if
+there is no cache or it doesn't match the script anymore*/
+static Node *loadScriptCache(const char *script, struct stat *stats, uint64_t *hash, int *empty){
+    char path[CACHE_PATH_MAX];
+    struct stat cacheStats;
+    *empty = 0;
+    if(cachePath(script, path) != 0){
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd < 0){
+        return NULL;
+    }
+    if((fstat(fd, &cacheStats) != 0) || ((size_t)cacheStats.st_size < sizeof(struct cacheHeader))){
+        close(fd);
+        return NULL;
+    }
+    size_t size = cacheStats.st_size;
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED){
+        close(fd);
+        return NULL;
+    }
+    struct cacheHeader *header = (struct cacheHeader *)map;
+    int valid = (header->magic == CACHE_MAGIC) && (header->version == CACHE_VERSION) &&
+                (header->partSize == sizeof(WordPart)) && (header->wordsSize == sizeof(Words)) &&
+                (header->dev == (uint64_t)stats->st_dev) && (header->ino == (uint64_t)stats->st_ino) &&
+                (header->size == (uint64_t)stats->st_size) && (header->stringsSize < size) &&
+                (sizeof(struct cacheHeader) + header->nodeCount * sizeof(struct cacheNode) +
+                 header->stringsSize == size);
+    if(valid && ((header->mtimeSec != stats->st_mtim.tv_sec) || (header->mtimeNsec != stats->st_mtim.tv_nsec))){
+        //touched but maybe not changed, the content hash decides
+        if(*hash == 0){
+            *hash = hashFile(script);
+        }
+        valid = (*hash != 0) && (*hash == header->hash);
+        if(valid){
+            //remember the new mtime, if this fails the hash is just checked again next time
+            int64_t mtime[2] = {stats->st_mtim.tv_sec, stats->st_mtim.tv_nsec};
+            ssize_t wrote = pwrite(fd, mtime, sizeof(mtime), offsetof(struct cacheHeader, mtimeSec));
+            (void)wrote;
+        }
+    }
+    close(fd);
+    if(!valid){
+        munmap(map, size);
+        return NULL;
+    }
+
+    uint32_t count = header->nodeCount;
+    struct cacheNode *flat = (struct cacheNode *)(map + sizeof(struct cacheHeader));
+    char *strings = (char *)(flat + count);
+    if((count == 0) || (header->root == NO_INDEX)){
+        munmap(map, size);
+        *empty = 1;
+        return NULL;
+    }
+    if(!validNodes(flat, count, header->root, strings, header->stringsSize)){
+        munmap(map, size);
+        return NULL;
+    }
+    Node *nodes = calloc(count, sizeof(Node));
+    if(nodes == NULL){
+        munmap(map, size);
+        return NULL;
+    }
+    for(uint32_t i = 0; i < count; i++){
+        nodes[i].kind = flat[i].kind;
+        nodes[i].flags = flat[i].flags;
+        nodes[i].text = (flat[i].text == NO_INDEX) ? NULL : strings + flat[i].text;
+        nodes[i].words = (flat[i].words == NO_INDEX) ? NULL : strings + flat[i].words;
+        nodes[i].lexed = (flat[i].lexed == NO_INDEX) ? NULL : (Words *)(strings + flat[i].lexed);
+        nodes[i].body = (flat[i].body == NO_INDEX) ? NULL : &nodes[flat[i].body];
+        nodes[i].elseBody = (flat[i].elseBody == NO_INDEX) ? NULL : &nodes[flat[i].elseBody];
+        nodes[i].next = (flat[i].next == NO_INDEX) ? NULL : &nodes[flat[i].next];
+    }
+    //the tree and the mapping live as long as the script runs
+    return &nodes[header->root];
+}
+
+/*get the statement tree for the script at path, from the cache when it is
+still good, otherwise by parsing everything source hands out and saving the
+result. Returns NULL when caching is off (USH_NOCACHE) or the script has a
+syntax error, the caller then rewinds and runs it line by line so the error
+is reported where it is*/
+Node *loadScript(const char *path, LineSource source){
+    static Node emptyScript;
+    struct stat stats;
+    uint64_t hash = 0;
+    int empty;
+    int error;
+
+    if((getenv("USH_NOCACHE") != NULL) || (stat(path, &stats) != 0) || !S_ISREG(stats.st_mode)){
+        return NULL;
+    }
+    Node *tree = loadScriptCache(path, &stats, &hash, &empty);
+    if((tree != NULL) || empty){
+        return tree ? tree : &emptyScript;
+    }
+
+    tree = parseScript(source, &error);
+    if(error){
+        return NULL;
+    }
+    if(hash == 0){
+        hash = hashFile(path);
+    }
+    saveScriptCache(path, &stats, hash, tree);
+    return tree ? tree : &emptyScript;
+}
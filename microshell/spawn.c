@@ -0,0 +1,179 @@
+/* Author: Calvin Kerns
+ * Starts external commands, using posix_spawn unless plain fork is needed
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+
+extern char **environ;
+
+int spawnMode = SPAWN_POSIX;
+
+//classic fork and exec, the child does the fd setup itself
+static pid_t forkCommand(char *path, char **argv, int inputFD, int outputFD, const Redirects *redirs, pid_t pgroup){
+    char **env = varEnviron();
+    long trace = TRACE_BEGIN(TRACE_FORK, argv[0]);
+    pid_t cpid = fork();
+    if(cpid != 0){
+        TRACE_END(trace);
+    }
+    if(cpid < 0){
+        perror("fork");
+        return -1;
+    }
+    //both sides set the group so it is in place whichever runs first
+    if(pgroup >= 0){
+        setpgid((cpid == 0) ? 0 : cpid, pgroup);
+    }
+    if(cpid == 0){
+        //same start as the posix_spawn path: SIGINT at its default and nothing blocked
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGINT, SIG_DFL);
+        //change input if needed
+        if(inputFD != 0){
+            dup2(inputFD, 0);
+        }
+        //change output if needed
+        if(outputFD != 1){
+            dup2(outputFD, 1);
+        }
+        if(applyRedirects(redirs) != 0){
+            _exit(1);
+        }
+        environ = env;
+        execv(path, argv);
+        //cached path went stale or needs a shell, let execvp sort it out
+        execvp(argv[0], argv);
+        perror("exec");
+        _exit(127);
+    }
+    return cpid;
+}
+
+/*start argv[0] (already resolved to path) with inputFD as stdin and outputFD
+as stdout, then redirs (NULL for none) on top of them. posix_spawn lets glibc use clone(CLONE_VM|CLONE_VFORK), so the cost
+doesn't grow with the size of the shell's memory the way fork's page table
+copy does. The fd setup, redirection files included, is handed over as file
+actions so only the child ever opens them. Returns the child pid
+or -1 if it couldn't be started. pgroup -1 leaves the child in the shell's
+process group, 0 makes it the leader of a new one and anything else puts it
+in that group*/
+pid_t launchCommand(char *path, char **argv, int inputFD, int outputFD, const Redirects *redirs, pid_t pgroup){
+    if(spawnMode == SPAWN_FORK){
+        return forkCommand(path, argv, inputFD, outputFD, redirs, pgroup);
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none;
+    pid_t cpid;
+    int opens = 0;
+
+    posix_spawn_file_actions_init(&actions);
+    if(inputFD != 0){
+        posix_spawn_file_actions_adddup2(&actions, inputFD, 0);
+    }
+    if(outputFD != 1){
+        posix_spawn_file_actions_adddup2(&actions, outputFD, 1);
+    }
+    for(int i = 0; (redirs != NULL) && (i < redirs->count); i++){
+        const Redirect *redirect = &redirs->list[i];
+        if(redirect->dupFrom >= 0){
+            posix_spawn_file_actions_adddup2(&actions, redirect->dupFrom, redirect->fd);
+        }
+        else{
+            posix_spawn_file_actions_addopen(&actions, redirect->fd, redirect->path, redirect->openFlags, 0666);
+            opens += 1;
+        }
+    }
+    //children start with SIGINT at its default and nothing blocked
+    posix_spawnattr_init(&attr);
+    sigemptyset(&none);
+    posix_spawnattr_setsigmask(&attr, &none);
+    sigaddset(&none, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &none);
+    short spawnFlags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    if(pgroup >= 0){
+        posix_spawnattr_setpgroup(&attr, pgroup);
+        spawnFlags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr, spawnFlags);
+
+    char **env = varEnviron();
+    long trace = TRACE_BEGIN(TRACE_EXEC, argv[0]);
+    int err = posix_spawn(&cpid, path, &actions, &attr, argv, env);
+    /*cached path went stale, search PATH again. A file the redirections
+    open that isn't there is ENOENT too, then only if path itself is gone*/
+    if((err == ENOENT) && ((opens == 0) || (access(path, X_OK) != 0)) && hashCommand(argv[0])){
+        path = lookupCommand(argv[0]);
+        err = posix_spawn(&cpid, path, &actions, &attr, argv, env);
+    }
+    TRACE_END(trace);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if((err == ENOEXEC) || ((err != 0) && (redirs != NULL) && (redirs->count > 0))){
+        /*scripts without a #! line need execvp's /bin/sh fallback, and a
+        redirection that failed is retried so the child can name the file*/
+        return forkCommand(path, argv, inputFD, outputFD, redirs, pgroup);
+    }
+    if(err != 0){
+        fprintf(stderr, "exec: %s\n", strerror(err));
+        return -1;
+    }
+    return cpid;
+}
+
+/*run a builtin in a child of its own, for pipeline stages and jobs where
+running it in the shell could block the commands around it. The child keeps
+only stdin, stdout and stderr open, after redirs. Returns the child pid or -1*/
+pid_t forkBuiltin(char **argv, int argc, int inputFD, int outputFD, const Redirects *redirs, pid_t pgroup){
+    //anything stdio has buffered would be written twice otherwise
+    fflush(NULL);
+    long trace = TRACE_BEGIN(TRACE_FORK, argv[0]);
+    pid_t cpid = fork();
+    if(cpid != 0){
+        TRACE_END(trace);
+    }
+    if(cpid < 0){
+        perror("fork");
+        return -1;
+    }
+    if(pgroup >= 0){
+        setpgid((cpid == 0) ? 0 : cpid, pgroup);
+    }
+    if(cpid == 0){
+        //the parent keeps the trace, the child's events would be lost anyway
+        traceStop();
+        signal(SIGINT, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        if(inputFD != 0){
+            dup2(inputFD, 0);
+        }
+        if(outputFD != 1){
+            dup2(outputFD, 1);
+        }
+        if(applyRedirects(redirs) != 0){
+            _exit(1);
+        }
+        //other pipes of the pipeline would otherwise stay open until this exits
+        if(close_range(3, ~0U, 0) != 0){
+            for(int fd = sysconf(_SC_OPEN_MAX) - 1; fd > 2; fd--){
+                close(fd);
+            }
+        }
+        int res = execBuiltin(argv, argc, 0, 1);
+        fflush(NULL);
+        _exit((res == 3) ? numberReplace : (res == 2));
+    }
+    return cpid;
+}
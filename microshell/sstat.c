@@ -0,0 +1,238 @@
+/* Author: Calvin Kerns
+ * sstat builtin: metadata for every file named, one line each. The statx
+ * calls are shared out to threads for long lists, names for uids and gids
+ * are looked up once per command and the lines go out in big writes
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pwd.h>
+#include <grp.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define SSTAT_MAX_THREADS 16
+//below this many files threads cost more than they save
+#define SSTAT_PARALLEL_MIN 256
+//files a thread claims at a time
+#define SSTAT_BATCH 64
+#define SSTAT_FLUSH 65536
+#define SSTAT_MASK (STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID | STATX_SIZE | STATX_MTIME)
+
+struct sstatResult {
+    struct statx stats;
+    int error;          //errno of a failed statx, 0 if it worked
+};
+
+struct sstatRun {
+    char **files;
+    struct sstatResult *results;
+    size_t count;
+    size_t next;        //first file no thread has claimed, taken atomically
+};
+
+//an id and the name it maps to, NULL name when it has none
+struct idName {
+    unsigned int id;
+    char *name;
+};
+
+struct idCache {
+    struct idName *ids;
+    int count;
+    int cap;
+};
+
+static void statRange(struct sstatRun *run, size_t start, size_t end){
+    for(size_t i = start; i < end; i++){
+        struct sstatResult *result = &run->results[i];
+        result->error = 0;
+        if(statx(AT_FDCWD, run->files[i], AT_STATX_SYNC_AS_STAT, SSTAT_MASK, &result->stats) != 0){
+            result->error = errno;
+        }
+    }
+}
+
+//claim batches of files until there are none left
+static void *statWorker(void *arg){
+    struct sstatRun *run = arg;
+    while(1){
+        size_t start = __atomic_fetch_add(&run->next, SSTAT_BATCH, __ATOMIC_RELAXED);
+        if(start >= run->count){
+            break;
+        }
+        size_t end = (start + SSTAT_BATCH < run->count) ? start + SSTAT_BATCH : run->count;
+        statRange(run, start, end);
+    }
+    return NULL;
+}
+
+//statx every file, with a thread per cpu when there are enough of them
+static void statAll(struct sstatRun *run){
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(threads > SSTAT_MAX_THREADS){
+        threads = SSTAT_MAX_THREADS;
+    }
+    if((threads < 2) || (run->count < SSTAT_PARALLEL_MIN)){
+        statRange(run, 0, run->count);
+        return;
+    }
+    pthread_t workers[SSTAT_MAX_THREADS];
+    int started = 0;
+    for(int i = 0; i < threads; i++){
+        if(pthread_create(&workers[i], NULL, statWorker, run) != 0){
+            break;
+        }
+        started += 1;
+    }
+    //this thread takes batches too, and finishes the job if none started
+    statWorker(run);
+    for(int i = 0; i < started; i++){
+        pthread_join(workers[i], NULL);
+    }
+}
+
+/*name for id, asking getpwuid or getgrgid only the first time an id comes
+up. NULL if it has no name*/
+static const char *idLookup(struct idCache *cache, unsigned int id, int isGroup){
+    for(int i = 0; i < cache->count; i++){
+        if(cache->ids[i].id == id){
+            return cache->ids[i].name;
+        }
+    }
+    char *name = NULL;
+    if(isGroup){
+        struct group *group = getgrgid(id);
+        name = (group != NULL) ? strdup(group->gr_name) : NULL;
+    }
+    else{
+        struct passwd *password = getpwuid(id);
+        name = (password != NULL) ? strdup(password->pw_name) : NULL;
+    }
+    if(cache->count == cache->cap){
+        int newCap = cache->cap ? cache->cap * 2 : 8;
+        struct idName *grown = realloc(cache->ids, newCap * sizeof(struct idName));
+        if(grown == NULL){
+            //can't keep it, the name is lost after this line
+            free(name);
+            return NULL;
+        }
+        cache->ids = grown;
+        cache->cap = newCap;
+    }
+    cache->ids[cache->count].id = id;
+    cache->ids[cache->count].name = name;
+    cache->count += 1;
+    return name;
+}
+
+static void freeIdCache(struct idCache *cache){
+    for(int i = 0; i < cache->count; i++){
+        free(cache->ids[i].name);
+    }
+    free(cache->ids);
+}
+
+//the line for one file: name user group mode links size mtime
+static void formatResult(Buffer *out, const char *file, struct statx *stats,
+                         struct idCache *users, struct idCache *groups,
+                         long long *lastTime, char *timeText){
+    char mode[12];
+    char userID[20];
+    char groupID[20];
+    const char *user = idLookup(users, stats->stx_uid, 0);
+    const char *group = idLookup(groups, stats->stx_gid, 1);
+    if(user == NULL){
+        snprintf(userID, sizeof(userID), "%u", stats->stx_uid);
+        user = userID;
+    }
+    if(group == NULL){
+        snprintf(groupID, sizeof(groupID), "%u", stats->stx_gid);
+        group = groupID;
+    }
+    my_strmode(stats->stx_mode, mode);
+
+    //files from one glob tend to share mtimes, only redo the text on a change
+    if(stats->stx_mtime.tv_sec != *lastTime){
+        time_t mtime = stats->stx_mtime.tv_sec;
+        struct tm local;
+        localtime_r(&mtime, &local);
+        strftime(timeText, 64, "%a %b %e %H:%M:%S %Y", &local);
+        *lastTime = stats->stx_mtime.tv_sec;
+    }
+
+    char line[128];
+    bufPuts(out, file);
+    bufPutc(out, ' ');
+    bufPuts(out, user);
+    bufPutc(out, ' ');
+    bufPuts(out, group);
+    snprintf(line, sizeof(line), " %s%u %llu %s\n", mode, stats->stx_nlink,
+             (unsigned long long)stats->stx_size, timeText);
+    bufPuts(out, line);
+}
+
+/*sstat file ...: every file is looked at even when some fail, failures are
+reported in order with the other lines and make the status 1*/
+int sstatBuiltin(char **args, int argc, int outfd){
+    if(argc <= 1){
+        fprintf(stderr, "Incorrect amount of arguments\n");
+        return 2;
+    }
+    struct sstatRun run;
+    run.files = &args[1];
+    run.count = argc - 1;
+    run.next = 0;
+    run.results = malloc(run.count * sizeof(struct sstatResult));
+    if(run.results == NULL){
+        perror("sstat malloc");
+        return 2;
+    }
+    statAll(&run);
+
+    ArenaMark mark = arenaMark(&lineArena);
+    Buffer out;
+    bufInitArena(&out, &lineArena);
+    struct idCache users = {NULL, 0, 0};
+    struct idCache groups = {NULL, 0, 0};
+    long long lastTime = -1;
+    char timeText[64];
+    int failed = 0;
+    tzset();
+    for(size_t i = 0; i < run.count; i++){
+        struct sstatResult *result = &run.results[i];
+        if(result->error != 0){
+            //what came before it goes out first so the order holds
+            writeAll(outfd, out.data, out.len);
+            out.len = 0;
+            fprintf(stderr, "stat failed: %s: %s\n", run.files[i], strerror(result->error));
+            failed = 1;
+            continue;
+        }
+        formatResult(&out, run.files[i], &result->stats, &users, &groups, &lastTime, timeText);
+        if(out.len >= SSTAT_FLUSH){
+            if(writeAll(outfd, out.data, out.len) != 0){
+                perror("write error");
+                failed = 1;
+                break;
+            }
+            out.len = 0;
+        }
+    }
+    if((out.len > 0) && (writeAll(outfd, out.data, out.len) != 0)){
+        perror("write error");
+        failed = 1;
+    }
+    arenaRelease(&lineArena, mark);
+    freeIdCache(&users);
+    freeIdCache(&groups);
+    free(run.results);
+    return failed ? 2 : 1;
+}
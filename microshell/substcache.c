@@ -0,0 +1,364 @@
+/* Author: Calvin Kerns
+ * Opt-in cache of $( ) output. Once the cache builtin turns it on, for
+ * every command or just the ones named, a substitution that exited 0 is
+ * remembered under its text, the cwd, PATH, the exported variables and the
+ * ${NAME} values it uses. An entry is used again until its TTL runs out or
+ * a file named in the command changes its mtime or size
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define SUBST_START 64
+//the table is cleared rather than grown past this
+#define SUBST_MAX_ENTRIES 4096
+//bigger output isn't kept
+#define SUBST_MAX_OUTPUT (1 << 20)
+#define SUBST_MAX_FILES 8
+#define SUBST_DEFAULT_TTL 60
+
+#define SUBST_OFF 0
+#define SUBST_ALL 1
+#define SUBST_LISTED 2      //only commands named with cache cmd
+
+//a file named in the command as it was when the output was stored
+struct watchedFile {
+    char *path;
+    struct timespec mtime;
+    off_t size;
+};
+
+struct substEntry {
+    char *key;              //NULL for an empty slot
+    size_t keyLen;
+    unsigned long hash;
+    char *output;
+    size_t outputLen;
+    double stored;          //seconds, CLOCK_MONOTONIC
+    int fileCount;
+    struct watchedFile files[SUBST_MAX_FILES];
+};
+
+static struct substEntry *substTable;
+static size_t tableSize;
+static size_t tableUsed;
+static int mode = SUBST_OFF;
+static double ttl = SUBST_DEFAULT_TTL;
+static char **listed;
+static int listedCount;
+
+static long hits;
+static long misses;
+static long stores;
+static long expired;
+static long changed;
+
+static double seconds(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static unsigned long hashKey(const char *key, size_t len){
+    unsigned long hash = 14695981039346656037UL;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)key[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+//length of the first word of command
+static size_t firstWord(const char *command){
+    command += strspn(command, " \t");
+    return strcspn(command, " \t");
+}
+
+/*1 if command may be cached: the cache is on for it and the only $ in it
+are ${NAME}, whose values go into the key. $1, $? and $$ can't be checked*/
+static int cacheable(const char *command){
+    if(mode == SUBST_OFF){
+        return 0;
+    }
+    for(const char *dollar = strchr(command, '$'); dollar != NULL; dollar = strchr(dollar + 1, '$')){
+        if(dollar[1] != '{'){
+            return 0;
+        }
+    }
+    if(mode == SUBST_ALL){
+        return 1;
+    }
+    const char *name = command + strspn(command, " \t");
+    size_t len = firstWord(command);
+    for(int i = 0; i < listedCount; i++){
+        if((strlen(listed[i]) == len) && (memcmp(listed[i], name, len) == 0)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*command text, cwd, PATH, a hash of the exported variables the command
+gets in its environment and the value of every ${NAME} in the text*/
+static int buildKey(const char *command, Buffer *key){
+    char cwd[PATH_MAX];
+    char env[24];
+    if(getcwd(cwd, sizeof(cwd)) == NULL){
+        return -1;
+    }
+    bufPuts(key, command);
+    bufPutc(key, 0);
+    bufPuts(key, cwd);
+    bufPutc(key, 0);
+    const char *path = getVar("PATH");
+    bufPuts(key, path ? path : "");
+    bufPutc(key, 0);
+    snprintf(env, sizeof(env), "%lx", envHash());
+    bufPuts(key, env);
+    for(const char *name = strstr(command, "${"); name != NULL; name = strstr(name, "${")){
+        name += 2;
+        const char *end = strchr(name, '}');
+        if(end == NULL){
+            break;
+        }
+        char var[256];
+        snprintf(var, sizeof(var), "%.*s", (int)(end - name), name);
+        const char *value = getVar(var);
+        bufPutc(key, 0);
+        bufPuts(key, value ? value : "");
+    }
+    return (key->data == NULL) ? -1 : 0;
+}
+
+static struct substEntry *findSlot(struct substEntry *table, size_t size, const char *key, size_t len, unsigned long hash){
+    size_t i = hash & (size - 1);
+    while(table[i].key != NULL){
+        if((table[i].hash == hash) && (table[i].keyLen == len) && (memcmp(table[i].key, key, len) == 0)){
+            break;
+        }
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+static void freeEntry(struct substEntry *entry){
+    free(entry->key);
+    free(entry->output);
+    for(int i = 0; i < entry->fileCount; i++){
+        free(entry->files[i].path);
+    }
+    memset(entry, 0, sizeof(struct substEntry));
+}
+
+static void clearCache(void){
+    for(size_t i = 0; i < tableSize; i++){
+        if(substTable[i].key != NULL){
+            freeEntry(&substTable[i]);
+        }
+    }
+    tableUsed = 0;
+}
+
+//double the table once it is 70% full, returns -1 if out of memory
+static int growTable(void){
+    size_t newSize = tableSize ? tableSize * 2 : SUBST_START;
+    struct substEntry *newTable = calloc(newSize, sizeof(struct substEntry));
+    if(newTable == NULL){
+        perror("cache");
+        return -1;
+    }
+    for(size_t i = 0; i < tableSize; i++){
+        struct substEntry *entry = &substTable[i];
+        if(entry->key != NULL){
+            *findSlot(newTable, newSize, entry->key, entry->keyLen, entry->hash) = *entry;
+        }
+    }
+    free(substTable);
+    substTable = newTable;
+    tableSize = newSize;
+    return 0;
+}
+
+//1 if every file the entry watches still has the same mtime and size
+static int filesUnchanged(const struct substEntry *entry){
+    struct stat stats;
+    for(int i = 0; i < entry->fileCount; i++){
+        const struct watchedFile *file = &entry->files[i];
+        if((stat(file->path, &stats) != 0) || (stats.st_size != file->size) ||
+           (stats.st_mtim.tv_sec != file->mtime.tv_sec) || (stats.st_mtim.tv_nsec != file->mtime.tv_nsec)){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//watch the words of command that name regular files, like config in cat config
+static void watchFiles(struct substEntry *entry, const char *command){
+    struct stat stats;
+    char word[PATH_MAX];
+    while((*command != 0) && (entry->fileCount < SUBST_MAX_FILES)){
+        command += strspn(command, " \t");
+        size_t len = strcspn(command, " \t");
+        if((len > 0) && (len < sizeof(word))){
+            memcpy(word, command, len);
+            word[len] = 0;
+            if((stat(word, &stats) == 0) && S_ISREG(stats.st_mode)){
+                struct watchedFile *file = &entry->files[entry->fileCount];
+                if((file->path = strdup(word)) != NULL){
+                    file->mtime = stats.st_mtim;
+                    file->size = stats.st_size;
+                    entry->fileCount += 1;
+                }
+            }
+        }
+        command += len;
+    }
+}
+
+/*append the cached output of command to out and set $? when there is a
+good entry for it. Returns the bytes added, or -1 to run it after all*/
+long substCacheGet(const char *command, Buffer *out){
+    if(!cacheable(command) || (tableSize == 0)){
+        return -1;
+    }
+    Buffer key;
+    bufInitArena(&key, &lineArena);
+    if(buildKey(command, &key) != 0){
+        return -1;
+    }
+    struct substEntry *entry = findSlot(substTable, tableSize, key.data, key.len, hashKey(key.data, key.len));
+    if(entry->key == NULL){
+        misses += 1;
+        return -1;
+    }
+    if((ttl > 0) && (seconds() - entry->stored > ttl)){
+        expired += 1;
+        misses += 1;
+        return -1;
+    }
+    if(!filesUnchanged(entry)){
+        changed += 1;
+        misses += 1;
+        return -1;
+    }
+    if(bufAppend(out, entry->output, entry->outputLen) != 0){
+        return -1;
+    }
+    hits += 1;
+    numberReplace = 0;
+    return entry->outputLen;
+}
+
+//remember output of command if it is cacheable and exited with status 0
+void substCachePut(const char *command, const char *output, size_t len, int status){
+    if((status != 0) || (len > SUBST_MAX_OUTPUT) || !cacheable(command)){
+        return;
+    }
+    if(tableUsed >= SUBST_MAX_ENTRIES){
+        clearCache();
+    }
+    if(((tableUsed + 1) * 10 >= tableSize * 7) && (growTable() != 0)){
+        return;
+    }
+    Buffer key;
+    bufInitArena(&key, &lineArena);
+    if(buildKey(command, &key) != 0){
+        return;
+    }
+    unsigned long hash = hashKey(key.data, key.len);
+    struct substEntry *entry = findSlot(substTable, tableSize, key.data, key.len, hash);
+    //allocate before dropping an old entry, an emptied slot would cut its probe chain
+    char *newKey = malloc(key.len);
+    char *newOutput = malloc(len + 1);
+    if((newKey == NULL) || (newOutput == NULL)){
+        perror("cache");
+        free(newKey);
+        free(newOutput);
+        return;
+    }
+    if(entry->key != NULL){
+        freeEntry(entry);
+        tableUsed -= 1;
+    }
+    entry->key = newKey;
+    entry->output = newOutput;
+    memcpy(entry->key, key.data, key.len);
+    memcpy(entry->output, output, len);
+    entry->keyLen = key.len;
+    entry->hash = hash;
+    entry->outputLen = len;
+    entry->stored = seconds();
+    watchFiles(entry, command);
+    tableUsed += 1;
+    stores += 1;
+}
+
+static int writeStats(int outfd){
+    size_t bytes = 0;
+    for(size_t i = 0; i < tableSize; i++){
+        bytes += substTable[i].outputLen;
+    }
+    char text[512];
+    int len = snprintf(text, sizeof(text),
+                       "mode\t%s\nttl\t%g\nentries\t%zu\nbytes\t%zu\nhits\t%ld\nmisses\t%ld\nstores\t%ld\nexpired\t%ld\nchanged\t%ld\n",
+                       (mode == SUBST_OFF) ? "off" : (mode == SUBST_ALL) ? "on" : "cmd",
+                       ttl, tableUsed, bytes, hits, misses, stores, expired, changed);
+    return writeAll(outfd, text, len);
+}
+
+/*cache on | off | cmd NAME... | ttl SECONDS | stats | clear. on caches
+every $( ), cmd only those running the commands named, a ttl of 0 never
+expires. Returns like execBuiltin*/
+int cacheBuiltin(char **args, int argc, int outfd){
+    if((argc == 2) && (strcmp(args[1], "on") == 0)){
+        mode = SUBST_ALL;
+        return 1;
+    }
+    if((argc == 2) && (strcmp(args[1], "off") == 0)){
+        mode = SUBST_OFF;
+        return 1;
+    }
+    if((argc > 2) && (strcmp(args[1], "cmd") == 0)){
+        char **grown = realloc(listed, sizeof(char *) * (listedCount + argc - 2));
+        if(grown == NULL){
+            perror("cache");
+            return 2;
+        }
+        listed = grown;
+        for(int i = 2; i < argc; i++){
+            if((listed[listedCount] = strdup(args[i])) != NULL){
+                listedCount += 1;
+            }
+        }
+        if(mode == SUBST_OFF){
+            mode = SUBST_LISTED;
+        }
+        return 1;
+    }
+    if((argc == 3) && (strcmp(args[1], "ttl") == 0)){
+        char *end;
+        double value = strtod(args[2], &end);
+        if((*end != 0) || (value < 0)){
+            fprintf(stderr, "cache: bad ttl %s\n", args[2]);
+            return 2;
+        }
+        ttl = value;
+        return 1;
+    }
+    if((argc == 2) && (strcmp(args[1], "stats") == 0)){
+        return (writeStats(outfd) == 0) ? 1 : 2;
+    }
+    if((argc == 2) && (strcmp(args[1], "clear") == 0)){
+        clearCache();
+        hits = misses = stores = expired = changed = 0;
+        return 1;
+    }
+    fprintf(stderr, "usage: cache on | off | cmd NAME... | ttl SECONDS | stats | clear\n");
+    return 2;
+}
@@ -0,0 +1,242 @@
+#!/bin/bash
+# Regression checks: each case runs a ush -c line and compares what it
+# prints, stdout and stderr together, with what it should.
+# Usage: tests/regress.sh [ush binary]
+
+USH=$(realpath "${1:-./ush}")
+WORK=$(mktemp -d /tmp/ush_regressXXXXXX)
+trap 'rm -rf "$WORK"' EXIT
+cd "$WORK" || exit 1
+failed=0
+
+check(){
+    local name=$1 line=$2 want=$3
+    local got
+    got=$("$USH" -c "$line" 2>&1)
+    if [ "$got" != "$want" ]; then
+        echo "FAIL $name"
+        echo "  line: $line"
+        echo "  want: $want"
+        echo "  got:  ${got:0:200}"
+        failed=1
+    fi
+}
+
+# builtins in $( ) release the line arena around their scratch space, the
+# word their output goes into must not be in the part they free
+check "builtin substitution output survives arena release" \
+    'echo A$(printf "%09000d" 0)B $(printf "%020000d" 1) end' \
+    "A$(printf "%09000d" 0)B $(printf "%020000d" 1) end"
+
+# a command found through a relative PATH entry is looked up again after cd
+mkdir -p bin && printf '#!/bin/sh\necho ran\n' > bin/rcmd && chmod +x bin/rcmd
+check "relative PATH hits are not cached" \
+    "envset PATH bin:/bin:/usr/bin
+rcmd
+cd /
+rcmd
+cd $WORK
+rcmd" \
+    "ran
+exec: rcmd: command not found
+ran"
+
+# printf formats, the format used again for leftover arguments, %b and \c
+check "printf conversions" \
+    'printf "%s|%5d|%-4s|%x|%o|%c|%03d|%%\n" str 42 ab 255 8 xyz 7' \
+    'str|   42|ab  |ff|10|x|007|%'
+check "printf reuses its format" \
+    'printf "%s-%s\n" a b c; printf "%d %d\n" 1' \
+    'a-b
+c-
+1 0'
+check "printf %b and \c" \
+    'printf "%b|\n" "a\tb\101"; printf "a\cb"; echo; printf "%b" "p\cq"; echo' \
+    "$(printf 'a\tbA|')
+a
+p"
+check "printf bad number" \
+    'printf "%d\n" 12abc; echo $?' \
+    'printf: 12abc: invalid number
+12
+1'
+
+# test and [, and the if, while, until and for blocks they drive
+check "test and [" \
+    'test 3 -lt 10; echo $?; [ abc = abd ]; echo $?; [ -n "" ]; echo $?; [ ! -z x ]; echo $?; test -d / -a -f /etc/passwd; echo $?; [ 1 -eq 1; echo $?' \
+    "0
+1
+1
+0
+0
+[: missing ']'
+1"
+check "if elif else" \
+    'if [ 1 = 2 ]; then echo a; elif [ 2 = 2 ]; then echo b; else echo c; fi' \
+    'b'
+check "while and until" \
+    'n=0; while [ ${n} -lt 3 ]; do echo w${n}; n=$(expr ${n} + 1); done; until [ ${n} = 1 ]; do echo u${n}; n=$(expr ${n} - 1); done' \
+    'w0
+w1
+w2
+u3
+u2'
+check "break and continue" \
+    'for x in 1 2 3 4 5; do if [ ${x} = 2 ]; then continue; fi; if [ ${x} = 4 ]; then break; fi; echo ${x}; done; for a in x y; do for b in 1 2; do if [ ${b} = 2 ]; then continue 2; fi; echo ${a}${b}; done; done' \
+    '1
+3
+x1
+y1'
+
+# loop bodies run from the words lexed when the loop was read
+check "loop bodies with redirects, pipes and substitutions" \
+    'for i in a b; do echo $(echo x${i}) | tr a-z A-Z >> acc; echo "${i}  q" > one; cat one; done; cat acc' \
+    'a  q
+b  q
+XA
+XB'
+
+# parallel items go into the expanded words as they are, builtins included
+printf 'a b\nc"d\n' > items
+check "parallel items with quotes are not lexed again" \
+    'parallel -k echo x{}y < items' \
+    'xa by
+xc"dy'
+check "parallel runs builtins" \
+    'parallel -k printf "%s-{}\n" 1 ::: p q' \
+    '1-p
+1-q'
+
+# redirections are done left to right, 2>&1 copies wherever 1 goes then
+check "redirection order" \
+    'ls /nonexistent > out 2>&1; echo [$(cat out | wc -l)]; ls /nonexistent 2>&1 > out | wc -l; echo [$(cat out | wc -l)]' \
+    '[1]
+1
+[0]'
+check "append and input redirection" \
+    'echo a > f; echo b >> f; cat < f; wc -l < f; cat /nonexistent 2> err; wc -l < err' \
+    'a
+b
+2
+1'
+
+# globs come out sorted, hidden files only for a leading dot, ** goes down
+mkdir -p globs/d/e && touch globs/b globs/a globs/c globs/.hid globs/d/x.c globs/d/e/y.c globs/d/.z.c
+check "glob sorting, hidden files and **" \
+    'cd globs; echo *; echo .*; echo [ab]* ?; echo d/*; echo **/*.c; echo nomatch*' \
+    'a b c d
+.hid
+a b a b c d
+d/e d/x.c
+d/e/y.c d/x.c
+nomatch*'
+
+# PIPESTATUS has the status of every stage of the last pipeline
+check "PIPESTATUS" \
+    'false | true | sh -c "exit 3"; echo ${PIPESTATUS} $?; true | false; echo ${PIPESTATUS}' \
+    '1 0 3 3
+0 1'
+
+# NAME=value stays in the shell until it is exported
+check "export and shell variables" \
+    'X=1; printenv X; echo $? [${X}]; export X; printenv X; X=2; printenv X; envunset X; printenv X; echo $? [${X}]; export Y=5; printenv Y' \
+    '1 [1]
+1
+2
+1 []
+5'
+check "export of a bad name" \
+    'export 1bad=3; echo $?' \
+    'export: 1bad=3: not a valid name
+1'
+
+# a cached command that moved is found again with redirections on it too,
+# and a missing input file is reported once
+mkdir -p pa pb && printf '#!/bin/sh\necho a\n' > pa/scmd && printf '#!/bin/sh\necho b\n' > pb/scmd
+chmod +x pa/scmd pb/scmd && echo in > input
+check "stale command path with a redirection" \
+    "envset PATH $WORK/pa:$WORK/pb:/bin:/usr/bin
+scmd < input
+rm pa/scmd
+scmd < input
+cat < missing; echo \$?" \
+    "a
+b
+missing: No such file or directory
+1"
+
+# redirections name any single digit fd, a copied fd has to be open
+check "redirection of an fd above 2" \
+    'echo hello 3>fd3; echo "[$(cat fd3)]"' \
+    'hello
+[]'
+check "copying an fd above 2" \
+    'echo one 3>fd3 1>&3; /bin/echo two 3>>fd3 >&3; cat fd3' \
+    'one
+two'
+check "copying an fd that isn't open" \
+    'echo x 2>&3; echo $?' \
+    '3: Bad file descriptor
+1'
+check ">& needs an fd" \
+    'echo x >&y; echo $?' \
+    'syntax error: >& needs an fd from 0 to 9
+1'
+
+# exported variables reach the shell's own environ, TZ for sstat's times
+touch -d '2020-01-10 12:00:00 UTC' stamped
+check "exported TZ is seen by sstat" \
+    'envset TZ EST5EDT; sstat stamped | cut -d" " -f7-; envset TZ UTC; sstat stamped | cut -d" " -f7-' \
+    'Fri Jan 10 07:00:00 2020
+Fri Jan 10 12:00:00 2020'
+
+# cached $( ) output is only used again with the same exported variables
+check "substitution cache keyed on the environment" \
+    'cache on; envset GREET hi; echo $(printenv GREET); envset GREET bye; echo $(printenv GREET); envset GREET hi; echo $(printenv GREET)' \
+    'hi
+bye
+hi'
+
+# scripts forget finished jobs between lines instead of keeping every one
+check "finished jobs leave the table of a script" \
+    "$(for i in 1 2 3 4 5 6 7 8 9 10; do echo '/bin/true &'; done)
+sleep 0.3
+jobs > table
+wc -l < table" \
+    '0'
+
+# a script cache with a bad offset or index is a miss, the script is parsed
+# again. 104 and 108 are the next and lexed fields of the first node
+mkdir -p cache && printf 'echo one | cat\necho two\n' > cached.ush
+USH_CACHE_DIR=$WORK/cache "$USH" cached.ush > /dev/null
+for offset in 104 108; do
+    printf '\377\377\377\177' | dd of="$(echo cache/*.ushc)" bs=1 seek=$offset conv=notrunc 2> /dev/null
+    got=$(USH_CACHE_DIR=$WORK/cache "$USH" cached.ush 2>&1)
+    if [ "$got" != "one
+two" ]; then
+        echo "FAIL script cache with a bad field at $offset"
+        echo "  got:  ${got:0:200}"
+        failed=1
+    fi
+done
+
+# a history index with offsets out of order is indexed again. The index is
+# written once 4096 lines are past it: 56 bytes of header, then 4101 entry
+# offsets, then 65537 bucket starts
+for i in $(seq 4100); do echo "line$i abc$((i % 97))"; done > hist
+USH_HISTFILE=$WORK/hist "$USH" -c 'history search abc42' > /dev/null
+cp hist.idx hist.good
+for field in "$((56 + 42 * 8)) 8" "$((56 + 4101 * 8)) $((65537 * 8))"; do
+    set -- $field
+    cp hist.good hist.idx
+    head -c "$2" /dev/zero | tr '\0' '\377' | dd of=hist.idx bs=1 seek="$1" conv=notrunc 2> /dev/null
+    got=$(USH_HISTFILE=$WORK/hist "$USH" -c 'history search abc42 | wc -l' 2>&1)
+    if [ "$got" != "42" ]; then
+        echo "FAIL history index with bad offsets at $1"
+        echo "  got:  ${got:0:200}"
+        failed=1
+    fi
+done
+
+[ $failed -eq 0 ] && echo "all regression checks passed"
+exit $failed
@@ -0,0 +1,415 @@
+/* Author: Calvin Kerns
+ * Execution tracing: while on, every command line, expansion, glob, $( ),
+ * fork, spawn, wait and builtin is recorded in a ring buffer with its
+ * times and rusage. The ring can be written out as Chrome/Perfetto trace
+ * JSON, folded stacks for flame graphs and a per-line summary. While off
+ * each hook is just a test of traceOn
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+
+//events kept, older ones are overwritten
+#define TRACE_RING 65536
+//deeper nesting than this isn't recorded
+#define TRACE_DEPTH 64
+#define TRACE_NAME 64
+
+struct traceEvent {
+    unsigned long seq;      //which event this slot holds now
+    long parent;            //seq of the enclosing event, -1 at the top
+    int kind;
+    int done;
+    double start;           //microseconds since the trace started
+    double end;
+    double childTime;       //time spent in events nested in this one
+    long userUs;            //rusage deltas of the shell
+    long sysUs;
+    long childUserUs;       //and of the children it waited for
+    long childSysUs;
+    long minorFaults;
+    unsigned long nameHash;  //of the whole name, which name may only be the start of
+    size_t nameLen;
+    char name[TRACE_NAME];
+};
+
+static const char *kindNames[] = {"line", "expand", "glob", "subst", "fork", "exec", "wait", "builtin"};
+
+int traceOn;
+static struct traceEvent *ring;
+static unsigned long nextSeq;
+static unsigned long firstSeq;     //first event of the current trace
+static long openEvents[TRACE_DEPTH];
+static int depth;
+static struct timespec epoch;
+static pid_t tracePid;
+static char *exitPath;
+
+static double sinceEpoch(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - epoch.tv_sec) * 1e6 + (now.tv_nsec - epoch.tv_nsec) / 1e3;
+}
+
+static long microseconds(struct timeval tv){
+    return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+//add sign times the current rusage to event
+static void addUsage(struct traceEvent *event, int sign){
+    struct rusage self;
+    struct rusage children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    event->userUs += sign * microseconds(self.ru_utime);
+    event->sysUs += sign * microseconds(self.ru_stime);
+    event->childUserUs += sign * microseconds(children.ru_utime);
+    event->childSysUs += sign * microseconds(children.ru_stime);
+    event->minorFaults += sign * self.ru_minflt;
+}
+
+//start recording, returns -1 if the ring couldn't be allocated
+int traceStart(void){
+    if(traceOn){
+        return 0;
+    }
+    if((ring == NULL) && ((ring = calloc(TRACE_RING, sizeof(struct traceEvent))) == NULL)){
+        perror("trace");
+        return -1;
+    }
+    //seqs keep counting so events still open from before can't be mistaken for new ones
+    firstSeq = nextSeq;
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    tracePid = getpid();
+    traceOn = 1;
+    return 0;
+}
+
+void traceStop(void){
+    traceOn = 0;
+}
+
+/*open an event of kind named after the first bytes of name. Returns its
+seq for traceEnd, or -1 when it isn't recorded. Use TRACE_BEGIN*/
+long traceBegin(int kind, const char *name){
+    if(depth == TRACE_DEPTH){
+        return -1;
+    }
+    unsigned long seq = nextSeq++;
+    struct traceEvent *event = &ring[seq % TRACE_RING];
+    memset(event, 0, sizeof(struct traceEvent));
+    event->seq = seq;
+    event->parent = (depth > 0) ? openEvents[depth - 1] : -1;
+    event->kind = kind;
+    if(name != NULL){
+        strncpy(event->name, name, TRACE_NAME - 1);
+        //lines are summed up by these, so long lines sharing a start stay apart
+        if(kind == TRACE_LINE){
+            event->nameHash = hashString(name);
+            event->nameLen = strlen(name);
+        }
+    }
+    openEvents[depth++] = seq;
+    addUsage(event, -1);
+    event->start = sinceEpoch();
+    return seq;
+}
+
+//close the event traceBegin returned seq for, and any left open inside it
+void traceEnd(long seq){
+    while((depth > 0) && (openEvents[depth - 1] >= seq)){
+        depth -= 1;
+    }
+    struct traceEvent *event = &ring[seq % TRACE_RING];
+    if(event->seq != (unsigned long)seq){
+        return;
+    }
+    event->end = sinceEpoch();
+    addUsage(event, 1);
+    event->done = 1;
+}
+
+//oldest event of the current trace still in the ring
+static unsigned long oldestSeq(void){
+    unsigned long oldest = (nextSeq > TRACE_RING) ? nextSeq - TRACE_RING : 0;
+    return (oldest > firstSeq) ? oldest : firstSeq;
+}
+
+//the event seq if it is still in the ring, else NULL
+static struct traceEvent *findEvent(long seq){
+    if((seq < 0) || ((unsigned long)seq < oldestSeq()) || ((unsigned long)seq >= nextSeq)){
+        return NULL;
+    }
+    struct traceEvent *event = &ring[seq % TRACE_RING];
+    return (event->seq == (unsigned long)seq) ? event : NULL;
+}
+
+//fill in childTime of every finished event
+static void sumChildren(void){
+    for(unsigned long seq = oldestSeq(); seq < nextSeq; seq++){
+        ring[seq % TRACE_RING].childTime = 0;
+    }
+    for(unsigned long seq = oldestSeq(); seq < nextSeq; seq++){
+        struct traceEvent *event = &ring[seq % TRACE_RING];
+        struct traceEvent *parent = findEvent(event->parent);
+        if(event->done && (parent != NULL)){
+            parent->childTime += event->end - event->start;
+        }
+    }
+}
+
+static void putJSONString(Buffer *out, const char *str){
+    bufPutc(out, '"');
+    for(; *str != 0; str++){
+        unsigned char c = *str;
+        if((c == '"') || (c == '\\')){
+            bufPutc(out, '\\');
+            bufPutc(out, c);
+        }
+        else if(c < 0x20){
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            bufPuts(out, escape);
+        }
+        else{
+            bufPutc(out, c);
+        }
+    }
+    bufPutc(out, '"');
+}
+
+//the trace as Chrome trace event JSON, complete events on one thread
+static int writeJSON(Buffer *out){
+    char number[256];
+    bufPuts(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    int first = 1;
+    for(unsigned long seq = oldestSeq(); seq < nextSeq; seq++){
+        struct traceEvent *event = &ring[seq % TRACE_RING];
+        if(!event->done){
+            continue;
+        }
+        bufPuts(out, first ? "{\"name\":" : ",\n{\"name\":");
+        first = 0;
+        putJSONString(out, event->name);
+        snprintf(number, sizeof(number),
+                 ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                 "\"args\":{\"user_us\":%ld,\"sys_us\":%ld,\"child_user_us\":%ld,\"child_sys_us\":%ld,\"minflt\":%ld}}",
+                 kindNames[event->kind], event->start, event->end - event->start, (int)tracePid, (int)tracePid,
+                 event->userUs, event->sysUs, event->childUserUs, event->childSysUs, event->minorFaults);
+        bufPuts(out, number);
+    }
+    bufPuts(out, "\n]}\n");
+    return 0;
+}
+
+//frame name for folded stacks, which can't have ; or newlines in it
+static void putFrame(Buffer *out, const struct traceEvent *event){
+    if(event->kind != TRACE_LINE){
+        bufPuts(out, kindNames[event->kind]);
+        bufPutc(out, ' ');
+    }
+    for(const char *c = event->name; *c != 0; c++){
+        bufPutc(out, ((*c == ';') || (*c == '\n')) ? ',' : *c);
+    }
+}
+
+//one "line;stage;stage self-microseconds" row per event, for flamegraph.pl and the like
+static int writeFolded(Buffer *out){
+    sumChildren();
+    for(unsigned long seq = oldestSeq(); seq < nextSeq; seq++){
+        struct traceEvent *event = &ring[seq % TRACE_RING];
+        long self = event->end - event->start - event->childTime;
+        if(!event->done || (self <= 0)){
+            continue;
+        }
+        const struct traceEvent *stack[TRACE_DEPTH];
+        int frames = 0;
+        for(const struct traceEvent *at = event; (at != NULL) && (frames < TRACE_DEPTH); at = findEvent(at->parent)){
+            stack[frames++] = at;
+        }
+        while(frames > 0){
+            putFrame(out, stack[--frames]);
+            bufPutc(out, (frames > 0) ? ';' : ' ');
+        }
+        char number[32];
+        snprintf(number, sizeof(number), "%ld\n", self);
+        bufPuts(out, number);
+    }
+    return 0;
+}
+
+struct lineTotal {
+    const struct traceEvent *line;     //the first run, for its name
+    long count;
+    double wall;
+    long user;
+    long sys;
+    long children;
+};
+
+//order lines by their whole text, as far as the hash and length tell it
+static int byLine(const void *a, const void *b){
+    const struct traceEvent *x = *(struct traceEvent *const *)a;
+    const struct traceEvent *y = *(struct traceEvent *const *)b;
+    if(x->nameHash != y->nameHash){
+        return (x->nameHash > y->nameHash) - (x->nameHash < y->nameHash);
+    }
+    if(x->nameLen != y->nameLen){
+        return (x->nameLen > y->nameLen) - (x->nameLen < y->nameLen);
+    }
+    return strcmp(x->name, y->name);
+}
+
+static int sameLine(const struct traceEvent *x, const struct traceEvent *y){
+    return byLine(&x, &y) == 0;
+}
+
+static int byWall(const void *a, const void *b){
+    double x = ((const struct lineTotal *)a)->wall;
+    double y = ((const struct lineTotal *)b)->wall;
+    return (x < y) - (x > y);
+}
+
+/*time spent in each top level line, summed over every time it ran and
+slowest first. Returns -1 if out of memory*/
+static int writeLines(Buffer *out){
+    size_t count = 0;
+    struct traceEvent **lines = malloc(sizeof(struct traceEvent *) * (nextSeq - oldestSeq() + 1));
+    struct lineTotal *totals = malloc(sizeof(struct lineTotal) * (nextSeq - oldestSeq() + 1));
+    if((lines == NULL) || (totals == NULL)){
+        perror("trace");
+        free(lines);
+        free(totals);
+        return -1;
+    }
+    for(unsigned long seq = oldestSeq(); seq < nextSeq; seq++){
+        struct traceEvent *event = &ring[seq % TRACE_RING];
+        if(event->done && (event->kind == TRACE_LINE) && (findEvent(event->parent) == NULL)){
+            lines[count++] = event;
+        }
+    }
+    qsort(lines, count, sizeof(struct traceEvent *), byLine);
+    size_t distinct = 0;
+    for(size_t i = 0; i < count; i++){
+        struct traceEvent *event = lines[i];
+        if((distinct == 0) || !sameLine(totals[distinct - 1].line, event)){
+            memset(&totals[distinct++], 0, sizeof(struct lineTotal));
+            totals[distinct - 1].line = event;
+        }
+        struct lineTotal *total = &totals[distinct - 1];
+        total->count += 1;
+        total->wall += event->end - event->start;
+        total->user += event->userUs;
+        total->sys += event->sysUs;
+        total->children += event->childUserUs + event->childSysUs;
+    }
+    qsort(totals, distinct, sizeof(struct lineTotal), byWall);
+
+    char row[128];
+    snprintf(row, sizeof(row), "%10s %8s %10s %10s %10s %10s  %s\n",
+             "total ms", "runs", "avg us", "user ms", "sys ms", "child ms", "line");
+    bufPuts(out, row);
+    for(size_t i = 0; i < distinct; i++){
+        struct lineTotal *total = &totals[i];
+        snprintf(row, sizeof(row), "%10.3f %8ld %10.1f %10.3f %10.3f %10.3f  ",
+                 total->wall / 1e3, total->count, total->wall / total->count,
+                 total->user / 1e3, total->sys / 1e3, total->children / 1e3);
+        bufPuts(out, row);
+        //only the start of a long line was kept
+        bufPuts(out, total->line->name);
+        bufPuts(out, (total->line->nameLen >= TRACE_NAME) ? "...\n" : "\n");
+    }
+    free(lines);
+    free(totals);
+    return 0;
+}
+
+static int writeFile(const char *path, const char *suffix, int (*write)(Buffer *out)){
+    Buffer name;
+    Buffer out;
+    bufInit(&name);
+    bufInit(&out);
+    bufPuts(&name, path);
+    bufPuts(&name, suffix);
+    if(write(&out) != 0){
+        bufFree(&name);
+        bufFree(&out);
+        return -1;
+    }
+    int fd = open(name.data, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    int res = (fd >= 0) ? writeAll(fd, out.data ? out.data : "", out.len) : -1;
+    if(res != 0){
+        perror(name.data);
+    }
+    if(fd >= 0){
+        close(fd);
+    }
+    bufFree(&name);
+    bufFree(&out);
+    return res;
+}
+
+/*write the trace to path as Chrome JSON, path.folded as folded stacks and
+path.lines as the per-line summary. Returns 0 or -1 after printing an error*/
+int traceWrite(const char *path){
+    if(ring == NULL){
+        fprintf(stderr, "trace: nothing recorded\n");
+        return -1;
+    }
+    int res = writeFile(path, "", writeJSON);
+    res |= writeFile(path, ".folded", writeFolded);
+    res |= writeFile(path, ".lines", writeLines);
+    return res;
+}
+
+static void writeAtExit(void){
+    //forked children exit through here too, only the shell that traced writes
+    if(getpid() == tracePid){
+        traceWrite(exitPath);
+    }
+}
+
+//trace the whole run and write it to path when the shell exits, for USH_TRACE
+void traceUntilExit(const char *path){
+    exitPath = strdup(path);
+    if((exitPath != NULL) && (traceStart() == 0)){
+        atexit(writeAtExit);
+    }
+}
+
+/*trace on, trace off, trace write FILE and trace lines, which prints the
+per-line summary. Returns like execBuiltin*/
+int traceBuiltin(char **args, int argc, int outfd){
+    if((argc == 2) && (strcmp(args[1], "on") == 0)){
+        return (traceStart() == 0) ? 1 : 2;
+    }
+    if((argc == 2) && (strcmp(args[1], "off") == 0)){
+        traceStop();
+        return 1;
+    }
+    if((argc == 3) && (strcmp(args[1], "write") == 0)){
+        return (traceWrite(args[2]) == 0) ? 1 : 2;
+    }
+    if((argc == 2) && (strcmp(args[1], "lines") == 0)){
+        if(ring == NULL){
+            fprintf(stderr, "trace: nothing recorded\n");
+            return 2;
+        }
+        Buffer out;
+        bufInit(&out);
+        int res = writeLines(&out);
+        if((res == 0) && (out.len > 0)){
+            res = writeAll(outfd, out.data, out.len);
+        }
+        bufFree(&out);
+        return (res == 0) ? 1 : 2;
+    }
+    fprintf(stderr, "usage: trace on | off | write FILE | lines\n");
+    return 2;
+}
@@ -19,17 +19,17 @@ int argctr;
 char **argvs;
 int numberReplace;
 int sigINT;
-FILE *strm;
 int alivechild;
 
 
-/* Constants */ 
-
-#define LINELEN 200000
-
 /* Prototypes */
 
 int processline (char *line, int inputFD, int outputFD, int flags);
+static pid_t runSimple(char *line, int inputFD, int outputFD, int flags, int substitutions);
+
+static Reader input;
+int interactive;
+static int editing;         //interactive input comes through the line editor
 
 void SIGhandler(int signal_num){ 
   if(alivechild){
@@ -40,38 +40,31 @@ void SIGhandler(int signal_num){
   (void)signal_num;
 }
 
-/*this looks for # to signify a comment, if found it replaces it with '\0' and
-returns 1 meaning comment was found, returns 0 otherwise*/
-int commentHandler(char buffer[], int length){
-  //iterate through and look for #, has special case for $#
-  int dollar = 0;
-  for(int i = 0; i<length; i++){
-    if(buffer[i] == '$'){//ar in a row, reset dollar count
-      if(dollar == 1){
-      //if it's the second doll
-        dollar = 0;
-      }
-      else{
-        dollar = 1;
-      }
-    }
-    else if((buffer[i] == '#') && (dollar == 0)){
-      buffer[i] = 0;
-      return 1;
-    }
-    else{
-      dollar = 0;
+/*prompt if needed and hand out the next line, with comments and the
+trailing newline removed. more asks for a continuation prompt. Returns NULL
+at the end of input*/
+char *readLine(int more){
+  //typed lines go into the history as they were, comments and all
+  if(editing){
+    char *line = editLine(more ? "> " : "% ");
+    if(line != NULL){
+      historyAdd(line);
+      stripComment(line);
     }
+    return line;
+  }
+  if(interactive){
+    /* prompt and get line */
+    fprintf (stderr, more ? "> " : "%% ");
   }
-  return 0;
+  return readerLine(&input);
 }
 
 /* Shell main */
 int
 main (int argc, char **argv)
 {
-    char   buffer [LINELEN];
-    int    len;
+    char  *line;
     argctr = argc;
     argvs = argv;
     shiftOffset = 0;
@@ -79,309 +72,320 @@ main (int argc, char **argv)
   //set sig handler
   signal(SIGINT, SIGhandler);
 
-//if we have more than 1 arg
-  if(argc != 1){
-    strm = fopen(*(argv+1), "r");
-    if(strm == NULL){
-      perror("Couldn't open file");
-      printf("Process exited with value 127\n");
-      exit(127);
-    }
-  }
-
-  while (1) {
-
-  sigINT = 0;//reset sigINT tracker
+  //the environment becomes the shell's exported variables
+  initVars();
 
-  //if we have only 1 arg (the ush program)
-  if(argc == 1){
-        /* prompt and get line */
-	  fprintf (stderr, "%% ");
-    strm = stdin;
+  //USH_SPAWN=fork goes back to plain fork and exec for every command
+  char *mode = getenv("USH_SPAWN");
+  if((mode != NULL) && (strcmp(mode, "fork") == 0)){
+    spawnMode = SPAWN_FORK;
   }
 
-  //check for error
-  if (fgets (buffer, LINELEN, strm) != buffer){
-	  break;
-    }
+  //background jobs are reaped through SIGCHLD
+  initJobs();
 
-        /* Get rid of \n at end of buffer. */
-	len = strlen(buffer);
-
-  //only remove \n if there was no comment found
-  int comment = commentHandler(buffer, len);
-  if(comment == 0){
-	  if (buffer[len-1] == '\n'){
-	    buffer[len-1] = 0;
-    }
+  //USH_TRACE=file traces the whole run into file, file.folded and file.lines
+  char *tracePath = getenv("USH_TRACE");
+  if((tracePath != NULL) && (*tracePath != 0)){
+    traceUntilExit(tracePath);
   }
 
-	
-	/* Run it ... */
-  
-	processline (buffer, 0, 1, WAIT|EXPAND);
+  //USH_STATS reports allocation counts and peak memory when the shell exits
+  if(getenv("USH_STATS") != NULL){
+    atexit(reportStats);
+  }
 
+  //-c runs the given string, the argument after it becomes $0
+  if((argc > 1) && (strcmp(argv[1], "-c") == 0)){
+    if(argc < 3){
+      fprintf(stderr, "usage: ush -c command [name [args ...]]\n");
+      exit(2);
     }
-
-    if (!feof(strm)){
-        perror ("read");
+    //same layout as running a script: argvs[1] is $0 and the rest follow
+    char **args = malloc(sizeof(char *) * (argc + 1));
+    if(args == NULL){
+      perror("malloc");
+      exit(1);
     }
-    return 0;		/* Also known as exit (0); */
-}
-
-
-
-/*goes through and removes parenthesis from line*/
-void removeParenthasis(char *line){
-  char *source = line;
-  char *dest = line;
-  while(*source != '"'){
-    source+=1;
-    dest+=1;
-    if(*source == 0){
-      return;
+    args[0] = argv[0];
+    args[1] = (argc > 3) ? argv[3] : argv[0];
+    argctr = 2;
+    for(int i = 4; i < argc; i++){
+      args[argctr++] = argv[i];
     }
+    args[argctr] = NULL;
+    argvs = args;
+    readerOpenString(&input, argv[2]);
   }
-  while(1){
-    if(*source == '"'){
-      source+=1;
+
+//if we have more than 1 arg
+  else if(argc != 1){
+    if(readerOpenFile(&input, argv[1]) != 0){
+      perror("Couldn't open file");
+      printf("Process exited with value 127\n");
+      exit(127);
     }
-    else if(*source == 0){
-      *dest = 0;
-      return;
+    //run the compiled tree when there is one, a script with errors still runs line by line
+    if(input.mapped){
+      Node *tree = loadScript(argv[1], readLine);
+      if(tree != NULL){
+        runScript(tree);
+        return 0;
+      }
+      if(readerRewind(&input) != 0){
+        perror("rewind");
+        exit(127);
+      }
     }
-    else{
-      *dest = *source;
-      dest+=1;
-      source+=1;
+  }
+
+  //if we have only 1 arg (the ush program)
+  else{
+    interactive = 1;
+    editing = canEdit();
+    //command names for tab completion are gathered in the background
+    if(editing){
+      startCommandTrie();
     }
+    readerOpenFd(&input, 0);
   }
-}
 
-/*Go through line and return an array of pointers to all the arguments in line*/
-char ** arg_parse (char *line, int *argcptr){
+  while (1) {
 
-  char *temp = line;
-  char *temp1 = line;
-  /*count args*/
-  int args = 0;
-  while(*temp != 0){
-    if(*temp == ' '){
-      temp += 1;
-    }
-    /*we are now in a arg*/
-    else{
-      args += 1;
-      while(1){
-	if((*temp == ' ') | (*temp == 0)){
+  sigINT = 0;//reset sigINT tracker
+  notifyJobs();
+
+  if ((line = readLine(0)) == NULL){
 	  break;
-	}
-	/*we are in parenth argument*/
-	if(*temp == '"'){
-	  temp += 1;
-	  while(*temp != '"'){
-	    if(*temp == 0){
-	      fprintf(stderr, "No second quotes\n");
-	      return NULL;
-	    }
-	    temp += 1;
-	  }
-	  temp += 1;
-	}
-	else{
-	  temp += 1;
-	}
-      }
     }
-  }
 
-  /*go through and add char pointers to malloced area*/
-  char **mpointer;
-  mpointer = malloc(sizeof(char *)*(args+1));
-  int index = 0;
-  while(*temp1 != 0){
-    if(*temp1 == ' '){
-      temp1 += 1;
-    }
-    /*we are now in a arg*/
-    else{
-      mpointer[index] = temp1;
-      index += 1;
-      while(1){
-	if(*temp1 == ' '){
-	  *temp1 = 0;
-	  temp1 += 1;
-	  break;
-	}
-	else if(*temp1 == 0){
-	  break;
-	    }
-	/*we are in parenth argument*/
-	else if(*temp1 == '"'){
-	  temp1 += 1;
-	  while(*temp1 != '"'){
-	    temp1 += 1;
-	  }
-	  temp1 += 1;
-	}
-	else{
-	  temp1 += 1;
-	}
-      }
+	/* Run it, blocks read the rest of their lines themselves */
+	runLine (line, readLine);
+	arenaReset(&lineArena);
+
     }
-  }
-  
-  *argcptr = args;
-  char *nptr = NULL;
-  mpointer[index] = nptr;
-  /*go through each element in malloc and take away parenthasis*/
-  for(int i = 0; i < args; i++){
-    removeParenthasis(mpointer[i]);
-  }
-  return mpointer;
+
+    readerClose(&input);
+    return 0;		/* Also known as exit (0); */
 }
 
-//return pid of child if it wasn't waited on, else return 0;
-int processline (char *line, int inputFD, int outputFD, int flags)
+/*run a command already split into args with its redirections, the rest of
+runSimple: a builtin in place or anything else in a child of its own, with
+the substitution fds from substitutions on. Returns the pid of the child if
+it wasn't waited on, else 0*/
+static pid_t runArgs(char **mal, int argcptr, Redirects *redirs, int inputFD, int outputFD, int flags,
+                     int substitutions)
 {
     pid_t  cpid;
-    int    status;
-    int argcptr;
-    char **mal;
+    int    status = 0;
     int builtreturn;
 
-    char new[LINELEN]; 
-    if(flags & EXPAND){
-      int expanded = expand(line, new, LINELEN);
-      if(expanded == 0){
-        return 0;
-      }  
-    }
-    else{
-      strncpy(new, line, LINELEN);
-    }
-
-    if(sigINT){
+    //a copied fd has to be one the command may have
+    if(checkRedirects(redirs) != 0){
+      numberReplace = 1;
       return 0;
     }
-
-    char *newer = new;
-
-    char *pipePTR;
-    int input = inputFD;
-    int output;
-    char *commandline = new;
-    if((pipePTR=strchr(new, '|')) != NULL){
-      while(pipePTR != NULL){
-        *pipePTR = 0; 
-        int fd[2];
-        if(pipe(fd) != 0){
-          perror("pipe failed");
-          return 0;
-        }
-        output = fd[1];
-        processline(commandline, input, output, NOWAIT);
-        if(input != 0){
-          close(input);
-        }
-        close(output);
-        input = fd[0];
-
-        //move pointer to right side of pipe
-        *pipePTR = '|';
-        pipePTR += 1;
-        commandline = pipePTR;
-        pipePTR=strchr(commandline, '|');
-      }
-      processline(commandline, input, outputFD, WAIT);
-      close(input);
-      //clean up zombies
-      while(wait(&status) > 0){
-        ;
-      }
+    //a line of only NAME=value words sets shell variables
+    if((argcptr > 0) && (redirs->count == 0) && (strchr(mal[0], '=') != NULL) && assignVars(mal, argcptr)){
+      numberReplace = 0;
       return 0;
     }
-
-    mal = arg_parse(newer, &argcptr);
+    //SUBSHELL builtins get a process of their own like any other command
+    int builtin = (mal != NULL) && (argcptr > 0) && isBuiltin(mal[0]);
+    int forked = (flags & SUBSHELL) && builtin;
     //if arg[0] was a builtin func, execute and return, if not continue
-    builtreturn = execBuiltin(mal, argcptr, outputFD);
+    builtreturn = 0;
+    if((builtin && !forked) || ((mal != NULL) && (argcptr == 0) && (redirs->count > 0))){
+      //the redirection files are opened here and handed over as fds, no fork
+      int builtinIn = inputFD;
+      int builtinOut = outputFD;
+      if(openRedirects(redirs, &builtinIn, &builtinOut) != 0){
+        numberReplace = 1;
+        return 0;
+      }
+      //a line of only redirections just creates or checks its files
+      builtreturn = builtin ? execBuiltin(mal, argcptr, builtinIn, builtinOut) : 1;
+      closeRedirects(redirs);
+    }
     if((builtreturn == 1) || (builtreturn == 2)){
       //if builtin returned with error, update global var
       numberReplace = 0;
       if(builtreturn == 2){
         numberReplace = 1;
       }
-      free(mal);
+      return 0;
+    }
+    else if(builtreturn == 3){
+      //the builtin set $? itself
       return 0;
     }
 
     /*if there are no args, return*/
     if(argcptr == 0){
-      free(mal);
       return 0;
     }/*if there is no second parenth*/
     else if(mal == NULL){
-       free(mal);
-      return 0;
+       return 0;
     }
     
+    //resolve the command in the parent so the PATH walk is cached
+    char *path = forked ? NULL : lookupCommand(mal[0]);
+    if(!forked && (path == NULL)){
+      fprintf(stderr, "exec: %s: command not found\n", mal[0]);
+      numberReplace = 127;
+      return 0;
+    }
+
     /* Start a new process to do the job. */
-    cpid = fork();
+    shareSubstitutions(substitutions);
+    pid_t pgroup = (flags & BACKGROUND) ? jobGroup() : -1;
+    if(forked){
+      cpid = forkBuiltin(mal, argcptr, inputFD, outputFD, redirs, pgroup);
+    }
+    else{
+      cpid = launchCommand(path, mal, inputFD, outputFD, redirs, pgroup);
+    }
     if (cpid < 0) {
-      /* Fork wasn't successful */
-      perror ("fork");
-       free(mal);
+      /* Spawn wasn't successful */
+      numberReplace = 127;
       return 0;
     }
-    
-    /* Check for who we are! */
-    if (cpid == 0) {
-      /* We are the child! */
-      //change input if needed
-      if(inputFD != 0){
-        dup2(inputFD, 0);
-      }
-      //change fd if needed 
-      if(outputFD != 1){
-        dup2(outputFD, 1);
-      }
-      execvp (mal[0], mal);
-      free(mal);
-      /* execlp reurned, wasn't successful */
-      perror ("exec");
-      fclose(strm);  // avoid a linux stdio bug
-      _exit (127);
+
+    //jobs are waited for through the job table, ^C isn't passed on to them
+    if(flags & BACKGROUND){
+      addJobProcess(cpid);
+      return cpid;
     }
 
     //check if we need to wait
     alivechild = cpid;
     if(flags & WAIT){
-      /* Have the parent wait for child to complete */
-      if (wait (&status) < 0) {
-        /* Wait wasn't successful */
-        perror ("wait");{
+      /* Have the parent wait for this child, not whichever finishes first */
+      long trace = TRACE_BEGIN(TRACE_WAIT, mal[0]);
+      while (waitpid (cpid, &status, 0) < 0) {
+        if (errno != EINTR) {
+          /* Wait wasn't successful */
+          perror ("wait");
+          break;
         }
       }
+      TRACE_END(trace);
       alivechild = 0;
       //update numberReplace var accordingly 
-      if(WIFEXITED(status)){
-        numberReplace = WEXITSTATUS(status);
+      reportSignal(status);
+      numberReplace = exitStatus(status);
+      return 0;
+    }
+    return cpid;
+}
+
+//return pid of child if it wasn't waited on, else return 0;
+int processline (char *line, int inputFD, int outputFD, int flags)
+{
+    checkJobs();
+    long trace = TRACE_BEGIN(TRACE_LINE, line);
+
+    //each unquoted & ends a job that carries on in the background
+    if(!(flags & BACKGROUND) && (jobGroup() < 0)){
+      char *amp;
+      while(*(amp = segmentEnd(line, '&')) == '&'){
+        *amp = 0;
+        startJob(line, inputFD, outputFD, flags);
+        *amp = '&';
+        line = amp + 1;
       }
-      else if(WIFSIGNALED(status)){
-        int SIG = WTERMSIG(status);
-        if(SIG != SIGINT){
-          dprintf(1, "%s", strsignal(SIG));
-          if(WCOREDUMP(status)){ 
-            dprintf(1, " (core dumped)"); 
-          }
-          dprintf(1, "\n");
-        }
-        numberReplace = 128 + SIG;
+      if(line[strspn(line, " \t")] == 0){
+        TRACE_END(trace);
+        return 0;
       }
-      free(mal);
+    }
+
+    pid_t cpid;
+    //pipelines are split before expansion so a | in quotes or $( ) stays put
+    if(*segmentEnd(line, '|') == '|'){
+      cpid = runPipeline(line, inputFD, outputFD, flags);
+    }
+    else{
+      //<( ) and >( ) made while expanding the command are closed once it has started
+      int substitutions = substitutionMark();
+      cpid = runSimple(line, inputFD, outputFD, flags, substitutions);
+      endSubstitutions(substitutions, cpid <= 0);
+    }
+    TRACE_END(trace);
+    return cpid;
+}
+
+/*expand and run a command with no | or & left in it, the rest of
+processline. Substitution fds from substitutions on are passed to it*/
+static pid_t runSimple(char *line, int inputFD, int outputFD, int flags, int substitutions)
+{
+    pid_t  cpid;
+    int argcptr = 0;
+    char **mal;
+
+    //everything this command allocates comes off the arena and is released on return
+    ArenaMark mark = arenaMark(&lineArena);
+
+    //redirections come out before expansion, their file names are expanded on their own
+    Redirects redirs;
+    redirs.count = 0;
+    if(*lexNext(line, LEX_REDIRECT) != 0){
+      line = takeRedirects(line, &redirs, flags & EXPAND);
+      if(line == NULL){
+        numberReplace = 1;
+        arenaRelease(&lineArena, mark);
+        return 0;
+      }
+    }
+
+    //the words come out of expansion as args, with their quotes already gone
+    mal = expandArgs(line, &argcptr, flags & EXPAND);
+    if((mal == NULL) || sigINT){
+      arenaRelease(&lineArena, mark);
       return 0;
     }
-    free(mal);
+
+    cpid = runArgs(mal, argcptr, &redirs, inputFD, outputFD, flags, substitutions);
+    arenaRelease(&lineArena, mark);
+    return cpid;
+}
+
+/*run words, a line lexed by lexCommand, the way processline runs the line
+it came from, stage by stage without going back to its text. text is the
+line, for the trace*/
+int processWords(Words *words, const char *text, int inputFD, int outputFD, int flags)
+{
+    if(words->stages == 1){
+      return processStage(words, 0, inputFD, outputFD, flags);
+    }
+    checkJobs();
+    long trace = TRACE_BEGIN(TRACE_LINE, text);
+    pid_t cpid = runPipelineWords(words, inputFD, outputFD, flags);
+    TRACE_END(trace);
     return cpid;
 }
 
+//run one stage of words, the way processline runs a line with no | in it
+pid_t processStage(Words *words, int stage, int inputFD, int outputFD, int flags)
+{
+    checkJobs();
+    long trace = TRACE_BEGIN(TRACE_LINE, stageText(words, stage));
+    int substitutions = substitutionMark();
+    ArenaMark mark = arenaMark(&lineArena);
+    Redirects redirs;
+    int argcptr = 0;
+    pid_t cpid = 0;
+    if(expandRedirects(words, stage, &redirs) != 0){
+      numberReplace = 1;
+    }
+    else{
+      char **mal = expandLexed(words, stage, &argcptr);
+      if((mal != NULL) && !sigINT){
+        cpid = runArgs(mal, argcptr, &redirs, inputFD, outputFD, flags, substitutions);
+      }
+    }
+    arenaRelease(&lineArena, mark);
+    endSubstitutions(substitutions, cpid <= 0);
+    TRACE_END(trace);
+    return cpid;
+}
@@ -0,0 +1,288 @@
+/* Author: Calvin Kerns
+ * Shell variables: an open addressing table of local and exported
+ * variables, filled from the environment at startup. The envp handed to
+ * exec is only rebuilt when an exported variable changed since the last one,
+ * and environ is kept pointing at it so getenv in the shell agrees
+*/
+
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#define VARS_START 256
+
+extern char **environ;
+
+/*one variable, kept as "NAME=value" so the envp is just these pointers.
+entry is NULL for an empty slot*/
+struct var {
+    char *entry;
+    size_t nameLen;
+    unsigned long hash;
+    int exported;
+};
+
+static struct var *varTable;
+static size_t tableSize;
+static size_t tableUsed;
+
+//bumped whenever an exported variable changes, envp is good for builtVersion
+static unsigned long envVersion = 1;
+static unsigned long builtVersion;
+static char **envp;
+static size_t envCap;
+static int varsReady;       //initVars is done, environ is ours from then on
+static unsigned long hashedVersion;
+static unsigned long envDigest;
+
+//FNV-1a like hashString, over the first len bytes
+static unsigned long hashName(const char *name, size_t len){
+    unsigned long hash = 14695981039346656037UL;
+    for(size_t i = 0; i < len; i++){
+        hash ^= (unsigned char)name[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+//find slot for name, either the matching entry or the empty slot it belongs in
+static struct var *findSlot(struct var *table, size_t size, const char *name, size_t len, unsigned long hash){
+    size_t i = hash & (size - 1);
+    while(table[i].entry != NULL){
+        if((table[i].hash == hash) && (table[i].nameLen == len) && (memcmp(table[i].entry, name, len) == 0)){
+            break;
+        }
+        i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+//double the table once it is 70% full, returns -1 if out of memory
+static int growTable(void){
+    size_t newSize = tableSize ? tableSize * 2 : VARS_START;
+    struct var *newTable = calloc(newSize, sizeof(struct var));
+    if(newTable == NULL){
+        perror("variables");
+        return -1;
+    }
+    for(size_t i = 0; i < tableSize; i++){
+        struct var *var = &varTable[i];
+        if(var->entry != NULL){
+            *findSlot(newTable, newSize, var->entry, var->nameLen, var->hash) = *var;
+        }
+    }
+    free(varTable);
+    varTable = newTable;
+    tableSize = newSize;
+    return 0;
+}
+
+static struct var *lookup(const char *name, size_t len){
+    if(tableSize == 0){
+        return NULL;
+    }
+    struct var *var = findSlot(varTable, tableSize, name, len, hashName(name, len));
+    return (var->entry != NULL) ? var : NULL;
+}
+
+//1 if name can be a variable: letters, digits and _, not starting with a digit
+int validVarName(const char *name, size_t len){
+    if((len == 0) || isdigit((unsigned char)name[0])){
+        return 0;
+    }
+    for(size_t i = 0; i < len; i++){
+        if(!isalnum((unsigned char)name[i]) && (name[i] != '_')){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*an exported variable changed: point environ at the new envp right away.
+The entry it replaced is freed already, and getenv in the shell, like
+tzset for sstat's times or the cache directories, has to see what commands
+get*/
+static void exportChanged(void){
+    envVersion += 1;
+    if(varsReady){
+        environ = varEnviron();
+    }
+}
+
+//store name=value, len is the length of name in it
+static int store(const char *name, size_t len, const char *value, int flags){
+    if((tableUsed + 1) * 10 >= tableSize * 7){
+        if(growTable() != 0){
+            return -1;
+        }
+    }
+    size_t valueLen = strlen(value);
+    char *entry = malloc(len + valueLen + 2);
+    if(entry == NULL){
+        perror("variables");
+        return -1;
+    }
+    memcpy(entry, name, len);
+    entry[len] = '=';
+    memcpy(entry + len + 1, value, valueLen + 1);
+
+    unsigned long hash = hashName(name, len);
+    struct var *var = findSlot(varTable, tableSize, name, len, hash);
+    if(var->entry == NULL){
+        var->nameLen = len;
+        var->hash = hash;
+        var->exported = 0;
+        tableUsed += 1;
+    }
+    free(var->entry);
+    var->entry = entry;
+    var->exported |= (flags & VAR_EXPORT) != 0;
+    if(var->exported){
+        exportChanged();
+    }
+    //cached command paths and completions are only good for the PATH they came from
+    if((len == 4) && (memcmp(name, "PATH", 4) == 0)){
+        clearCommandCache();
+        rebuildCommandTrie();
+    }
+    return 0;
+}
+
+//value of name, or NULL if it isn't set
+char *getVar(const char *name){
+    struct var *var = lookup(name, strlen(name));
+    return (var != NULL) ? var->entry + var->nameLen + 1 : NULL;
+}
+
+/*set name to value, keeping it exported if it was. VAR_EXPORT exports it.
+Returns 0, or -1 with errno set for a bad name or no memory*/
+int setVar(const char *name, const char *value, int flags){
+    size_t len = strlen(name);
+    if(!validVarName(name, len)){
+        errno = EINVAL;
+        return -1;
+    }
+    return store(name, len, value, flags);
+}
+
+//export name, which is created empty if it isn't set
+int exportVar(const char *name){
+    struct var *var = lookup(name, strlen(name));
+    if(var == NULL){
+        return setVar(name, "", VAR_EXPORT);
+    }
+    if(!var->exported){
+        var->exported = 1;
+        exportChanged();
+    }
+    return 0;
+}
+
+void unsetVar(const char *name){
+    size_t len = strlen(name);
+    struct var *var = lookup(name, len);
+    if(var == NULL){
+        return;
+    }
+    int exported = var->exported;
+    free(var->entry);
+    var->entry = NULL;
+    tableUsed -= 1;
+    //move later entries of the same run back so lookups don't stop at the gap
+    size_t gap = var - varTable;
+    for(size_t i = (gap + 1) & (tableSize - 1); varTable[i].entry != NULL; i = (i + 1) & (tableSize - 1)){
+        size_t home = varTable[i].hash & (tableSize - 1);
+        if(((i - home) & (tableSize - 1)) >= ((i - gap) & (tableSize - 1))){
+            varTable[gap] = varTable[i];
+            varTable[i].entry = NULL;
+            gap = i;
+        }
+    }
+    if(exported){
+        exportChanged();
+    }
+    if((len == 4) && (memcmp(name, "PATH", 4) == 0)){
+        clearCommandCache();
+        rebuildCommandTrie();
+    }
+}
+
+/*NAME=value words set local variables. If every arg is one they are all
+set and 1 is returned, otherwise nothing is set and it returns 0*/
+int assignVars(char **args, int argc){
+    for(int i = 0; i < argc; i++){
+        char *equals = strchr(args[i], '=');
+        if((equals == NULL) || !validVarName(args[i], equals - args[i])){
+            return 0;
+        }
+    }
+    for(int i = 0; i < argc; i++){
+        char *equals = strchr(args[i], '=');
+        if(store(args[i], equals - args[i], equals + 1, 0) != 0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+//take in the environment the shell was started with, all of it exported
+void initVars(void){
+    for(char **env = environ; *env != NULL; env++){
+        char *equals = strchr(*env, '=');
+        if((equals != NULL) && (equals != *env)){
+            store(*env, equals - *env, equals + 1, VAR_EXPORT);
+        }
+    }
+    varsReady = 1;
+    environ = varEnviron();
+}
+
+/*environment for exec, the exported variables. It stays good until an
+exported variable changes, so a run of commands shares one*/
+char **varEnviron(void){
+    if((builtVersion == envVersion) && (envp != NULL)){
+        return envp;
+    }
+    size_t count = 0;
+    for(size_t i = 0; i < tableSize; i++){
+        count += (varTable[i].entry != NULL) && varTable[i].exported;
+    }
+    if(count + 1 > envCap){
+        char **grown = realloc(envp, sizeof(char *) * (count + 1));
+        if(grown == NULL){
+            perror("environment");
+            return environ;
+        }
+        envp = grown;
+        envCap = count + 1;
+    }
+    count = 0;
+    for(size_t i = 0; i < tableSize; i++){
+        if((varTable[i].entry != NULL) && varTable[i].exported){
+            envp[count++] = varTable[i].entry;
+        }
+    }
+    envp[count] = NULL;
+    builtVersion = envVersion;
+    statEnvBuilds += 1;
+    return envp;
+}
+
+/*hash of the exported variables, names and values, the same whatever order
+they sit in the table. Only worked out again after one of them changed*/
+unsigned long envHash(void){
+    if(hashedVersion == envVersion){
+        return envDigest;
+    }
+    envDigest = 0;
+    for(size_t i = 0; i < tableSize; i++){
+        if((varTable[i].entry != NULL) && varTable[i].exported){
+            envDigest += hashString(varTable[i].entry);
+        }
+    }
+    hashedVersion = envVersion;
+    return envDigest;
+}
@@ -0,0 +1,321 @@
+/* Author: Calvin Kerns
+ * Parallel directory tree walker used for ** globs
+*/
+
+#define _GNU_SOURCE
+#include "defn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define WALK_MAX_THREADS 16
+#define DENTS_SIZE 65536
+#define BLOCK_SIZE (1 << 20)
+
+//what getdents64 hands back, glibc doesn't export this struct
+struct linuxDirent {
+    unsigned long d_ino;
+    long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+//one path found by a worker
+struct walkEntry {
+    char *path;
+    int isDir;
+};
+
+//per thread results, paths live in big blocks so there is one malloc per MB
+struct walkLocal {
+    struct walkEntry *entries;
+    size_t count;
+    size_t cap;
+    char **blocks;
+    size_t blockCount;
+    size_t blockUsed;   //bytes used in the newest block
+    char *dirents;
+};
+
+//work queue of directories still to be read, shared by every worker
+struct walkQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    char **dirs;
+    size_t count;
+    size_t cap;
+    int busy;           //workers reading a directory right now
+    int failed;
+};
+
+struct walkWorker {
+    pthread_t thread;
+    struct walkQueue *queue;
+    struct walkLocal local;
+    int (*keep)(const char *path, int isDir, void *arg);
+    void *arg;
+};
+
+//copy len bytes of path into the worker's block storage
+static char *storePath(struct walkLocal *local, const char *path, size_t len){
+    if((local->blockCount == 0) || (local->blockUsed + len + 1 > BLOCK_SIZE)){
+        size_t size = (len + 1 > BLOCK_SIZE) ? len + 1 : BLOCK_SIZE;
+        char **grown = realloc(local->blocks, sizeof(char *) * (local->blockCount + 1));
+        if(grown == NULL){
+            return NULL;
+        }
+        local->blocks = grown;
+        if((local->blocks[local->blockCount] = malloc(size)) == NULL){
+            return NULL;
+        }
+        local->blockCount += 1;
+        local->blockUsed = 0;
+    }
+    char *copy = local->blocks[local->blockCount - 1] + local->blockUsed;
+    memcpy(copy, path, len);
+    copy[len] = 0;
+    local->blockUsed += len + 1;
+    return copy;
+}
+
+static int addEntry(struct walkLocal *local, char *path, int isDir){
+    if(local->count == local->cap){
+        size_t newCap = local->cap ? local->cap * 2 : 1024;
+        struct walkEntry *grown = realloc(local->entries, newCap * sizeof(struct walkEntry));
+        if(grown == NULL){
+            return -1;
+        }
+        local->entries = grown;
+        local->cap = newCap;
+    }
+    local->entries[local->count].path = path;
+    local->entries[local->count].isDir = isDir;
+    local->count += 1;
+    return 0;
+}
+
+//put a directory on the queue and wake a waiting worker
+static int pushDir(struct walkQueue *queue, char *dir){
+    pthread_mutex_lock(&queue->lock);
+    if(queue->count == queue->cap){
+        size_t newCap = queue->cap ? queue->cap * 2 : 256;
+        char **grown = realloc(queue->dirs, newCap * sizeof(char *));
+        if(grown == NULL){
+            queue->failed = 1;
+            pthread_mutex_unlock(&queue->lock);
+            return -1;
+        }
+        queue->dirs = grown;
+        queue->cap = newCap;
+    }
+    queue->dirs[queue->count++] = dir;
+    pthread_cond_signal(&queue->more);
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/*read one directory with getdents64, recording every entry that isn't
+hidden and queueing the subdirectories. Symlinks to directories are listed
+but not followed, so loops can't happen*/
+static void readDir(struct walkWorker *worker, const char *dir){
+    struct walkLocal *local = &worker->local;
+    int fd = open(*dir ? dir : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(fd < 0){
+        return;
+    }
+    size_t dirLen = strlen(dir);
+    Buffer path;
+    bufInit(&path);
+    bufAppend(&path, dir, dirLen);
+    if((dirLen > 0) && (dir[dirLen - 1] != '/')){
+        bufPutc(&path, '/');
+    }
+    size_t baseLen = path.len;
+
+    long got;
+    while((got = syscall(SYS_getdents64, fd, local->dirents, DENTS_SIZE)) > 0){
+        for(long off = 0; off < got; ){
+            struct linuxDirent *entry = (struct linuxDirent *)(local->dirents + off);
+            off += entry->d_reclen;
+            //the same hidden file rule * has always used, also skips . and ..
+            if(entry->d_name[0] == '.'){
+                continue;
+            }
+            int isDir = (entry->d_type == DT_DIR);
+            if(entry->d_type == DT_UNKNOWN){
+                struct stat stats;
+                isDir = (fstatat(fd, entry->d_name, &stats, AT_SYMLINK_NOFOLLOW) == 0) &&
+                        S_ISDIR(stats.st_mode);
+            }
+            bufTruncate(&path, baseLen);
+            bufPuts(&path, entry->d_name);
+            //keep runs here in the worker so only matches get sorted later
+            int kept = (worker->keep == NULL) || worker->keep(path.data, isDir, worker->arg);
+            if(!kept && !isDir){
+                continue;
+            }
+            char *stored = storePath(local, path.data, path.len);
+            if((stored == NULL) || (kept && (addEntry(local, stored, isDir) != 0))){
+                worker->queue->failed = 1;
+                break;
+            }
+            if(isDir){
+                pushDir(worker->queue, stored);
+            }
+        }
+        if(sigINT == 1){
+            worker->queue->failed = 1;
+            break;
+        }
+    }
+    close(fd);
+    bufFree(&path);
+}
+
+static int cmpEntries(const void *a, const void *b){
+    return strcmp(((const struct walkEntry *)a)->path, ((const struct walkEntry *)b)->path);
+}
+
+//take directories off the queue until every worker is idle and it is empty
+static void *walkWorker(void *arg){
+    struct walkWorker *worker = arg;
+    struct walkQueue *queue = worker->queue;
+    pthread_mutex_lock(&queue->lock);
+    while(1){
+        while((queue->count == 0) && (queue->busy > 0) && !queue->failed){
+            pthread_cond_wait(&queue->more, &queue->lock);
+        }
+        if((queue->count == 0) || queue->failed){
+            break;
+        }
+        char *dir = queue->dirs[--queue->count];
+        queue->busy += 1;
+        pthread_mutex_unlock(&queue->lock);
+
+        readDir(worker, dir);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->busy -= 1;
+    }
+    //wake everyone else so they can notice the walk is over
+    pthread_cond_broadcast(&queue->more);
+    pthread_mutex_unlock(&queue->lock);
+
+    //sort this worker's share while the others are still going
+    qsort(worker->local.entries, worker->local.count, sizeof(struct walkEntry), cmpEntries);
+    return NULL;
+}
+
+static void freeLocal(struct walkLocal *local){
+    for(size_t i = 0; i < local->blockCount; i++){
+        free(local->blocks[i]);
+    }
+    free(local->blocks);
+    free(local->entries);
+    free(local->dirents);
+}
+
+static int walkThreads(void){
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus < 1){
+        cpus = 1;
+    }
+    return (cpus > WALK_MAX_THREADS) ? WALK_MAX_THREADS : cpus;
+}
+
+/*walk every path under base (base itself not included) with a pool of
+threads, one per cpu up to WALK_MAX_THREADS. Hidden names are skipped and
+not descended into. keep (when not NULL) is called from the worker threads
+and must only look at its arguments. Every path it keeps is handed to
+callback along with whether it is a directory, in strcmp order: each worker
+sorts its own results and they are merged here. Returns the number of paths
+handed to callback or -1 on error*/
+long walkTree(const char *base, int (*keep)(const char *path, int isDir, void *arg),
+              void (*callback)(const char *path, int isDir, void *arg), void *arg){
+    int threads = walkThreads();
+    struct walkQueue queue;
+    struct walkWorker *workers = calloc(threads, sizeof(struct walkWorker));
+    if(workers == NULL){
+        return -1;
+    }
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.more, NULL);
+    char *root = strdup(base);
+    pushDir(&queue, root);
+
+    int started = 0;
+    for(int i = 0; i < threads; i++){
+        workers[i].queue = &queue;
+        workers[i].keep = keep;
+        workers[i].arg = arg;
+        workers[i].local.dirents = malloc(DENTS_SIZE);
+        if(workers[i].local.dirents == NULL){
+            break;
+        }
+        if(pthread_create(&workers[i].thread, NULL, walkWorker, &workers[i]) != 0){
+            free(workers[i].local.dirents);
+            workers[i].local.dirents = NULL;
+            break;
+        }
+        started += 1;
+    }
+    if(started == 0){
+        //no threads to be had, do the walk on this one
+        workers[0].queue = &queue;
+        workers[0].keep = keep;
+        workers[0].arg = arg;
+        workers[0].local.dirents = malloc(DENTS_SIZE);
+        if(workers[0].local.dirents != NULL){
+            walkWorker(&workers[0]);
+            started = 1;
+        }
+    }
+    else{
+        for(int i = 0; i < started; i++){
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    //merge the sorted per worker lists, few enough to scan for the smallest
+    long handed = 0;
+    size_t *next = calloc(threads, sizeof(size_t));
+    if(queue.failed || (next == NULL)){
+        handed = -1;
+    }
+    while(handed >= 0){
+        int best = -1;
+        for(int i = 0; i < started; i++){
+            if(next[i] < workers[i].local.count){
+                if((best < 0) || (strcmp(workers[i].local.entries[next[i]].path,
+                                         workers[best].local.entries[next[best]].path) < 0)){
+                    best = i;
+                }
+            }
+        }
+        if(best < 0){
+            break;
+        }
+        struct walkEntry *entry = &workers[best].local.entries[next[best]++];
+        callback(entry->path, entry->isDir, arg);
+        handed += 1;
+    }
+
+    free(next);
+    for(int i = 0; i < threads; i++){
+        freeLocal(&workers[i].local);
+    }
+    free(workers);
+    free(queue.dirs);
+    free(root);
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.more);
+    return handed;
+}